@@ -0,0 +1,164 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "admit.h"
+
+/*
+ *  A check takes as many slots as it will keep CPUs busy (its weight).
+ *  Waiting checks are kept in a queue, each with a condition variable of
+ *  its own. Slots that are given back go to the checks at the head of
+ *  the queue as soon as there are enough for them, and a newcomer only
+ *  goes straight in if nobody is waiting, so it can never overtake those
+ *  already waiting. A check that waits too long takes itself out of the
+ *  queue.
+ */
+
+struct waiter {
+    pthread_cond_t cond;
+    long weight;
+    int admitted;
+    struct waiter *next;
+};
+
+struct admit {
+    pthread_mutex_t lock;
+    long slots;				/* in all */
+    long free;				/* slots not in use */
+    long wait;				/* milliseconds */
+    struct waiter *head, **tail;
+};
+
+/*
+ *  Create a controller of slots slots (0: one per CPU), checks that do
+ *  not get theirs at once waiting up to wait milliseconds (0: not at
+ *  all). Returns NULL if out of memory.
+ */
+
+struct admit *admit_create(long slots, long wait) {
+    struct admit *a;
+
+    if ((a = calloc(1, sizeof(*a))) == NULL) return(NULL);
+
+    if (slots <= 0) slots = sysconf(_SC_NPROCESSORS_ONLN);
+    if (slots <= 0) slots = 1;
+
+    pthread_mutex_init(&a->lock, NULL);
+
+    a->slots = a->free = slots;
+    a->wait = wait;
+    a->head = NULL;
+    a->tail = &a->head;
+
+    return(a);
+}
+
+/* A check's weight, from one slot up to all of them. */
+
+static long weigh(struct admit *a, long weight) {
+    return((weight < 1) ? 1 : (weight > a->slots) ? a->slots : weight);
+}
+
+/* Let in the checks at the head of the queue that there are slots for. */
+
+static void grant(struct admit *a) {
+    struct waiter *w;
+
+    while (((w = a->head) != NULL) && (a->free >= w->weight)) {
+	if ((a->head = w->next) == NULL) a->tail = &a->head;
+
+	a->free -= w->weight;
+
+	w->admitted = 1;
+	pthread_cond_signal(&w->cond);
+    }
+}
+
+/*
+ *  Wait for weight slots. Returns 0 once the caller has them (and must
+ *  give them back with admit_leave()), or -1 if it did not get them in
+ *  time. A weight above the number of slots takes them all.
+ */
+
+int admit_enter(struct admit *a, long weight) {
+    pthread_condattr_t attr;
+    struct waiter w, **p;
+    struct timespec t;
+    int code = 0;
+
+    pthread_mutex_lock(&a->lock);
+
+    weight = weigh(a, weight);
+
+    if ((a->head == NULL) && (a->free >= weight)) {
+	a->free -= weight;
+	pthread_mutex_unlock(&a->lock);
+	return(0);
+    }
+
+    if (a->wait <= 0) {
+	pthread_mutex_unlock(&a->lock);
+	return(-1);
+    }
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&w.cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    w.weight = weight;
+    w.admitted = 0;
+    w.next = NULL;
+
+    *a->tail = &w;
+    a->tail = &w.next;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    t.tv_sec += a->wait / 1000;
+    t.tv_nsec += (a->wait % 1000) * 1000000;
+
+    if (t.tv_nsec >= 1000000000) {
+	t.tv_sec += 1;
+	t.tv_nsec -= 1000000000;
+    }
+
+    while (w.admitted == 0) {
+	if (pthread_cond_timedwait(&w.cond, &a->lock, &t) == ETIMEDOUT) break;
+    }
+
+    /*
+     *  Out of time (and not let in meanwhile): leave the queue, which may
+     *  let in those behind that there are enough slots for.
+     */
+
+    if (w.admitted == 0) {
+	for (p = &a->head; *p != &w; p = &(*p)->next);
+
+	if ((*p = w.next) == NULL) a->tail = p;
+
+	grant(a);
+
+	code = -1;
+    }
+
+    pthread_mutex_unlock(&a->lock);
+
+    pthread_cond_destroy(&w.cond);
+
+    return(code);
+}
+
+/* Give back the slots admit_enter() gave for weight. */
+
+void admit_leave(struct admit *a, long weight) {
+    pthread_mutex_lock(&a->lock);
+
+    a->free += weigh(a, weight);
+
+    grant(a);
+
+    pthread_mutex_unlock(&a->lock);
+}
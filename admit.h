@@ -0,0 +1,12 @@
+/*
+ *  Admission control shared by the password modules: checks take slots,
+ *  one for each CPU they keep busy, at most a given number are in use at
+ *  once, and the rest wait for a turn in order of arrival, giving up
+ *  after a bounded time.
+ */
+
+struct admit;
+
+extern struct admit *admit_create(long, long);
+extern int admit_enter(struct admit *, long);
+extern void admit_leave(struct admit *, long);
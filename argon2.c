@@ -0,0 +1,815 @@
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+
+#include "base64.h"
+#include "argon2.h"
+
+#define ARGON2_VERSION		0x13
+#define ARGON2_TYPE		2	/* Argon2id */
+#define ARGON2_SLICES		4
+#define ARGON2_WORDS		128	/* 64-bit words in a 1 KiB block */
+
+/* Bounds on the parameters of the hashes that are made or checked. */
+
+#define ARGON2_MAXMEMORY	(4 * 1024 * 1024)	/* KiB */
+#define ARGON2_MAXPASSES	64
+#define ARGON2_MAXLANES		64
+#define ARGON2_MAXSALT		64
+
+/* The standard alphabet, without padding. */
+
+static char Base64Code [] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+#define ROTR64(x, n)	(((x) >> (n)) | ((x) << (64 - (n))))
+
+static uint64_t load64(const unsigned char *s) {
+    uint64_t w = 0;
+    int n;
+
+    for (n = 7; n >= 0; n -= 1) w = (w << 8) | s[n];
+
+    return(w);
+}
+
+static void store64(unsigned char *s, uint64_t w) {
+    int n;
+
+    for (n = 0; n < 8; n += 1, w >>= 8) s[n] = w & 0xff;
+}
+
+static void store32(unsigned char *s, uint32_t w) {
+    int n;
+
+    for (n = 0; n < 4; n += 1, w >>= 8) s[n] = w & 0xff;
+}
+
+/*
+ *  BLAKE2b (RFC 7693), unkeyed, with any output length up to 64 bytes.
+ *  OpenSSL only offers the 64-byte one, and Argon2 needs shorter ones.
+ */
+
+typedef struct {
+    uint64_t h[8], t;
+    unsigned char buffer[128];
+    long n, outlen;
+} blake2b_ctx;
+
+static const uint64_t blake2b_iv[8] = {
+    0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL,
+    0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+    0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+    0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+};
+
+static const unsigned char sigma[12][16] = {
+    {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+    { 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
+    { 11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4 },
+    {  7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8 },
+    {  9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13 },
+    {  2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9 },
+    { 12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11 },
+    { 13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10 },
+    {  6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5 },
+    { 10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0 },
+    {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+    { 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 }
+};
+
+#define B2B_G(a, b, c, d, x, y) do {			\
+	a += b + (x); d = ROTR64(d ^ a, 32);		\
+	c += d; b = ROTR64(b ^ c, 24);			\
+	a += b + (y); d = ROTR64(d ^ a, 16);		\
+	c += d; b = ROTR64(b ^ c, 63);			\
+    } while (0)
+
+static void blake2b_compress(blake2b_ctx *c, int last) {
+    uint64_t v[16], m[16];
+    const unsigned char *s;
+    int i;
+
+    for (i = 0; i < 8; i += 1) {
+	v[i] = c->h[i];
+	v[i + 8] = blake2b_iv[i];
+    }
+
+    v[12] ^= c->t;
+
+    if (last) v[14] = ~v[14];
+
+    for (i = 0; i < 16; i += 1) m[i] = load64(&c->buffer[8 * i]);
+
+    for (i = 0; i < 12; i += 1) {
+	s = sigma[i];
+
+	B2B_G(v[0], v[4], v[8],  v[12], m[s[0]],  m[s[1]]);
+	B2B_G(v[1], v[5], v[9],  v[13], m[s[2]],  m[s[3]]);
+	B2B_G(v[2], v[6], v[10], v[14], m[s[4]],  m[s[5]]);
+	B2B_G(v[3], v[7], v[11], v[15], m[s[6]],  m[s[7]]);
+	B2B_G(v[0], v[5], v[10], v[15], m[s[8]],  m[s[9]]);
+	B2B_G(v[1], v[6], v[11], v[12], m[s[10]], m[s[11]]);
+	B2B_G(v[2], v[7], v[8],  v[13], m[s[12]], m[s[13]]);
+	B2B_G(v[3], v[4], v[9],  v[14], m[s[14]], m[s[15]]);
+    }
+
+    for (i = 0; i < 8; i += 1) c->h[i] ^= v[i] ^ v[i + 8];
+}
+
+static void blake2b_init(blake2b_ctx *c, long outlen) {
+    memcpy(c->h, blake2b_iv, sizeof(c->h));
+
+    c->h[0] ^= 0x01010000 ^ outlen;
+    c->t = 0;
+    c->n = 0;
+    c->outlen = outlen;
+}
+
+static void blake2b_update(blake2b_ctx *c, const void *in, long n) {
+    const unsigned char *s = in;
+    long k;
+
+    while (n > 0) {
+	if (c->n == sizeof(c->buffer)) {
+	    c->t += c->n;
+	    blake2b_compress(c, 0);
+	    c->n = 0;
+	}
+
+	k = sizeof(c->buffer) - c->n;
+	if (k > n) k = n;
+
+	memcpy(&c->buffer[c->n], s, k);
+
+	c->n += k;
+	s += k;
+	n -= k;
+    }
+}
+
+static void blake2b_final(blake2b_ctx *c, unsigned char *out) {
+    unsigned char h[64];
+    int i;
+
+    c->t += c->n;
+    memset(&c->buffer[c->n], 0, sizeof(c->buffer) - c->n);
+
+    blake2b_compress(c, 1);
+
+    for (i = 0; i < 8; i += 1) store64(&h[8 * i], c->h[i]);
+
+    memcpy(out, h, c->outlen);
+}
+
+static void blake2b(unsigned char *out, long outlen, const void *in, long n) {
+    blake2b_ctx c;
+
+    blake2b_init(&c, outlen);
+    blake2b_update(&c, in, n);
+    blake2b_final(&c, out);
+}
+
+/* The variable-length hash H' of Argon2 (RFC 9106, section 3.3). */
+
+static void argon2_hash(unsigned char *out, long outlen,
+    const unsigned char *in, long n) {
+    unsigned char v[64], length[4];
+    blake2b_ctx c;
+    long m;
+
+    store32(length, outlen);
+
+    blake2b_init(&c, (outlen < 64) ? outlen : 64);
+    blake2b_update(&c, length, sizeof(length));
+    blake2b_update(&c, in, n);
+    blake2b_final(&c, v);
+
+    if (outlen <= 64) {
+	memcpy(out, v, outlen);
+	return;
+    }
+
+    memcpy(out, v, 32);
+
+    for (m = 32; (outlen - m) > 64; m += 32) {
+	blake2b(v, 64, v, 64);
+	memcpy(&out[m], v, 32);
+    }
+
+    blake2b(&out[m], outlen - m, v, 64);
+}
+
+/*
+ *  The compression function G: next (^)= P(prev ^ ref) ^ prev ^ ref, P
+ *  being the BLAKE2b round (with multiplications) applied to the rows
+ *  and then the columns of the block seen as 8 x 8 pairs of words.
+ */
+
+#define FBLAMKA(x, y)	\
+    ((x) + (y) + 2 * ((x) & 0xffffffff) * ((y) & 0xffffffff))
+
+#define ARGON2_G(a, b, c, d) do {				\
+	a = FBLAMKA(a, b); d = ROTR64(d ^ a, 32);		\
+	c = FBLAMKA(c, d); b = ROTR64(b ^ c, 24);		\
+	a = FBLAMKA(a, b); d = ROTR64(d ^ a, 16);		\
+	c = FBLAMKA(c, d); b = ROTR64(b ^ c, 63);		\
+    } while (0)
+
+#define ARGON2_P(v0, v1, v2, v3, v4, v5, v6, v7, v8, v9, v10, v11, v12,	\
+    v13, v14, v15) do {							\
+	ARGON2_G(v0, v4, v8, v12); ARGON2_G(v1, v5, v9, v13);		\
+	ARGON2_G(v2, v6, v10, v14); ARGON2_G(v3, v7, v11, v15);		\
+	ARGON2_G(v0, v5, v10, v15); ARGON2_G(v1, v6, v11, v12);		\
+	ARGON2_G(v2, v7, v8, v13); ARGON2_G(v3, v4, v9, v14);		\
+    } while (0)
+
+static void argon2_fill(const uint64_t *prev, const uint64_t *ref,
+    uint64_t *next, int xor) {
+    uint64_t R[ARGON2_WORDS], Z[ARGON2_WORDS];
+    uint64_t *z;
+    int i;
+
+    for (i = 0; i < ARGON2_WORDS; i += 1) Z[i] = R[i] = prev[i] ^ ref[i];
+
+    for (i = 0; i < 8; i += 1) {
+	z = &Z[16 * i];
+
+	ARGON2_P(z[0], z[1], z[2], z[3], z[4], z[5], z[6], z[7],
+	    z[8], z[9], z[10], z[11], z[12], z[13], z[14], z[15]);
+    }
+
+    for (i = 0; i < 8; i += 1) {
+	z = &Z[2 * i];
+
+	ARGON2_P(z[0], z[1], z[16], z[17], z[32], z[33], z[48], z[49],
+	    z[64], z[65], z[80], z[81], z[96], z[97], z[112], z[113]);
+    }
+
+    if (xor) {
+	for (i = 0; i < ARGON2_WORDS; i += 1) next[i] ^= R[i] ^ Z[i];
+    } else {
+	for (i = 0; i < ARGON2_WORDS; i += 1) next[i] = R[i] ^ Z[i];
+    }
+}
+
+/* The memory of one hash, of lanes rows of columns blocks. */
+
+struct argon2 {
+    uint64_t (*memory)[ARGON2_WORDS];
+    long blocks, lanes, columns, segment, passes;
+};
+
+/* The next block of addresses, for data-independent indexing. */
+
+static void argon2_addresses(uint64_t *address, uint64_t *input) {
+    static const uint64_t zero[ARGON2_WORDS];
+
+    input[6] += 1;
+
+    argon2_fill(zero, input, address, 0);
+    argon2_fill(zero, address, address, 0);
+}
+
+/*
+ *  Fill one lane's segment of a slice of a pass. The first half of the
+ *  first pass takes its reference blocks from addresses that depend only
+ *  on the position (Argon2i), the rest from the previous block (Argon2d).
+ */
+
+static void argon2_segment(struct argon2 *a, long pass, long slice,
+    long lane) {
+    uint64_t address[ARGON2_WORDS], input[ARGON2_WORDS];
+    uint64_t area, r, x;
+    long column, current, previous, start, i = 0, l;
+    int independent;
+
+    independent = (pass == 0) && (slice < ARGON2_SLICES / 2);
+
+    if (independent) {
+	memset(input, 0, sizeof(input));
+
+	input[0] = pass;
+	input[1] = lane;
+	input[2] = slice;
+	input[3] = a->blocks;
+	input[4] = a->passes;
+	input[5] = ARGON2_TYPE;
+    }
+
+    /* The first two blocks of each lane are made from the password. */
+
+    if ((pass == 0) && (slice == 0)) {
+	i = 2;
+	if (independent) argon2_addresses(address, input);
+    }
+
+    start = ((pass == 0) || (slice == ARGON2_SLICES - 1)) ? 0 :
+	(slice + 1) * a->segment;
+
+    for (; i < a->segment; i += 1) {
+	column = (slice * a->segment) + i;
+	current = (lane * a->columns) + column;
+	previous = (column == 0) ? current + a->columns - 1 : current - 1;
+
+	if (independent) {
+	    if ((i % ARGON2_WORDS) == 0) argon2_addresses(address, input);
+	    r = address[i % ARGON2_WORDS];
+	} else {
+	    r = a->memory[previous][0];
+	}
+
+	l = ((pass == 0) && (slice == 0)) ? lane : (r >> 32) % a->lanes;
+
+	/* The blocks that may be referenced, and which of them is. */
+
+	area = (pass == 0) ? slice * a->segment : a->columns - a->segment;
+
+	if (l == lane) {
+	    area += i - 1;
+	} else if (i == 0) {
+	    area -= 1;
+	}
+
+	x = r & 0xffffffff;
+	x = (x * x) >> 32;
+	x = area - 1 - ((area * x) >> 32);
+
+	argon2_fill(a->memory[previous],
+	    a->memory[(l * a->columns) + ((start + x) % a->columns)],
+	    a->memory[current], pass > 0);
+    }
+}
+
+/*
+ *  The threads filling the lanes of one hash. Each fills its own lane's
+ *  segment of every slice of every pass in turn: the caller announces a
+ *  slice (step) and waits until all the threads (working) are through
+ *  it, as the next slice may reference any block of this one.
+ */
+
+struct argon2_crew {
+    struct argon2 *a;
+    pthread_mutex_t lock;
+    pthread_cond_t go, done;
+    long pass, slice, step, working;
+    int stop;
+};
+
+struct argon2_job {
+    struct argon2_crew *crew;
+    long lane;
+};
+
+static void *argon2_lane(void *arg) {
+    struct argon2_job *j = arg;
+    struct argon2_crew *c = j->crew;
+    long pass, slice, step = 0;
+
+    for (;;) {
+	pthread_mutex_lock(&c->lock);
+
+	while (c->step == step) pthread_cond_wait(&c->go, &c->lock);
+
+	step = c->step;
+	pass = c->pass;
+	slice = c->slice;
+
+	if (c->stop) {
+	    pthread_mutex_unlock(&c->lock);
+	    break;
+	}
+
+	pthread_mutex_unlock(&c->lock);
+
+	argon2_segment(c->a, pass, slice, j->lane);
+
+	pthread_mutex_lock(&c->lock);
+
+	if ((c->working -= 1) == 0) pthread_cond_signal(&c->done);
+
+	pthread_mutex_unlock(&c->lock);
+    }
+
+    return(NULL);
+}
+
+/*
+ *  Fill every slice of every pass, with a thread for each lane beyond
+ *  the first (which the caller fills), started once for the whole hash.
+ *  Lanes whose thread cannot be started are left to the caller too.
+ */
+
+static void argon2_passes(struct argon2 *a) {
+    struct argon2_job job[ARGON2_MAXLANES];
+    pthread_t thread[ARGON2_MAXLANES];
+    struct argon2_crew c;
+    long l, threads, pass, slice;
+
+    memset(&c, 0, sizeof(c));
+
+    c.a = a;
+
+    pthread_mutex_init(&c.lock, NULL);
+    pthread_cond_init(&c.go, NULL);
+    pthread_cond_init(&c.done, NULL);
+
+    for (threads = 1; threads < a->lanes; threads += 1) {
+	job[threads] = (struct argon2_job){ &c, threads };
+
+	if (pthread_create(&thread[threads], NULL, argon2_lane,
+	    &job[threads])) {
+	    break;
+	}
+    }
+
+    for (pass = 0; pass < a->passes; pass += 1) {
+	for (slice = 0; slice < ARGON2_SLICES; slice += 1) {
+	    pthread_mutex_lock(&c.lock);
+
+	    c.pass = pass;
+	    c.slice = slice;
+	    c.working = threads - 1;
+	    c.step += 1;
+
+	    pthread_cond_broadcast(&c.go);
+	    pthread_mutex_unlock(&c.lock);
+
+	    argon2_segment(a, pass, slice, 0);
+
+	    for (l = threads; l < a->lanes; l += 1) {
+		argon2_segment(a, pass, slice, l);
+	    }
+
+	    pthread_mutex_lock(&c.lock);
+
+	    while (c.working > 0) pthread_cond_wait(&c.done, &c.lock);
+
+	    pthread_mutex_unlock(&c.lock);
+	}
+    }
+
+    pthread_mutex_lock(&c.lock);
+
+    c.stop = 1;
+    c.step += 1;
+
+    pthread_cond_broadcast(&c.go);
+    pthread_mutex_unlock(&c.lock);
+
+    for (l = 1; l < threads; l += 1) pthread_join(thread[l], NULL);
+
+    pthread_cond_destroy(&c.done);
+    pthread_cond_destroy(&c.go);
+    pthread_mutex_destroy(&c.lock);
+}
+
+/*
+ *  Raw Argon2id of password with salt, memory KiB, passes and lanes into
+ *  a tag of taglen bytes. Returns 0, or -1 with errno set if a parameter
+ *  is out of bounds or the memory cannot be had.
+ */
+
+int argon2id(const char *password, const unsigned char *salt, long saltlen,
+    long memory, long passes, long lanes, unsigned char *tag, long taglen)
+{
+    unsigned char h0[64 + 8], block[ARGON2_WORDS * 8], word[4];
+    struct argon2 a;
+    blake2b_ctx c;
+    long n, l, i;
+
+    errno = EINVAL;
+
+    if ((lanes < 1) || (lanes > ARGON2_MAXLANES) || (passes < 1) ||
+	(passes > ARGON2_MAXPASSES) || (memory < 8 * lanes) ||
+	(memory > ARGON2_MAXMEMORY) || (saltlen < 8) ||
+	(saltlen > ARGON2_MAXSALT) || (taglen < 4) || (taglen > 64)) {
+	return(-1);
+    }
+
+    a.lanes = lanes;
+    a.passes = passes;
+    a.segment = memory / (ARGON2_SLICES * lanes);
+    a.columns = a.segment * ARGON2_SLICES;
+    a.blocks = a.columns * lanes;
+
+    errno = ENOMEM;
+
+    if ((a.memory = malloc(a.blocks * sizeof(*a.memory))) == NULL) return(-1);
+
+    /* H0, from the parameters, the password and the salt. */
+
+    blake2b_init(&c, 64);
+
+    store32(word, lanes);
+    blake2b_update(&c, word, 4);
+    store32(word, taglen);
+    blake2b_update(&c, word, 4);
+    store32(word, memory);
+    blake2b_update(&c, word, 4);
+    store32(word, passes);
+    blake2b_update(&c, word, 4);
+    store32(word, ARGON2_VERSION);
+    blake2b_update(&c, word, 4);
+    store32(word, ARGON2_TYPE);
+    blake2b_update(&c, word, 4);
+    store32(word, strlen(password));
+    blake2b_update(&c, word, 4);
+    blake2b_update(&c, password, strlen(password));
+    store32(word, saltlen);
+    blake2b_update(&c, word, 4);
+    blake2b_update(&c, salt, saltlen);
+    store32(word, 0);
+    blake2b_update(&c, word, 4);	/* no secret */
+    blake2b_update(&c, word, 4);	/* no associated data */
+
+    blake2b_final(&c, h0);
+
+    for (l = 0; l < lanes; l += 1) {
+	for (n = 0; n < 2; n += 1) {
+	    store32(&h0[64], n);
+	    store32(&h0[68], l);
+
+	    argon2_hash(block, sizeof(block), h0, sizeof(h0));
+
+	    for (i = 0; i < ARGON2_WORDS; i += 1) {
+		a.memory[(l * a.columns) + n][i] = load64(&block[8 * i]);
+	    }
+	}
+    }
+
+    argon2_passes(&a);
+
+    /* The tag, from the last block of every lane. */
+
+    for (l = 1; l < lanes; l += 1) {
+	for (i = 0; i < ARGON2_WORDS; i += 1) {
+	    a.memory[a.columns - 1][i] ^=
+		a.memory[(l * a.columns) + a.columns - 1][i];
+	}
+    }
+
+    for (i = 0; i < ARGON2_WORDS; i += 1) {
+	store64(&block[8 * i], a.memory[a.columns - 1][i]);
+    }
+
+    argon2_hash(tag, taglen, block, sizeof(block));
+
+    OPENSSL_cleanse(h0, sizeof(h0));
+    OPENSSL_cleanse(block, sizeof(block));
+
+    free(a.memory);
+
+    errno = 0;
+
+    return(0);
+}
+
+/*
+ *  Hash password with a random salt into a caller-supplied buffer of size
+ *  bytes (at least ARGON2_HASHLEN + 1). Returns the length of the hash or
+ *  -1 with errno set.
+ */
+
+int argon2_hash_r(const char *password, long memory, long passes, long lanes,
+    char *hash, long size)
+{
+    unsigned char salt[ARGON2_SALTLEN], tag[ARGON2_TAGLEN];
+    long m, n;
+
+    errno = EINVAL;
+
+    if (size < ARGON2_HASHLEN + 1) return(-1);
+
+    errno = EIO;
+
+    if (RAND_bytes(salt, sizeof(salt)) != 1) return(-1);
+
+    if (argon2id(password, salt, sizeof(salt), memory, passes, lanes, tag,
+	sizeof(tag)) < 0) {
+	return(-1);
+    }
+
+    n = snprintf(hash, size, "$argon2id$v=%d$m=%ld,t=%ld,p=%ld$",
+	ARGON2_VERSION, memory, passes, lanes);
+
+    if ((m = Base64Encode(salt, sizeof(salt), &hash[n], size - n,
+	Base64Code)) < 0) {
+	return(-1);
+    }
+
+    n += m;
+    hash[n++] = '$';
+
+    if ((m = Base64Encode(tag, sizeof(tag), &hash[n], size - n,
+	Base64Code)) < 0) {
+	return(-1);
+    }
+
+    errno = 0;
+
+    return(n + m);
+}
+
+/*
+ *  The memory (KiB), passes and lanes hash was made with. Returns 0, or
+ *  -1 with errno set if it is not an Argon2id hash.
+ */
+
+int argon2_params(const char *hash, long *memory, long *passes, long *lanes)
+{
+    int version, n = 0;
+
+    errno = EINVAL;
+
+    if ((sscanf(hash, "$argon2id$v=%d$m=%ld,t=%ld,p=%ld$%n", &version,
+	memory, passes, lanes, &n) != 4) || (n == 0) ||
+	(version != ARGON2_VERSION)) {
+	return(-1);
+    }
+
+    errno = 0;
+
+    return(0);
+}
+
+/*
+ *  Check password against a hash, with the parameters and salt found in
+ *  it. Returns 0 if the password is right, -1 if it is not or the hash is
+ *  not valid (with errno set).
+ */
+
+int argon2_check(const char *password, const char *hash) {
+    unsigned char salt[ARGON2_MAXSALT], tag[64], check[64];
+    char encoded[ARGON2_HASHLEN + 64], *s;
+    long memory, passes, lanes, saltlen, taglen;
+    int version, n = 0;
+
+    errno = EINVAL;
+
+    if (strnlen(hash, sizeof(encoded)) == sizeof(encoded)) return(-1);
+
+    strcpy(encoded, hash);
+
+    if ((sscanf(encoded, "$argon2id$v=%d$m=%ld,t=%ld,p=%ld$%n", &version,
+	&memory, &passes, &lanes, &n) != 4) || (n == 0)) {
+	return(-1);
+    }
+
+    if (version != ARGON2_VERSION) return(-1);
+
+    if ((s = strchr(&encoded[n], '$')) == NULL) return(-1);
+
+    *s++ = '\0';
+
+    if ((saltlen = Base64Decode(&encoded[n], salt, sizeof(salt),
+	Base64Code)) < 0) {
+	return(-1);
+    }
+
+    if ((taglen = Base64Decode(s, tag, sizeof(tag), Base64Code)) < 0) {
+	return(-1);
+    }
+
+    if (argon2id(password, salt, saltlen, memory, passes, lanes, check,
+	taglen) < 0) {
+	return(-1);
+    }
+
+    errno = 0;
+
+    return(CRYPTO_memcmp(check, tag, taglen) ? -1 : 0);
+}
+
+#if defined(ARGON2_BENCH)
+
+/*
+ *  Compare the latency of Argon2id, with more and more lanes, against
+ *  bcrypt at the same cost in CPU time:
+ *
+ *	argon2_bench [<bcrypt cost> [<passes> [<lanes>]]]
+ *
+ *  The memory is chosen so that a single lane takes as much CPU time as
+ *  bcrypt does; more lanes then do the same work in less wall-clock
+ *  time, as long as there are CPUs for them. Build with
+ *
+ *	cc -O2 -DARGON2_BENCH -o argon2_bench argon2.c bcrypt.c blf.c \
+ *	    base64.c -lcrypto -lpthread
+ */
+
+#include <time.h>
+
+#include "bcrypt.h"
+
+#define RUNS	5
+
+static double seconds(clockid_t clock) {
+    struct timespec t;
+
+    clock_gettime(clock, &t);
+
+    return(t.tv_sec + (t.tv_nsec / 1e9));
+}
+
+/* Median wall-clock and CPU time of RUNS hashes (memory 0: bcrypt). */
+
+static void timed(int cost, long memory, long passes, long lanes,
+    double *wall, double *cpu) {
+    char salt[BCRYPT_SALTLEN + 1], hash[ARGON2_HASHLEN + 1];
+    double w[RUNS], c[RUNS], x;
+    int i, j;
+
+    bcrypt_gensalt_r(cost, salt, sizeof(salt));
+
+    for (i = 0; i < RUNS; i += 1) {
+	w[i] = seconds(CLOCK_MONOTONIC);
+	c[i] = seconds(CLOCK_PROCESS_CPUTIME_ID);
+
+	if (memory) {
+	    argon2_hash_r("benchmark", memory, passes, lanes, hash,
+		sizeof(hash));
+	} else {
+	    bcrypt_r("benchmark", salt, hash, sizeof(hash));
+	}
+
+	w[i] = seconds(CLOCK_MONOTONIC) - w[i];
+	c[i] = seconds(CLOCK_PROCESS_CPUTIME_ID) - c[i];
+
+	for (j = i; (j > 0) && (w[j - 1] > w[j]); j -= 1) {
+	    x = w[j]; w[j] = w[j - 1]; w[j - 1] = x;
+	}
+
+	for (j = i; (j > 0) && (c[j - 1] > c[j]); j -= 1) {
+	    x = c[j]; c[j] = c[j - 1]; c[j - 1] = x;
+	}
+    }
+
+    *wall = w[RUNS / 2] * 1000;
+    *cpu = c[RUNS / 2] * 1000;
+}
+
+int main(int n, char *v[]) {
+    long memory, passes, lanes, p, unit;
+    double wall, cpu, target;
+    char name[64];
+    int cost;
+
+    cost = (n > 1) ? atoi(v[1]) : 10;
+    passes = (n > 2) ? atol(v[2]) : ARGON2_PASSES;
+    lanes = (n > 3) ? atol(v[3]) : ARGON2_LANES;
+
+    if ((cost < 4) || (cost > 31) || (passes < 1) ||
+	(passes > ARGON2_MAXPASSES) || (lanes < 1) ||
+	(lanes > ARGON2_MAXLANES)) {
+	fprintf(stderr, "usage: %s [<bcrypt cost> [<passes> [<lanes>]]]\n",
+	    v[0]);
+	exit(1);
+    }
+
+    printf("%-32s %10s %10s\n", "scheme", "wall ms", "cpu ms");
+
+    timed(cost, 0, 0, 0, &wall, &cpu);
+    target = cpu;
+
+    snprintf(name, sizeof(name), "bcrypt cost %d", cost);
+    printf("%-32s %10.1f %10.1f\n", name, wall, cpu);
+
+    /*
+     *  Memory for one lane to take as long, in whole segments of all the
+     *  lanes: scaled from a first guess, then once more from the result.
+     */
+
+    unit = ARGON2_SLICES * lanes;
+    memory = 1024 * unit;
+
+    for (n = 0; n < 2; n += 1) {
+	timed(0, memory, passes, 1, &wall, &cpu);
+
+	memory = ((long)(memory * (target / cpu)) / unit) * unit;
+
+	if (memory < 2 * unit) memory = 2 * unit;
+	if (memory > ARGON2_MAXMEMORY) memory = ARGON2_MAXMEMORY;
+    }
+
+    for (p = 1; ; p = ((p * 2) < lanes) ? p * 2 : lanes) {
+	timed(0, memory, passes, p, &wall, &cpu);
+
+	snprintf(name, sizeof(name), "argon2id m=%ld,t=%ld,p=%ld", memory,
+	    passes, p);
+	printf("%-32s %10.1f %10.1f\n", name, wall, cpu);
+
+	if (p == lanes) break;
+    }
+
+    exit(0);
+}
+
+#endif
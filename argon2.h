@@ -0,0 +1,25 @@
+/*
+ *  Argon2id (RFC 9106) password hashes, in the usual encoding
+ *
+ *	$argon2id$v=19$m=<KiB>,t=<passes>,p=<lanes>$<salt>$<tag>
+ *
+ *  (unpadded standard base64), so that the memory, passes and lanes a
+ *  hash was made with are kept in it. The lanes of one hash are filled
+ *  by as many threads, started once per hash.
+ */
+
+#define ARGON2_SALTLEN	16
+#define ARGON2_TAGLEN	32
+#define ARGON2_HASHLEN	127	/* longest hash argon2_hash_r() makes */
+
+/* Parameters of new hashes unless given: 64 MiB, 3 passes, 4 lanes. */
+
+#define ARGON2_MEMORY	65536
+#define ARGON2_PASSES	3
+#define ARGON2_LANES	4
+
+extern int argon2id(const char *, const unsigned char *, long, long, long,
+    long, unsigned char *, long);
+extern int argon2_hash_r(const char *, long, long, long, char *, long);
+extern int argon2_params(const char *, long *, long *, long *);
+extern int argon2_check(const char *, const char *);
@@ -59,179 +59,548 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define VECTOR
+#endif
+
+#include "base64.h"
 
 static const char Encode64[] =
     "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/=";
 
-#define Pad64	Encode64[64]
+/*
+ *  An alphabet: its 64 characters and padding character (0 for none),
+ *  and the tables derived from them, built once by Base64Alphabet() and
+ *  kept for the life of the process. Besides the plain decode table,
+ *  the alphabet is split into 16-entry tables for the vector kernels,
+ *  which look up 16 or 32 characters at once with pshufb: value to
+ *  character by value >> 4, and character to value (0x80 if it is not
+ *  in the alphabet) by character >> 4 for the 128 ASCII characters.
+ */
+
+struct base64 {
+    char encode[65];
+    signed char decode[256];
+    unsigned char lookup[4][16];
+    unsigned char reverse[8][16];
+    struct base64 *next;
+};
 
-int Base64Encode(unsigned char *src, long srclen, char *dst, long dstlen, char *table) {
-    unsigned char *d, *e, *s;
-    long n, m;
+static struct base64 *alphabets = NULL;
+static pthread_mutex_t alphabets_lock = PTHREAD_MUTEX_INITIALIZER;
 
-    if (table == NULL) table = (char *)Encode64;
+/*
+ *  The kernels to use: 0 for the scalar code alone, 1 for SSSE3, 2 for
+ *  AVX2, found from the CPU (and what the system saves for it) the first
+ *  time they are needed.
+ */
 
-    errno = EINVAL;
+#define KERNEL_SCALAR	0
+#define KERNEL_SSSE3	1
+#define KERNEL_AVX2	2
 
-    if ((n = ((srclen + 2) / 3) * 4) >= dstlen) return(-1);
+static int kernel = -1, kernels = KERNEL_SCALAR;
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
 
-    errno = 0;
+static void kernel_init(void) {
+#if defined(VECTOR)
+    unsigned int a, b, c, d, lo, hi;
 
-#if defined(OVERLAP)
-    if ((s = malloc(srclen)) == NULL) return(-1);
+    if (__get_cpuid(1, &a, &b, &c, &d) && (c & bit_SSSE3)) {
+	kernels = KERNEL_SSSE3;
 
-    memcpy(s, src, srclen);
+	/* AVX2 needs the OS to save the YMM registers (XCR0 bits 1, 2). */
 
-    src = s;
+	if ((c & bit_OSXSAVE) && (c & bit_AVX)) {
+	    __asm__ volatile ("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+
+	    if (((lo & 6) == 6) && __get_cpuid_count(7, 0, &a, &b, &c, &d) &&
+		(b & bit_AVX2)) {
+		kernels = KERNEL_AVX2;
+	    }
+	}
+    }
 #endif
 
-    memset(dst + n, 0, dstlen - n);
+    if (kernel < 0) kernel = kernels;
+}
+
+/*
+ *  Limit the kernels used to level (KERNEL_SCALAR and up; -1 for the
+ *  best the CPU has), e.g. to compare them. Returns the level in use.
+ */
+
+int Base64Kernel(int level) {
+    pthread_once(&kernel_once, kernel_init);
+
+    kernel = ((level < 0) || (level > kernels)) ? kernels : level;
 
-    s = (unsigned char *)src;
-    e = s + srclen;
+    return(kernel);
+}
+
+/* The codec for an alphabet (NULL for the standard one), or NULL. */
 
-    d = (unsigned char *)dst;
+struct base64 *Base64Alphabet(const char *table) {
+    struct base64 *b;
+    int n;
 
-    while ((e - s) > 2) {
-	m = (s[0] << 16) | (s[1] << 8) | s[2];
+    if (table == NULL) table = Encode64;
 
-	d[0] = table[(m >> 18) & 0x3f];
-	d[1] = table[(m >> 12) & 0x3f];
-	d[2] = table[(m >> 6) & 0x3f];
-	d[3] = table[m & 0x3f];
+    pthread_once(&kernel_once, kernel_init);
 
-	d += 4;
-	s += 3;
+    for (b = __atomic_load_n(&alphabets, __ATOMIC_ACQUIRE); b; b = b->next) {
+	if (memcmp(b->encode, table, 65) == 0) return(b);
     }
 
-    if (s < e) {
-	m = s[0] << 16;
+    pthread_mutex_lock(&alphabets_lock);
+
+    for (b = alphabets; b; b = b->next) {
+	if (memcmp(b->encode, table, 65) == 0) break;
+    }
 
-	d[0] = table[(m >> 18) & 0x3f];
+    if ((b == NULL) && ((b = calloc(1, sizeof(*b))) != NULL)) {
+	memcpy(b->encode, table, 65);
+	memset(b->decode, -1, sizeof(b->decode));
+	memset(b->reverse, 0x80, sizeof(b->reverse));
 
-	if ((e - s) == 2) {
-	    m |= (s[1] << 8);
-	    d[2] = table[(m >> 6) & 0x3f];
-	} else {
-	    d[2] = table[64];
+	for (n = 0; n < 64; n += 1) {
+	    b->decode[(unsigned char)table[n]] = n;
+	    b->lookup[n >> 4][n & 15] = table[n];
+
+	    if ((table[n] & 0x80) == 0) {
+		b->reverse[(table[n] >> 4) & 7][table[n] & 15] = n;
+	    }
 	}
 
-	d[1] = table[(m >> 12) & 0x3f];
-	d[3] = table[64];
+	b->next = alphabets;
 
-	if (table[64] == 0) n -= (3 - (e - s));
+	__atomic_store_n(&alphabets, b, __ATOMIC_RELEASE);
     }
 
-#if defined(OVERLAP)
-    free(src);
-#endif
+    pthread_mutex_unlock(&alphabets_lock);
 
-    return(n);
+    return(b);
 }
 
-static const char Decode64[] = {
-    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1, -1, 63,
-    52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -1, -1, -1,
-    -1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
-    15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
-    -1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
-    41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
-    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
-};
+#if defined(VECTOR)
 
-int Base64Decode(char *src, unsigned char *dst, long dstlen, char *table) {
-    char *decode, buffer[256];
-    unsigned char *d, *e, *s;
-    long m, n;
+/*
+ *  Vector kernels, after Muła and Lemire, "Faster Base64 Encoding and
+ *  Decoding Using AVX2 Instructions", but looking characters up through
+ *  the alphabet's tables rather than by the ranges of the standard one,
+ *  so any alphabet works. Each encodes 12 (24) bytes or decodes 16 (32)
+ *  characters at a time, returning how many bytes it used up; decoding
+ *  stops at the first block with a character not in the alphabet, which
+ *  is left to the scalar code.
+ */
+
+__attribute__((target("ssse3")))
+static long encode_ssse3(struct base64 *b, unsigned char *s, long n,
+    unsigned char *d)
+{
+    __m128i in, lo, hi, out, table[4];
+    unsigned char *start = s;
+    int k;
+
+    if (n < 16) return(0);
+
+    for (k = 0; k < 4; k += 1) {
+	table[k] = _mm_loadu_si128((__m128i *)b->lookup[k]);
+    }
 
-#if defined(OVERLAP)
-    unsigned char *t;
-#endif
+    for (; n >= 16; n -= 12, s += 12, d += 16) {
+	in = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)s),
+	    _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
 
-    if (table == NULL) {
-	decode = (char *)Decode64;
-	table = (char *)Encode64;
-    } else {
-	memset(decode = buffer, -1, sizeof(buffer));
+	lo = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)),
+	    _mm_set1_epi32(0x04000040));
+	hi = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)),
+	    _mm_set1_epi32(0x01000010));
+	in = _mm_or_si128(lo, hi);
 
-	for (n = 0; n < 64; n += 1) {
-	    decode[(int)table[n]] = n;
+	hi = _mm_and_si128(_mm_srli_epi16(in, 4), _mm_set1_epi8(15));
+
+	out = _mm_setzero_si128();
+
+	for (k = 0; k < 4; k += 1) {
+	    out = _mm_or_si128(out, _mm_and_si128(_mm_shuffle_epi8(table[k],
+		in), _mm_cmpeq_epi8(hi, _mm_set1_epi8(k))));
 	}
+
+	_mm_storeu_si128((__m128i *)d, out);
     }
 
-    errno = EINVAL;
+    return(s - start);
+}
 
-    s = (unsigned char *)src;
+__attribute__((target("ssse3")))
+static long decode_ssse3(struct base64 *b, unsigned char *s, long n,
+    unsigned char *d, long room)
+{
+    __m128i in, hi, out, table[8];
+    unsigned char *start = s;
+    int k;
 
-    for (e = s; (*e != 0) && (*e != table[64]); e += 1) {
-	if (decode[*e] < 0) return(-1);
+    if (n < 16) return(0);
+
+    for (k = 0; k < 8; k += 1) {
+	table[k] = _mm_loadu_si128((__m128i *)b->reverse[k]);
     }
 
-    if (table[64] == 0) {
-	n = (((e - s + 3) / 4) * 4) - (e - s);
-    } else {
-	if ((n = ((e[0] == table[64]) ? 1 : 0))) {
-	    if (e[1] == table[64]) n = 2;
+    for (; (n >= 16) && (room >= 16); n -= 16, room -= 12, s += 16, d += 12) {
+	in = _mm_loadu_si128((__m128i *)s);
+	hi = _mm_and_si128(_mm_srli_epi16(in, 4), _mm_set1_epi8(15));
+
+	out = _mm_setzero_si128();
+
+	for (k = 0; k < 8; k += 1) {
+	    out = _mm_or_si128(out, _mm_and_si128(_mm_shuffle_epi8(table[k],
+		in), _mm_cmpeq_epi8(hi, _mm_set1_epi8(k))));
 	}
 
-	if ((e[n]) || ((e - s + n) % 4)) return(-1);
+	if (_mm_movemask_epi8(_mm_or_si128(in, out))) break;
+
+	out = _mm_maddubs_epi16(out, _mm_set1_epi32(0x01400140));
+	out = _mm_madd_epi16(out, _mm_set1_epi32(0x00011000));
+	out = _mm_shuffle_epi8(out, _mm_set_epi8(-1, -1, -1, -1, 12, 13, 14,
+	    8, 9, 10, 4, 5, 6, 0, 1, 2));
+
+	_mm_storeu_si128((__m128i *)d, out);
     }
 
-    if (((n = (((e - s + n) / 4) * 3) - n) > dstlen)) return(-1);
+    return(s - start);
+}
 
-    errno = 0;
+__attribute__((target("avx2")))
+static long encode_avx2(struct base64 *b, unsigned char *s, long n,
+    unsigned char *d)
+{
+    __m256i in, lo, hi, out, table[4];
+    unsigned char *start = s;
+    int k;
 
-    d = (unsigned char *)dst;
+    if (n < 28) return(0);
 
-#if defined(OVERLAP)
-    if ((t = malloc(n)) == NULL) return(-1);
+    for (k = 0; k < 4; k += 1) {
+	table[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128(
+	    (__m128i *)b->lookup[k]));
+    }
 
-    d = t;
-#endif
+    for (; n >= 28; n -= 24, s += 24, d += 32) {
+	in = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128(
+	    (__m128i *)s)), _mm_loadu_si128((__m128i *)(s + 12)), 1);
+	in = _mm256_shuffle_epi8(in, _mm256_set_epi8(
+	    10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+	    10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+
+	lo = _mm256_mulhi_epu16(_mm256_and_si256(in,
+	    _mm256_set1_epi32(0x0fc0fc00)), _mm256_set1_epi32(0x04000040));
+	hi = _mm256_mullo_epi16(_mm256_and_si256(in,
+	    _mm256_set1_epi32(0x003f03f0)), _mm256_set1_epi32(0x01000010));
+	in = _mm256_or_si256(lo, hi);
+
+	hi = _mm256_and_si256(_mm256_srli_epi16(in, 4), _mm256_set1_epi8(15));
+
+	out = _mm256_setzero_si256();
+
+	for (k = 0; k < 4; k += 1) {
+	    out = _mm256_or_si256(out, _mm256_and_si256(_mm256_shuffle_epi8(
+		table[k], in), _mm256_cmpeq_epi8(hi, _mm256_set1_epi8(k))));
+	}
+
+	_mm256_storeu_si256((__m256i *)d, out);
+    }
 
-    while ((e - s) > 3) {
-	m = (decode[s[0]] << 18) | (decode[s[1]] << 12) |
-	    (decode[s[2]] << 6) | decode[s[3]];
+    return(s - start);
+}
+
+__attribute__((target("avx2")))
+static long decode_avx2(struct base64 *b, unsigned char *s, long n,
+    unsigned char *d, long room)
+{
+    __m256i in, hi, out, table[8];
+    unsigned char *start = s;
+    int k;
 
-	d[0] = (m >> 16) & 0xff;
-	d[1] = (m >> 8) & 0xff;
-	d[2] = m & 0xff;
+    if (n < 32) return(0);
 
-	d += 3;
-	s += 4;
+    for (k = 0; k < 8; k += 1) {
+	table[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128(
+	    (__m128i *)b->reverse[k]));
     }
 
-    if (s < e) {
-	m = (decode[s[0]] << 18) | (decode[s[1]] << 12);
+    for (; (n >= 32) && (room >= 28); n -= 32, room -= 24, s += 32, d += 24) {
+	in = _mm256_loadu_si256((__m256i *)s);
+	hi = _mm256_and_si256(_mm256_srli_epi16(in, 4), _mm256_set1_epi8(15));
+
+	out = _mm256_setzero_si256();
+
+	for (k = 0; k < 8; k += 1) {
+	    out = _mm256_or_si256(out, _mm256_and_si256(_mm256_shuffle_epi8(
+		table[k], in), _mm256_cmpeq_epi8(hi, _mm256_set1_epi8(k))));
+	}
+
+	if (_mm256_movemask_epi8(_mm256_or_si256(in, out))) break;
+
+	out = _mm256_maddubs_epi16(out, _mm256_set1_epi32(0x01400140));
+	out = _mm256_madd_epi16(out, _mm256_set1_epi32(0x00011000));
+	out = _mm256_shuffle_epi8(out, _mm256_set_epi8(
+	    -1, -1, -1, -1, 12, 13, 14, 8, 9, 10, 4, 5, 6, 0, 1, 2,
+	    -1, -1, -1, -1, 12, 13, 14, 8, 9, 10, 4, 5, 6, 0, 1, 2));
+
+	_mm_storeu_si128((__m128i *)d, _mm256_castsi256_si128(out));
+	_mm_storeu_si128((__m128i *)(d + 12), _mm256_extracti128_si256(out, 1));
+    }
+
+    return(s - start);
+}
+
+#endif
+
+/* Encode 3 bytes into 4 characters. */
+
+static inline void encode_block(struct base64 *b, unsigned char *s,
+    unsigned char *d)
+{
+    long m = (s[0] << 16) | (s[1] << 8) | s[2];
+
+    d[0] = b->encode[(m >> 18) & 0x3f];
+    d[1] = b->encode[(m >> 12) & 0x3f];
+    d[2] = b->encode[(m >> 6) & 0x3f];
+    d[3] = b->encode[m & 0x3f];
+}
+
+/*
+ *  Decode 4 characters into 3 bytes. Returns a negative value, leaving d
+ *  alone, if one is not valid (decodes to -1, which must not be shifted).
+ */
+
+static inline int decode_block(struct base64 *b, unsigned char *s,
+    unsigned char *d)
+{
+    int c0 = b->decode[s[0]], c1 = b->decode[s[1]];
+    int c2 = b->decode[s[2]], c3 = b->decode[s[3]];
+    long m;
+
+    if ((c0 | c1 | c2 | c3) < 0) return(-1);
 
-	d[0] = (m >> 16) & 0xff;
+    m = (c0 << 18) | (c1 << 12) | (c2 << 6) | c3;
 
-	if ((e - s) == 3) {
-	    m |= (decode[s[2]] << 6);
-	    d[1] = (m >> 8) & 0xff;
+    d[0] = (m >> 16) & 0xff;
+    d[1] = (m >> 8) & 0xff;
+    d[2] = m & 0xff;
+
+    return(0);
+}
+
+/* Encode group k (of 3 bytes, or the last 1 or 2) into 4 characters. */
+
+static void encode_group(struct base64 *b, unsigned char *src, long srclen,
+    unsigned char *dst, long k)
+{
+    unsigned char *s = src + (k * 3), *d = dst + (k * 4);
+    long m, n = srclen - (k * 3);
+
+    m = s[0] << 16;
+
+    if (n > 1) m |= s[1] << 8;
+    if (n > 2) m |= s[2];
+
+    d[0] = b->encode[(m >> 18) & 0x3f];
+    d[1] = b->encode[(m >> 12) & 0x3f];
+    d[2] = (n > 1) ? b->encode[(m >> 6) & 0x3f] : b->encode[64];
+    d[3] = (n > 2) ? b->encode[m & 0x3f] : b->encode[64];
+}
+
+/*
+ *  Decode group k (of 4 characters, or the last 2 or 3) into 3 bytes (1
+ *  or 2). Returns a negative value, writing nothing, if a character is
+ *  not in the alphabet.
+ */
+
+static int decode_group(struct base64 *b, unsigned char *src, long srclen,
+    unsigned char *dst, long k)
+{
+    unsigned char *s = src + (k * 4), *d = dst + (k * 3);
+    long n = srclen - (k * 4);
+    int c0, c1, c2 = 0, c3 = 0;
+    long m;
+
+    if (n < 2) return(0);
+
+    c0 = b->decode[s[0]];
+    c1 = b->decode[s[1]];
+
+    if (n > 2) c2 = b->decode[s[2]];
+    if (n > 3) c3 = b->decode[s[3]];
+
+    if ((c0 | c1 | c2 | c3) < 0) return(-1);
+
+    m = (c0 << 18) | (c1 << 12) | (c2 << 6) | c3;
+
+    d[0] = (m >> 16) & 0xff;
+
+    if (n > 2) d[1] = (m >> 8) & 0xff;
+    if (n > 3) d[2] = m & 0xff;
+
+    return(0);
+}
+
+/*
+ *  Encode srclen bytes at src into dstlen bytes at dst. Returns the
+ *  length of the encoded string, which is NUL padded to dstlen, or -1
+ *  with errno set.
+ *
+ *  Source and destination may overlap. Groups are then encoded in an
+ *  order that reads each one before it is written over: from the end
+ *  down to the group that dst catches up with, then from the start.
+ */
+
+int Base64EncodeWith(struct base64 *b, unsigned char *src, long srclen,
+    char *dst, long dstlen)
+{
+    unsigned char *d = (unsigned char *)dst;
+    long g, k, n, groups, done = 0;
+
+    errno = ENOMEM;
+
+    if (b == NULL) return(-1);
+
+    errno = EINVAL;
+
+    if ((n = ((srclen + 2) / 3) * 4) >= dstlen) return(-1);
+
+    errno = 0;
+
+    groups = (srclen + 2) / 3;
+
+    if ((d < src + srclen) && (src < d + n)) {
+	g = (d < src) ? (src - d) : 0;
+
+	if (g > groups) g = groups;
+
+	for (k = groups - 1; k >= g; k -= 1) encode_group(b, src, srclen, d, k);
+	for (k = 0; k < g; k += 1) encode_group(b, src, srclen, d, k);
+    } else {
+#if defined(VECTOR)
+	if (kernel >= KERNEL_AVX2) {
+	    done += encode_avx2(b, src, srclen, d);
+	}
+
+	if (kernel >= KERNEL_SSSE3) {
+	    done += encode_ssse3(b, src + done, srclen - done,
+		d + (done / 3) * 4);
 	}
+#endif
+
+	for (k = done / 3; k < srclen / 3; k += 1) {
+	    encode_block(b, src + (k * 3), d + (k * 4));
+	}
+
+	if (srclen % 3) encode_group(b, src, srclen, d, k);
     }
 
+    if ((srclen % 3) && (b->encode[64] == 0)) n -= 3 - (srclen % 3);
+
     memset(dst + n, 0, dstlen - n);
 
-#if defined(OVERLAP)
-    memcpy(dst, t, n);
+    return(n);
+}
+
+/*
+ *  Decode the NUL terminated string at src into dstlen bytes at dst.
+ *  Returns the number of bytes decoded, the rest of dst being zeroed, or
+ *  -1 with errno set if src is not valid in the alphabet. Source and
+ *  destination may overlap: groups are then decoded from the one that
+ *  dst has fallen behind onwards, then from there back to the start.
+ */
+
+int Base64DecodeWith(struct base64 *b, char *src, unsigned char *dst,
+    long dstlen)
+{
+    unsigned char *s = (unsigned char *)src;
+    long g, k, m, n, groups, done = 0;
+    int bad = 0;
+
+    errno = ENOMEM;
+
+    if (b == NULL) return(-1);
+
+    errno = EINVAL;
+
+    m = strlen(src);
+    n = 0;
+
+    if (b->encode[64] == 0) {
+	n = (((m + 3) / 4) * 4) - m;
+    } else {
+	while ((n < 2) && (m > 0) && (s[m - 1] == b->encode[64])) {
+	    m -= 1;
+	    n += 1;
+	}
+
+	if ((m + n) % 4) return(-1);
+    }
+
+    if (((n = (((m + n) / 4) * 3) - n) > dstlen)) return(-1);
+
+    groups = (m + 3) / 4;
+
+    if ((dst < s + m) && (s < dst + dstlen)) {
+	g = (dst > s) ? (dst - s) : 0;
+
+	if (g > groups) g = groups;
 
-    free(t);
+	for (k = g; (k < groups) && (bad == 0); k += 1) {
+	    bad = decode_group(b, s, m, dst, k);
+	}
+
+	for (k = g - 1; (k >= 0) && (bad == 0); k -= 1) {
+	    bad = decode_group(b, s, m, dst, k);
+	}
+    } else {
+#if defined(VECTOR)
+	if (kernel >= KERNEL_AVX2) {
+	    done += decode_avx2(b, s, m, dst, dstlen);
+	}
+
+	if (kernel >= KERNEL_SSSE3) {
+	    done += decode_ssse3(b, s + done, m - done, dst + (done / 4) * 3,
+		dstlen - (done / 4) * 3);
+	}
 #endif
 
+	for (k = done / 4; (k < m / 4) && (bad == 0); k += 1) {
+	    bad = decode_block(b, s + (k * 4), dst + (k * 3));
+	}
+
+	if ((m % 4) && (bad == 0)) bad = decode_group(b, s, m, dst, k);
+    }
+
+    if (bad < 0) return(-1);
+
+    errno = 0;
+
+    memset(dst + n, 0, dstlen - n);
+
     return(n);
 }
 
+int Base64Encode(unsigned char *src, long srclen, char *dst, long dstlen,
+    char *table)
+{
+    return(Base64EncodeWith(Base64Alphabet(table), src, srclen, dst, dstlen));
+}
+
+int Base64Decode(char *src, unsigned char *dst, long dstlen, char *table) {
+    return(Base64DecodeWith(Base64Alphabet(table), src, dst, dstlen));
+}
+
 #if defined(TEST)
 
 #include <stdio.h>
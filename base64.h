@@ -1,2 +1,17 @@
+/*
+ *  Base64 encoding and decoding with any alphabet of 64 characters and a
+ *  padding character (the 65th, 0 for none); NULL is the standard one.
+ *  Each alphabet's tables are built once, by Base64Alphabet().
+ */
+
+struct base64;
+
+extern struct base64 *Base64Alphabet(const char *);
+extern int Base64Kernel(int);
+
+extern int Base64EncodeWith(struct base64 *, unsigned char *, long, char *,
+    long);
+extern int Base64DecodeWith(struct base64 *, char *, unsigned char *, long);
+
 extern int Base64Encode(unsigned char *, long, char *, long, char *);
 extern int Base64Decode(char *, unsigned char *, long, char *);
@@ -4,90 +4,302 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
+
+#if defined(__linux__)
+#include <sys/random.h>
+#endif
 
 #include <openssl/rand.h>
-#include <openssl/rand.h>
+#include <openssl/err.h>
+#include <openssl/crypto.h>
 
 #include "blf.h"
+#include "bcrypt.h"
 
-#define BCRYPT_BLOCKS		6
 #define BCRYPT_MINLOGROUNDS	4
-#define BCRYPT_MINROUNDS	(1 << BCRYPT_MINLOGROUNDS)
+#define BCRYPT_MAXLOGROUNDS	31
 #define BCRYPT_VERSION		'2'
 
-#define SALT_MAXLEN	16
+/* Number of base64 characters holding the raw salt. */
+
+#define BCRYPT_SALT_CHARS	((BCRYPT_SALT_MAXLEN * 4 + 2) / 3)
+
+/* Number of base64 characters holding the digest. */
+
+#define BCRYPT_DIGEST_CHARS	((BCRYPT_DIGESTLEN * 4 + 2) / 3)
+
+/* Number of stored hashes each thread keeps decoded (bcrypt_check()). */
+
+#define BCRYPT_DECODED		4
 
 static char Base64Code [] =
     "./ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
 
-#define SALTLEN	((((SALT_MAXLEN + 2) / 3) * 4) + 7)
+static char ciphertext0[BCRYPT_BLOCKS * 4 + 1] = "OrpheanBeholderScryDoubt";
 
-char *bcrypt_gensalt(unsigned char n) {
-    static char salt[SALTLEN + 1];
+/* The codec for Base64Code, set up once. */
+
+static struct base64 *base64 = NULL;
+static pthread_once_t base64_once = PTHREAD_ONCE_INIT;
+
+static void base64_init(void) {
+    base64 = Base64Alphabet(Base64Code);
+}
+
+static struct base64 *bcrypt_base64(void) {
+    pthread_once(&base64_once, base64_init);
+
+    return(base64);
+}
+
+/*
+ *  Per-thread entropy pool for salts. Each thread refills its own buffer
+ *  in ENTROPY_POOLSIZE chunks, so handing out a salt needs neither a lock
+ *  nor a system call. A fork handler bumps a generation counter so that
+ *  a child never reuses the bytes its parent had already buffered.
+ */
+
+#define ENTROPY_POOLSIZE	4096
+
+static __thread struct {
+    unsigned char buffer[ENTROPY_POOLSIZE];
+    unsigned long generation;
+    long used;
+} pool = { .used = ENTROPY_POOLSIZE };
 
-    unsigned char seed[SALT_MAXLEN];
+static unsigned long generation = 1;
+
+static pthread_once_t entropy_once = PTHREAD_ONCE_INIT;
+
+static void entropy_forked(void) {
+    generation += 1;
+}
+
+static void entropy_init(void) {
+    pthread_atfork(NULL, NULL, entropy_forked);
+}
+
+static int entropy_fill(unsigned char *s, long n) {
+#if defined(__linux__)
     long m;
 
+    while (n > 0) {
+	if ((m = getrandom(s, n, 0)) < 0) {
+	    if (errno == EINTR) continue;
+	    break;
+	}
+
+	s += m;
+	n -= m;
+    }
+
+    if (n == 0) return(0);
+#endif
+
+    return((RAND_bytes(s, n) > 0) ? 0 : -1);
+}
+
+static int entropy_get(unsigned char *s, long n) {
+    pthread_once(&entropy_once, entropy_init);
+
+    if (pool.generation != generation) {
+	pool.generation = generation;
+	pool.used = ENTROPY_POOLSIZE;
+    }
+
+    if (pool.used + n > ENTROPY_POOLSIZE) {
+	if (entropy_fill(pool.buffer, ENTROPY_POOLSIZE) < 0) return(-1);
+
+	pool.used = 0;
+    }
+
+    memcpy(s, &pool.buffer[pool.used], n);
+    memset(&pool.buffer[pool.used], 0, n);
+
+    pool.used += n;
+
+    return(0);
+}
+
+/*
+ *  Reentrant salt generation into a caller-supplied buffer of size bytes
+ *  (at least BCRYPT_SALTLEN + 1). Returns the length of the salt or -1
+ *  with errno set.
+ */
+
+int bcrypt_gensalt_r(unsigned char n, char *salt, long size) {
+    unsigned char seed[BCRYPT_SALT_MAXLEN];
+    long m;
+
+    errno = EINVAL;
+
+    if (size < BCRYPT_SALTLEN + 1) return(-1);
+
     if (n < BCRYPT_MINLOGROUNDS) n = BCRYPT_MINLOGROUNDS;
+    if (n > BCRYPT_MAXLOGROUNDS) n = BCRYPT_MAXLOGROUNDS;
+
+    errno = EIO;
+
+    if (entropy_get(seed, sizeof(seed)) < 0) return(-1);
+
+    errno = 0;
+
+    m = snprintf(salt, size, "$%ca$%2.2u$", BCRYPT_VERSION, n);
+
+    return(m + Base64EncodeWith(bcrypt_base64(), seed, BCRYPT_SALT_MAXLEN,
+	&salt[m], size - m));
+}
+
+char *bcrypt_gensalt(unsigned char n) {
+    static char salt[BCRYPT_SALTLEN + 1];
 
-    if (RAND_bytes(seed, sizeof(seed)) <= 0) {
+    if (bcrypt_gensalt_r(n, salt, sizeof(salt)) < 0) {
 	fprintf(stderr, "RAND error: %s\n", ERR_error_string(ERR_get_error(),
 	    NULL));
 	exit(1);
     }
 
-    m = snprintf(salt, sizeof(salt), "$%ca$%2.2u$", BCRYPT_VERSION, n);
-
-    Base64Encode(seed, SALT_MAXLEN, &salt[m], sizeof(salt) - m, Base64Code);
-
     return(salt);
 }
 
-#define HASHLEN	(SALTLEN + (((BCRYPT_BLOCKS * 4 - 1 + 2) / 3) * 4))
+/*
+ *  Parse the "$2a$NN$<salt>" prefix of a salt or of a complete hash. The
+ *  raw salt is decoded into buffer, and the cost NN (two digits, from 04
+ *  to 31) turned into 2^NN rounds. Returns the length of the prefix
+ *  (which is copied as-is into the resulting hash) or -1 with errno set
+ *  if the string is not a valid bcrypt salt.
+ */
 
-char *bcrypt(const char *password, const char *salt) {
-    static char hash[HASHLEN + 1];
-
-    unsigned char ciphertext[BCRYPT_BLOCKS * 4] = "OrpheanBeholderScryDoubt";
-    unsigned char buffer[SALT_MAXLEN];
-    char minor, *s = (char *)salt;
-    long m, n, rounds;
-    blf_key context;
+static long bcrypt_parse(const char *salt, unsigned char *buffer, char *minor,
+    unsigned long *rounds)
+{
+    char encoded[BCRYPT_SALT_CHARS + 1], *s = (char *)salt;
+    int cost;
 
     errno = EINVAL;
 
-    if (*s++ != '$') return(NULL);
+    /* The prefix is read below as fixed positions; make sure it is there. */
+
+    if (strnlen(salt, 7) != 7) return(-1);
+
+    if (*s++ != '$') return(-1);
 
-    if (*s++ > BCRYPT_VERSION) return(NULL);
+    if (*s++ > BCRYPT_VERSION) return(-1);
 
     if (*s == '$') {
-	minor = 0;
+	*minor = 0;
     } else {
-	if (*s++ != 'a') return(NULL);
-	minor = 'a';
+	if (*s++ != 'a') return(-1);
+	*minor = 'a';
+    }
+
+    if ((*s++ != '$') || (s[2] != '$')) return(-1);
+
+    if ((s[0] < '0') || (s[0] > '9') || (s[1] < '0') || (s[1] > '9')) {
+	return(-1);
     }
 
-    if ((*s++ != '$') || (s[2] != '$')) return(NULL);
+    cost = ((s[0] - '0') * 10) + (s[1] - '0');
 
-    if ((rounds = (1 << atoi(s))) < BCRYPT_MINROUNDS) return(NULL);
+    if ((cost < BCRYPT_MINLOGROUNDS) || (cost > BCRYPT_MAXLOGROUNDS)) {
+	return(-1);
+    }
+
+    *rounds = 1UL << cost;
+
+    s += 3;
+
+    if (strnlen(s, BCRYPT_SALT_CHARS) != BCRYPT_SALT_CHARS) return(-1);
 
-    if (((strlen(s += 3) * 3) / 4) != SALT_MAXLEN) return(NULL);
+    memcpy(encoded, s, BCRYPT_SALT_CHARS);
+    encoded[BCRYPT_SALT_CHARS] = '\0';
+
+    if (Base64DecodeWith(bcrypt_base64(), encoded, buffer,
+	BCRYPT_SALT_MAXLEN) < 0) {
+	return(-1);
+    }
 
     errno = 0;
 
-    Base64Decode(s, buffer, SALT_MAXLEN, Base64Code);
+    return((s - salt) + BCRYPT_SALT_CHARS);
+}
+
+/* Build the final hash string from the salt prefix and the ciphertext. */
+
+static int bcrypt_format(char *hash, long size, const char *salt, long m,
+    unsigned char *ciphertext)
+{
+    long n;
+
+    n = snprintf(hash, size, "%.*s", (int)m, salt);
+
+    return(n + Base64EncodeWith(bcrypt_base64(), ciphertext,
+	BCRYPT_BLOCKS * 4 - 1, &hash[n], size - n));
+}
+
+/*
+ *  Encrypt "OrpheanBeholderScryDoubt" 64 times with the expanded key. The
+ *  three blocks are kept as words and encrypted interleaved.
+ */
+
+static void bcrypt_cipher(blf_key *context, unsigned char *ciphertext) {
+    uint32_t data[BCRYPT_BLOCKS];
+    unsigned char *s;
+    long n;
+
+    for (n = 0; n < BCRYPT_BLOCKS; n += 1) {
+	s = (unsigned char *)&ciphertext0[n * 4];
+	data[n] = ((uint32_t)s[0] << 24) | (s[1] << 16) | (s[2] << 8) | s[3];
+    }
+
+    for (n = 0; n < 64; n += 1)
+	blf_enc(context, data, BCRYPT_BLOCKS / 2);
+
+    for (n = 0; n < BCRYPT_BLOCKS; n += 1) {
+	s = &ciphertext[n * 4];
+	s[0] = (data[n] >> 24) & 0xff;
+	s[1] = (data[n] >> 16) & 0xff;
+	s[2] = (data[n] >> 8) & 0xff;
+	s[3] = data[n] & 0xff;
+    }
+}
+
+/*
+ *  Reentrant bcrypt into a caller-supplied buffer of size bytes (at least
+ *  BCRYPT_HASHLEN + 1). The key schedule lives on the caller's stack, so
+ *  this is safe to call from several threads at once. Returns the length
+ *  of the hash or -1 with errno set.
+ */
+
+int bcrypt_r(const char *password, const char *salt, char *hash, long size) {
+    unsigned char ciphertext[BCRYPT_BLOCKS * 4];
+    unsigned char buffer[BCRYPT_SALT_MAXLEN];
+    unsigned long rounds;
+    long m, n;
+    blf_key context;
+    char minor;
+
+    errno = EINVAL;
+
+    if (size < BCRYPT_HASHLEN + 1) return(-1);
+
+    if ((m = bcrypt_parse(salt, buffer, &minor, &rounds)) < 0) return(-1);
 
     n = strlen(password) + ((minor >= 'a') ? 1 : 0);
 
-    blf_eks_setup(&context, buffer, SALT_MAXLEN, (unsigned char *)password, n, rounds);
+    blf_eks_setup(&context, buffer, BCRYPT_SALT_MAXLEN,
+	(unsigned char *)password, n, rounds);
 
-    for (m = 0; m < 64; m += 1)
-	blf_ecb_encrypt(&context, ciphertext, BCRYPT_BLOCKS * 4);
+    bcrypt_cipher(&context, ciphertext);
 
-    n = snprintf(hash, sizeof(hash), "%s", salt);
+    return(bcrypt_format(hash, size, salt, m, ciphertext));
+}
+
+char *bcrypt(const char *password, const char *salt) {
+    static char hash[BCRYPT_HASHLEN + 1];
 
-    Base64Encode(ciphertext, BCRYPT_BLOCKS * 4 - 1, &hash[n], sizeof(hash) - n,
-	Base64Code);
+    if (bcrypt_r(password, salt, hash, sizeof(hash)) < 0) return(NULL);
 
     return(hash);
 }
@@ -95,3 +307,305 @@ char *bcrypt(const char *password, const char *salt) {
 char *blfhash(const char *password, const int n) {
     return(bcrypt(password, bcrypt_gensalt(n)));
 }
+
+/*
+ *  Decode a stored hash ("$2a$NN$<salt><digest>") into h, so that it can
+ *  be checked without any string work. Only the canonical encoding of
+ *  the digest is accepted, as only that can equal what bcrypt_r() would
+ *  produce. Returns 0, or -1 with errno set if it is not a valid hash.
+ */
+
+int bcrypt_decode(const char *hash, struct bcrypt_hash *h) {
+    char encoded[BCRYPT_DIGEST_CHARS + 1];
+    const char *s;
+    long m;
+
+    if ((m = bcrypt_parse(hash, h->salt, &h->minor, &h->rounds)) < 0) {
+	return(-1);
+    }
+
+    errno = EINVAL;
+
+    s = &hash[m];
+
+    if (strnlen(s, BCRYPT_DIGEST_CHARS + 1) != BCRYPT_DIGEST_CHARS) return(-1);
+
+    memcpy(encoded, s, BCRYPT_DIGEST_CHARS + 1);
+
+    if (Base64DecodeWith(bcrypt_base64(), encoded, h->digest,
+	BCRYPT_DIGESTLEN) < 0) return(-1);
+
+    /* The last character carries 2 bits of padding, which must be 0. */
+
+    if ((strchr(Base64Code, s[BCRYPT_DIGEST_CHARS - 1]) - Base64Code) & 3) {
+	errno = EINVAL;
+	return(-1);
+    }
+
+    errno = 0;
+
+    return(0);
+}
+
+/*
+ *  Hash password with a decoded hash's salt and cost, and compare the
+ *  raw digests in constant time. Returns 0 if they are the same, -1 if
+ *  not.
+ */
+
+int bcrypt_verify(const char *password, const struct bcrypt_hash *h) {
+    unsigned char ciphertext[BCRYPT_BLOCKS * 4];
+    blf_key context;
+    long n;
+
+    n = strlen(password) + ((h->minor >= 'a') ? 1 : 0);
+
+    blf_eks_setup(&context, (unsigned char *)h->salt, BCRYPT_SALT_MAXLEN,
+	(unsigned char *)password, n, h->rounds);
+
+    bcrypt_cipher(&context, ciphertext);
+
+    if (CRYPTO_memcmp(ciphertext, h->digest, BCRYPT_DIGESTLEN)) return(-1);
+
+    return(0);
+}
+
+/*
+ *  Check password against a stored hash. The last few hashes each thread
+ *  has seen are kept decoded, so a hash checked again (as when a user
+ *  binds repeatedly) is not decoded again. Returns 0 if the password is
+ *  right, -1 if it is not or the hash is not valid (with errno set).
+ */
+
+static __thread struct {
+    char hash[BCRYPT_HASHLEN + 1];
+    struct bcrypt_hash decoded;
+} decoded[BCRYPT_DECODED];
+
+static __thread int decoded_next = 0;
+
+int bcrypt_check(const char *password, const char *hash) {
+    struct bcrypt_hash *h = NULL;
+    int n;
+
+    errno = EINVAL;
+
+    if ((*hash != '$') || (strnlen(hash, BCRYPT_HASHLEN + 1) > BCRYPT_HASHLEN))
+	return(-1);
+
+    for (n = 0; n < BCRYPT_DECODED; n += 1) {
+	if (strcmp(decoded[n].hash, hash) == 0) {
+	    h = &decoded[n].decoded;
+	    break;
+	}
+    }
+
+    if (h == NULL) {
+	n = decoded_next;
+	decoded[n].hash[0] = '\0';
+
+	if (bcrypt_decode(hash, &decoded[n].decoded) < 0) return(-1);
+
+	strcpy(decoded[n].hash, hash);
+	h = &decoded[n].decoded;
+
+	decoded_next = (n + 1) % BCRYPT_DECODED;
+    }
+
+    errno = 0;
+
+    return(bcrypt_verify(password, h));
+}
+
+/* Hash the entries still waiting for a full set of lanes, one at a time. */
+
+static int bcrypt_flush(long l, long *index, const char **password,
+    const char **salt, char **hash, long size)
+{
+    int count = 0;
+    long m;
+
+    for (m = 0; m < l; m += 1) {
+	if (bcrypt_r(password[index[m]], salt[index[m]], hash[index[m]],
+	    size) < 0) {
+	    hash[index[m]][0] = '\0';
+	} else {
+	    count += 1;
+	}
+    }
+
+    return(count);
+}
+
+/*
+ *  Compute n hashes at once. Entries are hashed BLF_LANES at a time using
+ *  the multi-lane key schedule; consecutive entries with the same cost are
+ *  grouped together, and anything left over is hashed one at a time. Each
+ *  hash[i] must have room for size bytes (at least BCRYPT_HASHLEN + 1).
+ *  A salt may also be a complete hash, so stored values can be rehashed
+ *  for verification. Entries with an invalid salt get an empty hash.
+ *  Returns the number of hashes computed.
+ */
+
+int bcrypt_batch(long n, const char **password, const char **salt,
+    char **hash, long size)
+{
+    blf_key context[BLF_LANES];
+
+    unsigned char ciphertext[BLF_LANES][BCRYPT_BLOCKS * 4];
+    unsigned char buffer[BLF_LANES][BCRYPT_SALT_MAXLEN];
+    unsigned char *key[BLF_LANES], *data[BLF_LANES];
+    long keylen[BLF_LANES], datalen[BLF_LANES];
+    long index[BLF_LANES], prefix[BLF_LANES];
+    unsigned char raw[BCRYPT_SALT_MAXLEN];
+    unsigned long r, rounds = 0;
+    long i, l, m;
+    int count = 0;
+    char minor;
+
+    errno = EINVAL;
+
+    if (size < BCRYPT_HASHLEN + 1) return(-1);
+
+    errno = 0;
+
+    for (i = 0, l = 0; i < n; i += 1) {
+	if ((m = bcrypt_parse(salt[i], raw, &minor, &r)) < 0) {
+	    hash[i][0] = '\0';
+	    continue;
+	}
+
+	/* Lanes must share a cost, so a change of cost flushes them. */
+
+	if (l && (r != rounds)) {
+	    count += bcrypt_flush(l, index, password, salt, hash, size);
+	    l = 0;
+	}
+
+	rounds = r;
+	index[l] = i;
+	prefix[l] = m;
+
+	memcpy(buffer[l], raw, BCRYPT_SALT_MAXLEN);
+
+	key[l] = (unsigned char *)password[i];
+	keylen[l] = strlen(password[i]) + ((minor >= 'a') ? 1 : 0);
+	data[l] = buffer[l];
+	datalen[l] = BCRYPT_SALT_MAXLEN;
+
+	if ((l += 1) < BLF_LANES) continue;
+
+	blf_eks_setup_lanes(context, data, datalen, key, keylen, rounds);
+
+	for (l = 0; l < BLF_LANES; l += 1) {
+	    bcrypt_cipher(&context[l], ciphertext[l]);
+
+	    bcrypt_format(hash[index[l]], size, salt[index[l]], prefix[l],
+		ciphertext[l]);
+	}
+
+	count += BLF_LANES;
+	l = 0;
+    }
+
+    count += bcrypt_flush(l, index, password, salt, hash, size);
+
+    return(count);
+}
+
+#if defined(BENCH)
+
+#include <time.h>
+
+static double now(void) {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return(t.tv_sec + (t.tv_nsec / 1e9));
+}
+
+#define SALTS	200000
+
+/* Generate salts, either from the pool or straight from RAND_bytes(). */
+
+static void *salts(void *arg) {
+    unsigned char seed[BCRYPT_SALT_MAXLEN];
+    char salt[BCRYPT_SALTLEN + 1];
+    long n;
+
+    for (n = 0; n < SALTS; n += 1) {
+	if (arg) {
+	    RAND_bytes(seed, sizeof(seed));
+	} else {
+	    bcrypt_gensalt_r(8, salt, sizeof(salt));
+	}
+    }
+
+    return(NULL);
+}
+
+static void saltbench(int threads, void *arg) {
+    pthread_t thread[32];
+    double t;
+    int n;
+
+    t = now();
+
+    for (n = 0; n < threads; n += 1)
+	pthread_create(&thread[n], NULL, salts, arg);
+
+    for (n = 0; n < threads; n += 1)
+	pthread_join(thread[n], NULL);
+
+    t = now() - t;
+
+    printf("%2d threads %-10s %12.0f salts/sec\n", threads,
+	(arg) ? "RAND_bytes" : "pool", (threads * SALTS) / t);
+}
+
+/* Compare hashes/sec/core of bcrypt() with bcrypt_batch() at a given cost. */
+
+int main(int n, char *v[]) {
+    char *hash[BLF_LANES * 4], space[BLF_LANES * 4][BCRYPT_HASHLEN + 1];
+    const char *password[BLF_LANES * 4], *salt[BLF_LANES * 4];
+    char buffer[BLF_LANES * 4][16];
+    int cost, count, m;
+    double t;
+
+    cost = (n > 1) ? atoi(v[1]) : 8;
+    count = BLF_LANES * 4;
+
+    for (m = 0; m < count; m += 1) {
+	snprintf(buffer[m], sizeof(buffer[m]), "password%d", m);
+	password[m] = buffer[m];
+	salt[m] = strdup(bcrypt_gensalt(cost));
+	hash[m] = space[m];
+    }
+
+    t = now();
+
+    for (m = 0; m < count; m += 1) bcrypt(password[m], salt[m]);
+
+    t = now() - t;
+
+    printf("cost %d scalar: %8.2f hashes/sec/core\n", cost, count / t);
+
+    t = now();
+
+    bcrypt_batch(count, password, salt, hash, sizeof(space[0]));
+
+    t = now() - t;
+
+    printf("cost %d batch:  %8.2f hashes/sec/core (%d lanes)\n", cost,
+	count / t, BLF_LANES);
+
+    for (m = 1; m <= 32; m = (m == 1) ? 8 : m * 4) {
+	saltbench(m, "RAND_bytes");
+	saltbench(m, NULL);
+    }
+
+    exit(0);
+}
+
+#endif
@@ -0,0 +1,31 @@
+/* Sizes of the strings produced by bcrypt_gensalt() and bcrypt(). */
+
+#define BCRYPT_BLOCKS		6
+#define BCRYPT_SALT_MAXLEN	16
+
+#define BCRYPT_SALTLEN	((((BCRYPT_SALT_MAXLEN + 2) / 3) * 4) + 7)
+#define BCRYPT_HASHLEN	\
+    (BCRYPT_SALTLEN + (((BCRYPT_BLOCKS * 4 - 1 + 2) / 3) * 4))
+
+/* A stored hash, decoded once by bcrypt_decode(). */
+
+#define BCRYPT_DIGESTLEN	(BCRYPT_BLOCKS * 4 - 1)
+
+struct bcrypt_hash {
+    char minor;
+    unsigned long rounds;
+    unsigned char salt[BCRYPT_SALT_MAXLEN];
+    unsigned char digest[BCRYPT_DIGESTLEN];
+};
+
+extern int bcrypt_decode(const char *, struct bcrypt_hash *);
+extern int bcrypt_verify(const char *, const struct bcrypt_hash *);
+extern int bcrypt_check(const char *, const char *);
+
+extern int bcrypt_gensalt_r(unsigned char, char *, long);
+extern int bcrypt_r(const char *, const char *, char *, long);
+
+extern char *bcrypt_gensalt(unsigned char);
+extern char *bcrypt(const char *, const char *);
+extern char *blfhash(const char *, const int);
+extern int bcrypt_batch(long, const char **, const char **, char **, long);
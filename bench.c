@@ -0,0 +1,383 @@
+/*
+ *  Microbenchmarks for the Blowfish, bcrypt and base64 primitives.
+ *
+ *  usage: bench [<maximum cost> [<samples>]]
+ *
+ *  Each benchmark is warmed up, then timed over a number of samples, each
+ *  of enough operations to take at least SAMPLETIME (a single operation
+ *  if that is already longer, as for bcrypt at higher costs). The time
+ *  per operation is reported as the minimum, median, 90th and 99th
+ *  percentiles and maximum over the samples. Where the kernel allows it
+ *  (perf_event_open(2), see kernel.perf_event_paranoid), CPU cycles and
+ *  instructions spent in user mode are counted too, giving cycles per
+ *  operation and, for the bulk primitives, per byte. The base64 codec is
+ *  measured with each kernel the CPU has (scalar, SSSE3, AVX2), on bcrypt
+ *  sized strings and on large buffers. The results are written as JSON
+ *  to the standard output, to be kept and compared across builds and
+ *  machines, and as a table to the standard error.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#endif
+
+#include "blf.h"
+#include "bcrypt.h"
+
+#define SAMPLES		31
+#define SAMPLETIME	10000000	/* nanoseconds */
+#define WARMUP		100000000	/* nanoseconds */
+#define MAXCOST		10
+
+#define BULK		4096
+
+static unsigned char plain[BULK], cipher[BULK];
+static char encoded[((BULK + 2) / 3) * 4 + 1];
+
+static char *kernels[] = { "scalar", "ssse3", "avx2" };
+
+/* As in bcrypt.c: 16 bytes of salt, 23 of ciphertext. */
+
+static char bcrypt64[] =
+    "./ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
+
+static char salt64[] = "abcdefghijklmnopqrstuu";
+
+static blf_key key;
+static unsigned char iv[8];
+
+static char salt[BCRYPT_SALTLEN + 1], hash[BCRYPT_HASHLEN + 1];
+
+/* The benchmarks: run() does n operations of param (a cost, or bytes). */
+
+struct benchmark {
+    char *name;
+    void (*run)(long n, int param);
+    int param;
+    long bytes;
+    int kernel;			/* base64 kernel, -1 for the best */
+};
+
+static void ecb_encrypt(long n, int param) {
+    while (n-- > 0) blf_ecb_encrypt(&key, cipher, param);
+}
+
+static void cbc_encrypt(long n, int param) {
+    while (n-- > 0) blf_cbc_encrypt(&key, iv, cipher, param);
+}
+
+static void cbc_decrypt(long n, int param) {
+    while (n-- > 0) blf_cbc_decrypt(&key, iv, cipher, param);
+}
+
+static void ctr_crypt(long n, int param) {
+    while (n-- > 0) blf_ctr_crypt(&key, iv, 0, cipher, param);
+}
+
+static void eks_setup(long n, int param) {
+    unsigned char s[BCRYPT_SALT_MAXLEN];
+
+    memset(s, 0x5a, sizeof(s));
+
+    while (n-- > 0) {
+	blf_eks_setup(&key, s, sizeof(s), (unsigned char *)"password", 9,
+	    1 << param);
+    }
+}
+
+static void hash_cost(long n, int param) {
+    while (n-- > 0) bcrypt_r("password", salt, hash, sizeof(hash));
+}
+
+static void gensalt(long n, int param) {
+    char s[BCRYPT_SALTLEN + 1];
+
+    while (n-- > 0) bcrypt_gensalt_r(param, s, sizeof(s));
+}
+
+static void encode(long n, int param) {
+    while (n-- > 0) Base64Encode(plain, param, encoded, sizeof(encoded), NULL);
+}
+
+static void decode(long n, int param) {
+    while (n-- > 0) Base64Decode(encoded, cipher, sizeof(cipher), NULL);
+}
+
+static void encode_bcrypt(long n, int param) {
+    char s[64];
+
+    while (n-- > 0) Base64Encode(plain, param, s, sizeof(s), bcrypt64);
+}
+
+static void decode_bcrypt(long n, int param) {
+    while (n-- > 0) Base64Decode(salt64, cipher, 16, bcrypt64);
+}
+
+/* CPU counters, if the kernel lets us have them. */
+
+#define COUNTERS	2
+
+static int counter[COUNTERS] = { -1, -1 };
+static char *counted[COUNTERS] = { "cycles", "instructions" };
+
+static void counters_open(void) {
+#if defined(__linux__) && defined(SYS_perf_event_open)
+    struct perf_event_attr attr;
+    int n;
+
+    for (n = 0; n < COUNTERS; n += 1) {
+	memset(&attr, 0, sizeof(attr));
+
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = (n == 0) ? PERF_COUNT_HW_CPU_CYCLES :
+	    PERF_COUNT_HW_INSTRUCTIONS;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	counter[n] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+#endif
+}
+
+static void counters_read(long long *value) {
+    int n;
+
+    for (n = 0; n < COUNTERS; n += 1) {
+	if (counter[n] < 0) {
+	    value[n] = -1;
+	} else if (read(counter[n], &value[n], sizeof(*value)) != sizeof(*value)) {
+	    value[n] = -1;
+	}
+    }
+}
+
+static long long now(void) {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return((t.tv_sec * 1000000000LL) + t.tv_nsec);
+}
+
+static int compare(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return((x < y) ? -1 : (x > y));
+}
+
+/* Time one benchmark and print its results, as a JSON object. */
+
+static void measure(struct benchmark *b, int samples, int first) {
+    long long t, u, start[COUNTERS], end[COUNTERS], total[COUNTERS];
+    double ns[SAMPLES * 8], p50, p90, p99;
+    long n, iterations;
+    int m, k;
+
+    /* Warm up, and find how many operations make up a sample. */
+
+    iterations = 1;
+
+    for (t = now(); ; iterations *= 2) {
+	u = now();
+
+	b->run(iterations, b->param);
+
+	if ((now() - u >= SAMPLETIME) || (now() - t >= WARMUP)) break;
+    }
+
+    memset(total, 0, sizeof(total));
+
+    for (m = 0; m < samples; m += 1) {
+	counters_read(start);
+	t = now();
+
+	b->run(iterations, b->param);
+
+	ns[m] = (double)(now() - t) / iterations;
+	counters_read(end);
+
+	for (k = 0; k < COUNTERS; k += 1) {
+	    if ((start[k] < 0) || (end[k] < 0) || (total[k] < 0)) {
+		total[k] = -1;
+	    } else {
+		total[k] += end[k] - start[k];
+	    }
+	}
+    }
+
+    qsort(ns, samples, sizeof(*ns), compare);
+
+    p50 = ns[(samples - 1) / 2];
+    p90 = ns[((samples - 1) * 90) / 100];
+    p99 = ns[((samples - 1) * 99) / 100];
+
+    n = iterations * samples;
+
+    printf("%s\n    {\"name\": \"%s\", \"param\": %d, \"bytes\": %ld, "
+	"\"iterations\": %ld, \"samples\": %d,\n", (first) ? "" : ",",
+	b->name, b->param, b->bytes, iterations, samples);
+
+    if (b->kernel >= 0) {
+	printf("     \"kernel\": \"%s\",\n", kernels[b->kernel]);
+    }
+    printf("     \"ns\": {\"min\": %.1f, \"p50\": %.1f, \"p90\": %.1f, "
+	"\"p99\": %.1f, \"max\": %.1f}", ns[0], p50, p90, p99,
+	ns[samples - 1]);
+
+    if (b->bytes) {
+	printf(",\n     \"mb_per_s\": %.1f", (b->bytes * 1000.0) / p50);
+    }
+
+    for (k = 0; k < COUNTERS; k += 1) {
+	if (total[k] < 0) {
+	    printf(",\n     \"%s_per_op\": null", counted[k]);
+	} else {
+	    printf(",\n     \"%s_per_op\": %.1f", counted[k],
+		(double)total[k] / n);
+
+	    if (b->bytes) {
+		printf(", \"%s_per_byte\": %.2f", counted[k],
+		    (double)total[k] / n / b->bytes);
+	    }
+	}
+    }
+
+    printf("}");
+
+    fprintf(stderr, "%-15s %-6s %4d %12.1f %12.1f %12.1f %12.1f", b->name,
+	(b->kernel >= 0) ? kernels[b->kernel] : "", b->param, ns[0], p50, p90,
+	p99);
+
+    if (total[0] >= 0) {
+	fprintf(stderr, " %12.1f", (double)total[0] / n);
+	if (b->bytes) {
+	    fprintf(stderr, " %8.2f", (double)total[0] / n / b->bytes);
+	}
+    }
+
+    fprintf(stderr, "\n");
+}
+
+int main(int n, char *v[]) {
+    struct benchmark *list;
+    char cpu[256], line[256];
+    struct utsname host;
+    int cost, samples, m, k, best;
+    FILE *f;
+
+    cost = (n > 1) ? atoi(v[1]) : MAXCOST;
+    samples = (n > 2) ? atoi(v[2]) : SAMPLES;
+
+    if ((cost < 4) || (cost > 31) || (samples < 1) ||
+	(samples > SAMPLES * 8)) {
+	fprintf(stderr, "usage: %s [<maximum cost> [<samples>]]\n", v[0]);
+	exit(1);
+    }
+
+    memset(plain, 0xa5, sizeof(plain));
+    memset(cipher, 0xa5, sizeof(cipher));
+
+    blf_init(&key, (unsigned char *)"benchmark", 9);
+
+    Base64Encode(plain, BULK, encoded, sizeof(encoded), NULL);
+
+    best = Base64Kernel(-1);
+
+    /* Blowfish modes, base64 per kernel, gensalt and two per cost. */
+
+    if ((list = calloc(4 + 4 * (best + 1) + 1 + 2 * (cost - 3),
+	sizeof(*list))) == NULL) {
+	perror("calloc");
+	exit(1);
+    }
+
+    m = 0;
+
+    list[m++] = (struct benchmark){ "blf_ecb_encrypt", ecb_encrypt, BULK,
+	BULK, -1 };
+    list[m++] = (struct benchmark){ "blf_cbc_encrypt", cbc_encrypt, BULK,
+	BULK, -1 };
+    list[m++] = (struct benchmark){ "blf_cbc_decrypt", cbc_decrypt, BULK,
+	BULK, -1 };
+    list[m++] = (struct benchmark){ "blf_ctr_crypt", ctr_crypt, BULK,
+	BULK, -1 };
+
+    for (k = 0; k <= best; k += 1) {
+	list[m++] = (struct benchmark){ "Base64Encode", encode_bcrypt, 23, 23,
+	    k };
+	list[m++] = (struct benchmark){ "Base64Decode", decode_bcrypt, 22, 22,
+	    k };
+	list[m++] = (struct benchmark){ "Base64Encode", encode, BULK, BULK, k };
+	list[m++] = (struct benchmark){ "Base64Decode", decode, BULK, BULK, k };
+    }
+
+    list[m++] = (struct benchmark){ "bcrypt_gensalt", gensalt, 8, 0, -1 };
+
+    for (n = 4; n <= cost; n += 1) {
+	list[m++] = (struct benchmark){ "blf_eks_setup", eks_setup, n, 0, -1 };
+    }
+
+    for (n = 4; n <= cost; n += 1) {
+	list[m++] = (struct benchmark){ "bcrypt", hash_cost, n, 0, -1 };
+    }
+
+    counters_open();
+
+    /* Describe the machine and build, so results can be told apart. */
+
+    strcpy(cpu, "unknown");
+
+    if ((f = fopen("/proc/cpuinfo", "r")) != NULL) {
+	while (fgets(line, sizeof(line), f)) {
+	    if ((strncmp(line, "model name", 10) == 0) && strchr(line, ':')) {
+		strncpy(cpu, strchr(line, ':') + 2, sizeof(cpu) - 1);
+		cpu[strcspn(cpu, "\n\"\\")] = '\0';
+		break;
+	    }
+	}
+
+	fclose(f);
+    }
+
+    uname(&host);
+
+    printf("{\"host\": \"%s\", \"machine\": \"%s\", \"cpu\": \"%s\", "
+	"\"cpus\": %ld,\n", host.nodename, host.machine, cpu,
+	sysconf(_SC_NPROCESSORS_ONLN));
+    printf(" \"compiler\": \"%s\", \"blf_lanes\": %d, \"time\": %ld,\n",
+	__VERSION__, BLF_LANES, (long)time(NULL));
+    printf(" \"counters\": %s,\n \"benchmarks\": [",
+	(counter[0] < 0) ? "false" : "true");
+
+    fprintf(stderr, "%-22s %4s %12s %12s %12s %12s%s\n", "benchmark", "arg",
+	"min ns", "p50 ns", "p90 ns", "p99 ns",
+	(counter[0] < 0) ? "" : "   cycles/op  cyc/byte");
+
+    for (n = 0; n < m; n += 1) {
+
+	/* The bcrypt benchmarks need a salt of their cost. */
+
+	if (list[n].run == hash_cost) {
+	    bcrypt_gensalt_r(list[n].param, salt, sizeof(salt));
+	}
+
+	Base64Kernel(list[n].kernel);
+
+	measure(&list[n], samples, n == 0);
+    }
+
+    printf("\n ]}\n");
+
+    free(list);
+
+    exit(0);
+}
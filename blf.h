@@ -1,13 +1,39 @@
+#include <stdint.h>
+
 #include "base64.h"
 
 #define N	16
 
+/* Number of key schedules set up together by blf_eks_setup_lanes(). */
+
+#if ! defined(BLF_LANES)
+    #define BLF_LANES	4
+#endif
+
+/* Number of blocks the bulk modes keep in flight (see blf_ctr_crypt()). */
+
+#if ! defined(BLF_BLOCKS)
+    #define BLF_BLOCKS	8
+#endif
+
+/* Blowfish words are 32 bits; keep the schedule compact and cache-aligned. */
+
+#define BLF_ALIGN	__attribute__((aligned(64)))
+
 typedef struct {
-    unsigned long P[N + 2];
-    unsigned long S[4][256];
-} blf_key;
+    uint32_t S[4][256];
+    uint32_t P[N + 2];
+} BLF_ALIGN blf_key;
 
+void blf_cbc_decrypt(blf_key *, unsigned char *, unsigned char *, long);
+void blf_cbc_encrypt(blf_key *, unsigned char *, unsigned char *, long);
+void blf_ctr_crypt(blf_key *, const unsigned char *, uint64_t, unsigned char *,
+    long);
 void blf_ecb_decrypt(blf_key *, unsigned char *, long);
 void blf_ecb_encrypt(blf_key *, unsigned char *, long);
-void blf_eks_setup(blf_key *, unsigned char *, long,  unsigned char *, long, int);
+void blf_enc(blf_key *, uint32_t *, long);
+void blf_eks_setup(blf_key *, unsigned char *, long,  unsigned char *, long,
+    unsigned long);
+void blf_eks_setup_lanes(blf_key *, unsigned char **, long *, unsigned char **,
+    long *, unsigned long);
 void blf_init(blf_key *, unsigned char *, long);
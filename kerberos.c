@@ -4,9 +4,10 @@
 #include <krb5.h>
 
 #include "lutil.h"
+#include "pwstats.h"
+#include "krb5module.h"
 
-/* From <ldap_pvt.h> */
-LDAP_F (char *)ldap_pvt_get_fqdn LDAP_P((char *));
+#include "krb5_pw_validate.c"
 
 static LUTIL_PASSWD_CHK_FUNC chk_kerberos;
 
@@ -19,113 +20,135 @@ static struct berval scheme = {
 
 #include <syslog.h>
 
-static int chk_kerberos(
-    const struct berval *scheme,
-    const struct berval *passwd,
-    const struct berval *cred,
-    const char **text)
+/* Get and verify initial credentials for a principal and password. */
+
+static int verify( struct krb5_service *service, char *principal,
+    char *password )
 {
-    int n;
+    struct krb5_handle *h;
+    krb5_context context;
+    krb5_error_code ret;
+    krb5_creds creds;
+    krb5_get_init_creds_opt get_options;
+    krb5_verify_init_creds_opt verify_options;
+    krb5_principal client, server;
+    char host[KRB5_SERVICE_HOSTLEN];
+    krb5_keytab keytab;
+    int64_t start;
 
-    /* Make sure there are no NULL characters in credentials. */
+    start = pwstats_clock();
 
-    for (n = 0; n < cred->bv_len; n += 1) {
-	if (cred->bv_val[n] == '\0') {
-	    return(LUTIL_PASSWD_ERR);
-	}
-    }
+    ret = krb5_handle_get( &h );
 
-    /* Make sure that the credentials are NULL terminated. */
+    pwstats_add( PWSTATS_CONTEXT, pwstats_clock() - start );
 
-    if (cred->bv_val[n] != '\0') {
-	return(LUTIL_PASSWD_ERR);
+    if (ret) {
+	return ret;
     }
 
-    /* Make sure there are no NULL characters in password. */
+    context = h->context;
+
+    krb5_get_init_creds_opt_init( &get_options );
+
+    krb5_verify_init_creds_opt_init( &verify_options );
 
-    for (n = 0; n < passwd->bv_len; n += 1) {
-	if (passwd->bv_val[n] == '\0') {
-	    return(LUTIL_PASSWD_ERR);
-	}
+    ret = krb5_parse_name( context, principal, &client );
+
+    if (ret) {
+	krb5_handle_put( h );
+	return ret;
     }
 
-    /* Make sure that the password is NULL terminated. */
+    start = pwstats_clock();
+
+    ret = krb5_get_init_creds_password( context,
+	&creds, client, password, NULL,
+	NULL, 0, NULL, &get_options );
 
-    if (passwd->bv_val[n] != '\0') {
-	return(LUTIL_PASSWD_ERR);
+    pwstats_add( PWSTATS_INITCREDS, pwstats_clock() - start );
+
+    if (ret) {
+	krb5_free_principal( context, client );
+	krb5_handle_put( h );
+	return ret;
     }
 
-    {
-	krb5_context context;
-	krb5_error_code ret;
-	krb5_creds creds;
-	krb5_get_init_creds_opt get_options;
-	krb5_verify_init_creds_opt verify_options;
-	krb5_principal client, server;
+    krb5_service_host( service, host );
 
-	ret = krb5_init_context( &context );
-	if (ret) {
-	    return LUTIL_PASSWD_ERR;
-	}
+    start = pwstats_clock();
 
-	krb5_get_init_creds_opt_init( &get_options );
+    ret = krb5_handle_server( h, service->service, host, service->realm,
+	KRB5_NT_UNKNOWN, &server );
 
-	krb5_verify_init_creds_opt_init( &verify_options );
-    
-	ret = krb5_parse_name( context, passwd->bv_val, &client );
+    pwstats_add( PWSTATS_SERVER, pwstats_clock() - start );
+
+    if (ret == 0) {
+	start = pwstats_clock();
+
+	ret = krb5_handle_keytab( h, service->keytab, &keytab );
+
+	pwstats_add( PWSTATS_KEYTAB, pwstats_clock() - start );
+    }
 
-	if (ret) {
-	    krb5_free_context( context );
-	    return LUTIL_PASSWD_ERR;
-	}
+    if (ret) {
+	krb5_free_principal( context, client );
+	krb5_free_cred_contents( context, &creds );
+	krb5_handle_put( h );
+	return ret;
+    }
 
-	ret = krb5_get_init_creds_password( context,
-	    &creds, client, cred->bv_val, NULL,
-	    NULL, 0, NULL, &get_options );
+    start = pwstats_clock();
 
-	if (ret) {
-	    krb5_free_principal( context, client );
-	    krb5_free_context( context );
-	    return LUTIL_PASSWD_ERR;
-	}
+    ret = krb5_verify_init_creds( context, &creds,
+	server, keytab, NULL, &verify_options );
 
-	{
-	    char *host = ldap_pvt_get_fqdn( NULL );
+    pwstats_add( PWSTATS_VERIFY, pwstats_clock() - start );
 
-	    if( host == NULL ) {
-		krb5_free_principal( context, client );
-		krb5_free_context( context );
-		return LUTIL_PASSWD_ERR;
-	    }
+    krb5_free_principal( context, client );
+    krb5_free_cred_contents( context, &creds );
+    krb5_handle_put( h );
 
-	    ret = krb5_sname_to_principal( context, host,
-		"ldap", KRB5_NT_SRV_HST, &server );
+    return ret;
+}
 
-	    ber_memfree( host );
-	}
+/*
+ *  Service, cache, throttle, engine and statistics (see init_module()
+ *  below). Whether a KDC that cannot be verified fails the check is left
+ *  to krb5.conf.
+ */
 
-	if (ret) {
-	    krb5_free_principal( context, client );
-	    krb5_free_context( context );
-	    return LUTIL_PASSWD_ERR;
-	}
+static struct krb5_service service = KRB5_SERVICE_DEFAULT;
 
-	ret = krb5_verify_init_creds( context, &creds,
-	    server, NULL, NULL, &verify_options );
+static struct krb5_module module =
+    KRB5_MODULE_DEFAULT( scheme, service, verify, -1 );
 
-	krb5_free_principal( context, client );
-	krb5_free_principal( context, server );
-	krb5_free_cred_contents( context, &creds );
-	krb5_free_context( context );
+static int chk_kerberos(
+    const struct berval *scheme,
+    const struct berval *passwd,
+    const struct berval *cred,
+    const char **text)
+{
+    return(krb5_module_check( &module, passwd, cred ));
+}
 
-	if (ret) {
-	    return LUTIL_PASSWD_ERR;
-	}
-    }
+/*
+ *  Report cache hits and misses, throttled checks, and checks that led a
+ *  flight or joined one (see coalesce=).
+ */
 
-    return LUTIL_PASSWD_OK;
+void kerberos_stats(unsigned long *hits, unsigned long *misses,
+    unsigned long *throttled, unsigned long *flights, unsigned long *joined)
+{
+    krb5_module_stats( &module, hits, misses, throttled, flights, joined );
 }
 
+/*
+ *  Module arguments (e.g. "moduleload pw-kerberos.so cache-size=10000")
+ *  are those of krb5_module_init().
+ */
+
 int init_module(int argc, char *argv[]) {
-    return lutil_passwd_add(&scheme, chk_kerberos, NULL);
+    if (krb5_module_init( &module, argc, argv )) return(-1);
+
+    return lutil_passwd_add( &scheme, chk_kerberos, NULL );
 }
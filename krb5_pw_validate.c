@@ -1,10 +1,286 @@
 #include <stdio.h>
+#include <string.h>
 #include <strings.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <time.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include <krb5.h>
 
+/* Programs built without statistics (-DNOSTATS) time nothing; modules   */
+/* that keep them include pwstats.h first.                               */
+
+#if defined(NOSTATS)
+#define pwstats_clock()		0
+#define pwstats_add(phase, ns)	((void)(ns))
+#endif
+
+/* krb5_handle:                                                          */
+/*                                                                       */
+/* Each thread keeps one initialized Kerberos context, together with the */
+/* keytab and service principal it last used, and reuses them for every  */
+/* validation instead of re-reading krb5.conf and re-resolving the       */
+/* keytab each time. At most krb5_handle_max handles are kept; threads   */
+/* beyond that get a temporary handle that is freed after use. A handle  */
+/* is rebuilt when krb5.conf or its keytab file has been modified.       */
+
+#define KRB5_HANDLE_RECHECK	5
+
+struct krb5_handle {
+    krb5_context context;
+    krb5_keytab keytab;
+    krb5_principal server;
+    char *file, *service, *host, *realm;
+    int type;
+    char keytab_path[1024];
+    time_t conf_mtime, keytab_mtime, checked;
+    int temporary;
+};
+
+long krb5_handle_max = 64;
+
+static long krb5_handles = 0;
+
+static pthread_key_t krb5_handle_key;
+static pthread_once_t krb5_handle_once = PTHREAD_ONCE_INIT;
+
+static time_t krb5_mtime(const char *path) {
+    struct stat st;
+
+    return((path && *path && (stat(path, &st) == 0)) ? st.st_mtime : 0);
+}
+
+/* First file in the krb5.conf search path. */
+
+static const char *krb5_conf_path(char *buffer, long n) {
+    char *s;
+
+    if ((s = getenv("KRB5_CONFIG")) == NULL) s = "/etc/krb5.conf";
+
+    snprintf(buffer, n, "%s", s);
+
+    if ((s = strchr(buffer, ':')) != NULL) *s = '\0';
+
+    return(buffer);
+}
+
+/* Path of a FILE: or WRFILE: keytab name, or empty if it has no file. */
+
+static void krb5_keytab_path(char *path, long n, const char *name) {
+    const char *s;
+
+    if ((s = strchr(name, ':')) == NULL) {
+	s = name;
+    } else if ((strncmp(name, "FILE:", 5) == 0) ||
+	(strncmp(name, "WRFILE:", 7) == 0)) {
+	s += 1;
+    } else {
+	s = "";
+    }
+
+    snprintf(path, n, "%s", s);
+}
+
+static void krb5_handle_free(struct krb5_handle *h) {
+    if (h->server) krb5_free_principal(h->context, h->server);
+    if (h->keytab) krb5_kt_close(h->context, h->keytab);
+
+    krb5_free_context(h->context);
+
+    free(h->file);
+    free(h->service);
+    free(h->host);
+    free(h->realm);
+
+    if (h->temporary == 0) __sync_fetch_and_sub(&krb5_handles, 1);
+
+    free(h);
+}
+
+static void krb5_handle_destroy(void *h) {
+    krb5_handle_free((struct krb5_handle *)h);
+}
+
+static void krb5_handle_init(void) {
+    pthread_key_create(&krb5_handle_key, krb5_handle_destroy);
+}
+
+static krb5_error_code krb5_handle_new(struct krb5_handle **hp) {
+    struct krb5_handle *h;
+    krb5_error_code code;
+    char path[1024];
+
+    if ((h = calloc(1, sizeof(*h))) == NULL) return(ENOMEM);
+
+    if ((code = krb5_init_context(&h->context))) {
+	free(h);
+	return(code);
+    }
+
+    h->conf_mtime = krb5_mtime(krb5_conf_path(path, sizeof(path)));
+    h->checked = time(NULL);
+
+    h->temporary = (__sync_add_and_fetch(&krb5_handles, 1) > krb5_handle_max);
+
+    if (h->temporary) __sync_fetch_and_sub(&krb5_handles, 1);
+
+    *hp = h;
+
+    return(0);
+}
+
+/* Get the calling thread's handle, rebuilding it if it is out of date. */
+
+static krb5_error_code krb5_handle_get(struct krb5_handle **hp) {
+    struct krb5_handle *h;
+    krb5_error_code code;
+    char path[1024];
+    time_t t;
+
+    pthread_once(&krb5_handle_once, krb5_handle_init);
+
+    if ((h = pthread_getspecific(krb5_handle_key)) != NULL) {
+	t = time(NULL);
+
+	if (t - h->checked < KRB5_HANDLE_RECHECK) {
+	    *hp = h;
+	    return(0);
+	}
+
+	h->checked = t;
+
+	if ((krb5_mtime(krb5_conf_path(path, sizeof(path))) == h->conf_mtime)
+	    && (krb5_mtime(h->keytab_path) == h->keytab_mtime)) {
+	    *hp = h;
+	    return(0);
+	}
+
+	pthread_setspecific(krb5_handle_key, NULL);
+	krb5_handle_free(h);
+    }
+
+    if ((code = krb5_handle_new(&h))) return(code);
+
+    if (h->temporary == 0) pthread_setspecific(krb5_handle_key, h);
+
+    *hp = h;
+
+    return(0);
+}
+
+/* Done with a handle; only temporary ones are actually freed. */
+
+static void krb5_handle_put(struct krb5_handle *h) {
+    if (h->temporary) krb5_handle_free(h);
+}
+
+static int krb5_same(const char *a, const char *b) {
+    return((a == NULL) ? (b == NULL) : ((b != NULL) && (strcmp(a, b) == 0)));
+}
+
+static char *krb5_strdup(const char *s) {
+    return((s) ? strdup(s) : NULL);
+}
+
+/* Keytab for file (or the default keytab), resolved once per handle. */
+
+static krb5_error_code krb5_handle_keytab(struct krb5_handle *h,
+    const char *file, krb5_keytab *keytab)
+{
+    krb5_error_code code;
+    char name[1024];
+
+    if (h->keytab && krb5_same(h->file, file)) {
+	*keytab = h->keytab;
+	return(0);
+    }
+
+    if (h->keytab) {
+	krb5_kt_close(h->context, h->keytab);
+	h->keytab = NULL;
+    }
+
+    free(h->file);
+    h->file = NULL;
+
+    if (file != NULL) {
+	code = krb5_kt_resolve(h->context, file, &h->keytab);
+    } else {
+	code = krb5_kt_default(h->context, &h->keytab);
+    }
+
+    if (code) {
+	h->keytab = NULL;
+	return(code);
+    }
+
+    h->file = krb5_strdup(file);
+
+    if (krb5_kt_get_name(h->context, h->keytab, name, sizeof(name)) == 0) {
+	krb5_keytab_path(h->keytab_path, sizeof(h->keytab_path), name);
+	h->keytab_mtime = krb5_mtime(h->keytab_path);
+    }
+
+    *keytab = h->keytab;
+
+    return(0);
+}
+
+/* Principal for service/host, built once per handle. Do not free it.  */
+/* With a realm the principal is built as is; otherwise the realm (and  */
+/* for KRB5_NT_SRV_HST, the canonical host name) come from Kerberos.    */
+
+static krb5_error_code krb5_handle_server(struct krb5_handle *h,
+    const char *service, const char *host, const char *realm, int type,
+    krb5_principal *server)
+{
+    krb5_error_code code;
+
+    if (h->server && krb5_same(h->service, service) &&
+	krb5_same(h->host, host) && krb5_same(h->realm, realm) &&
+	(h->type == type)) {
+	*server = h->server;
+	return(0);
+    }
+
+    if (h->server) {
+	krb5_free_principal(h->context, h->server);
+	h->server = NULL;
+    }
+
+    free(h->service);
+    free(h->host);
+    free(h->realm);
+    h->service = h->host = h->realm = NULL;
+
+    if ((realm != NULL) && (host != NULL)) {
+	code = krb5_build_principal(h->context, &h->server, strlen(realm),
+	    realm, service, host, (char *)NULL);
+    } else {
+	code = krb5_sname_to_principal(h->context, host, service, type,
+	    &h->server);
+    }
+
+    if (code) {
+	h->server = NULL;
+	return(code);
+    }
+
+    h->service = krb5_strdup(service);
+    h->host = krb5_strdup(host);
+    h->realm = krb5_strdup(realm);
+    h->type = type;
+
+    *server = h->server;
+
+    return(0);
+}
+
 /* krb5_pw_validate:                                                     */
 /*                                                                       */
 /* Routine to verify a password using Kerberos 5 and, optionally, verify */
@@ -27,16 +303,28 @@
 /*                                                                       */
 /* The user and password parameters may not be NULL.                     */
 
+static int krb5_pw_verify(char *user, char *password, char *service,
+    char *host, char *realm, int type, char *file);
+
 int krb5_pw_validate(char *user, char *password, char *service,
     char *host, char *file)
+{
+    return(krb5_pw_verify(user, password, service, host, NULL,
+	KRB5_NT_SRV_HST, file));
+}
+
+static int krb5_pw_verify(char *user, char *password, char *service,
+    char *host, char *realm, int type, char *file)
 {
     krb5_verify_init_creds_opt verify;
     krb5_get_init_creds_opt options;
     krb5_principal principal;
     krb5_creds credentials;
     krb5_principal server;
+    struct krb5_handle *h;
     krb5_context context;
     krb5_keytab keytab;
+    int64_t start;
 
     krb5_error_code code = 0;
 
@@ -49,16 +337,24 @@ int krb5_pw_validate(char *user, char *password, char *service,
     if ((password == NULL) || (*password == '\0')) return(EINVAL);
     if ((user == NULL) || (*user == '\0')) return(EINVAL);
 
-    /* Initialize Kerberos. */
+    /* Get this thread's Kerberos context. */
+
+    start = pwstats_clock();
+
+    code = krb5_handle_get(&h);
 
-    if (code = krb5_init_context(&context)) {
+    pwstats_add(PWSTATS_CONTEXT, pwstats_clock() - start);
+
+    if (code) {
 	return(code);
     }
 
+    context = h->context;
+
     /* Get principal for user. */
 
     if (code = krb5_parse_name(context, user, &principal)) {
-	krb5_free_context(context);
+	krb5_handle_put(h);
 	return(code);
     }
 
@@ -83,9 +379,13 @@ int krb5_pw_validate(char *user, char *password, char *service,
 
     /* Get ticket-granting ticket, no prompting for password. */
 
+    start = pwstats_clock();
+
     code = krb5_get_init_creds_password(context, &credentials, principal,
 	password, NULL, NULL, 0, NULL, &options);
 
+    pwstats_add(PWSTATS_INITCREDS, pwstats_clock() - start);
+
     if (code == KRB5KDC_ERR_KEY_EXP) {
 
 	/* Expired password. Try again with "change password" service. */
@@ -93,9 +393,13 @@ int krb5_pw_validate(char *user, char *password, char *service,
 	/* return "expired password". Otherwise, return whatever was   */
 	/* returned by Kerberos (likely "bad password").               */
 
+	start = pwstats_clock();
+
 	code = krb5_get_init_creds_password(context, &credentials, principal,
 	    password, NULL, NULL, 0, "kadmin/changepw", &options);
 
+	pwstats_add(PWSTATS_CHANGEPW, pwstats_clock() - start);
+
 	if (code == 0) {
 	    krb5_free_cred_contents(context, &credentials);
 
@@ -112,10 +416,13 @@ int krb5_pw_validate(char *user, char *password, char *service,
 	    krb5_verify_init_creds_opt_init(&verify);
 	    krb5_verify_init_creds_opt_set_ap_req_nofail(&verify, 1);
 
-	    /* Get principal for service. */
+	    /* Get (cached) principal for service. */
 
-	    code = krb5_sname_to_principal(context, host, service,
-		KRB5_NT_SRV_HST, &server);
+	    start = pwstats_clock();
+
+	    code = krb5_handle_server(h, service, host, realm, type, &server);
+
+	    pwstats_add(PWSTATS_SERVER, pwstats_clock() - start);
 
 	    if (code == 0) {
 #if defined(DEBUG)
@@ -125,23 +432,25 @@ int krb5_pw_validate(char *user, char *password, char *service,
 		}
 #endif
 
-		/* Set appropriate keytab file. */
+		/* Set appropriate (cached) keytab file. */
 
-		if (file != NULL) {
-		    code = krb5_kt_resolve(context, file, &keytab);
-		} else {
-		    code = krb5_kt_default(context, &keytab);
-		}
+		start = pwstats_clock();
+
+		code = krb5_handle_keytab(h, file, &keytab);
+
+		pwstats_add(PWSTATS_KEYTAB, pwstats_clock() - start);
 
 		if (code == 0) {
 
 		    /* Verify the credentials using the service principal. */
 
+		    start = pwstats_clock();
+
 		    code = krb5_verify_init_creds(context, &credentials, server,
 		        keytab, NULL, &verify);
-		}
 
-		krb5_free_principal(context, server);
+		    pwstats_add(PWSTATS_VERIFY, pwstats_clock() - start);
+		}
 	    }
 	}
 
@@ -151,11 +460,180 @@ int krb5_pw_validate(char *user, char *password, char *service,
     /* Success or failure now known. */
 
     krb5_free_principal(context, principal);
-    krb5_free_context(context);
+    krb5_handle_put(h);
+
+    return(code);
+}
+
+/* krb5_service:                                                         */
+/*                                                                       */
+/* Load-time settings of a module that verifies the KDC: service name,   */
+/* host (default: this host), keytab (default: the system keytab),       */
+/* realm (default: from the host's realm mapping) and whether the host   */
+/* name is canonicalized through DNS. The host name is resolved once by  */
+/* krb5_service_init() and then again every refresh seconds by a         */
+/* background thread, so binds never wait for the resolver. A failed     */
+/* refresh keeps the previous name.                                      */
+
+#define KRB5_SERVICE_HOSTLEN	256
+
+struct krb5_service {
+    char *service;
+    char *host;
+    char *keytab;
+    char *realm;
+    int canonicalize;
+    long refresh;
+    char fqdn[KRB5_SERVICE_HOSTLEN];
+    pthread_mutex_t lock;
+};
+
+#define KRB5_SERVICE_DEFAULT \
+    { "ldap", NULL, NULL, NULL, 1, 3600, "", PTHREAD_MUTEX_INITIALIZER }
+
+/* Resolve the service host. Returns -1 if canonicalization failed, in   */
+/* which case fqdn holds the name as given.                              */
+
+static int krb5_service_resolve(struct krb5_service *s, char *fqdn, long n) {
+    struct addrinfo hints, *ai;
+    int code = 0;
+    char *t;
+
+    if (s->host != NULL) {
+	snprintf(fqdn, n, "%s", s->host);
+    } else if (gethostname(fqdn, n) != 0) {
+	return(-1);
+    }
+
+    fqdn[n - 1] = '\0';
+
+    if (s->canonicalize) {
+	memset(&hints, 0, sizeof(hints));
+
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_flags = AI_CANONNAME;
+
+	if (getaddrinfo(fqdn, NULL, &hints, &ai) == 0) {
+	    if (ai->ai_canonname != NULL) {
+		snprintf(fqdn, n, "%s", ai->ai_canonname);
+	    }
+
+	    freeaddrinfo(ai);
+	} else {
+	    code = -1;
+	}
+    }
+
+    for (t = fqdn; *t; t += 1) {
+	if ((*t >= 'A') && (*t <= 'Z')) *t += 'a' - 'A';
+    }
 
     return(code);
 }
 
+static void *krb5_service_refresh(void *arg) {
+    struct krb5_service *s = (struct krb5_service *)arg;
+    char fqdn[KRB5_SERVICE_HOSTLEN];
+
+    for (;;) {
+	sleep(s->refresh);
+
+	if (krb5_service_resolve(s, fqdn, sizeof(fqdn)) == 0) {
+	    pthread_mutex_lock(&s->lock);
+	    memcpy(s->fqdn, fqdn, sizeof(fqdn));
+	    pthread_mutex_unlock(&s->lock);
+	}
+    }
+
+    return(NULL);
+}
+
+/* Resolve the host now and start refreshing it. Returns 0 or -1. */
+
+int krb5_service_init(struct krb5_service *s) {
+    pthread_t thread;
+
+    if (krb5_service_resolve(s, s->fqdn, sizeof(s->fqdn)) && !*s->fqdn) {
+	return(-1);
+    }
+
+    if (s->refresh > 0) {
+	if (pthread_create(&thread, NULL, krb5_service_refresh, s) != 0) {
+	    return(-1);
+	}
+
+	pthread_detach(thread);
+    }
+
+    return(0);
+}
+
+/* Copy out the current host name. */
+
+void krb5_service_host(struct krb5_service *s, char *fqdn) {
+    pthread_mutex_lock(&s->lock);
+    memcpy(fqdn, s->fqdn, KRB5_SERVICE_HOSTLEN);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* Parse a "service=", "host=", "keytab=", "realm=", "canonicalize=" or  */
+/* "refresh=" module argument. Returns 1 if it was one of these.         */
+
+int krb5_service_option(struct krb5_service *s, char *arg) {
+    if (strncasecmp(arg, "service=", 8) == 0) {
+	s->service = &arg[8];
+    } else if (strncasecmp(arg, "host=", 5) == 0) {
+	s->host = &arg[5];
+    } else if (strncasecmp(arg, "keytab=", 7) == 0) {
+	s->keytab = &arg[7];
+    } else if (strncasecmp(arg, "realm=", 6) == 0) {
+	s->realm = &arg[6];
+    } else if (strncasecmp(arg, "canonicalize=", 13) == 0) {
+	s->canonicalize = ((strcasecmp(&arg[13], "yes") == 0) ||
+	    (strcasecmp(&arg[13], "true") == 0) || (atoi(&arg[13]) != 0));
+    } else if (strncasecmp(arg, "refresh=", 8) == 0) {
+	s->refresh = atol(&arg[8]);
+    } else {
+	return(0);
+    }
+
+    return(1);
+}
+
+/* Name of the service principal, without a realm if none was given. */
+
+void krb5_service_name(struct krb5_service *s, char *name, long n) {
+    char fqdn[KRB5_SERVICE_HOSTLEN];
+
+    krb5_service_host(s, fqdn);
+
+    if (s->realm != NULL) {
+	snprintf(name, n, "%s/%s@%s", s->service, fqdn, s->realm);
+    } else {
+	snprintf(name, n, "%s/%s", s->service, fqdn);
+    }
+}
+
+/* Keytab holding the service key (NULL for the default keytab). */
+
+char *krb5_service_keytab(struct krb5_service *s) {
+    return(s->keytab);
+}
+
+/* krb5_pw_validate() against a configured service. The host name has  */
+/* already been resolved, so Kerberos is asked not to canonicalize it.  */
+
+int krb5_service_validate(struct krb5_service *s, char *user,
+    char *password)
+{
+    char fqdn[KRB5_SERVICE_HOSTLEN];
+
+    krb5_service_host(s, fqdn);
+
+    return(krb5_pw_verify(user, password, s->service, fqdn, s->realm,
+	KRB5_NT_UNKNOWN, s->keytab));
+}
+
 #ifdef MAIN
 #include <com_err.h>
 
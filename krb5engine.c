@@ -0,0 +1,1036 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include <krb5.h>
+#include <profile.h>
+
+#include "krb5engine.h"
+
+/*
+ *  Each engine thread (a worker) takes submitted requests off its queue
+ *  and runs them as state machines: krb5_init_creds_step() produces the
+ *  next message for a realm, the worker sends it to one of the realm's
+ *  KDCs and feeds the reply back in, until the exchange completes. UDP
+ *  is used unless the message is large or the KDC says the reply is too
+ *  big, as libkrb5 does. A request that gets no reply within timeout
+ *  milliseconds is resent to the realm's next KDC, for up to ENGINE_TRIES
+ *  passes over them. Every send restarts the same timeout, so in-flight
+ *  requests kept in send order are also in deadline order.
+ *
+ *  If a service principal is given, the initial ticket is requested for
+ *  it rather than for krbtgt, so krb5_verify_init_creds() can check it
+ *  against the keytab without a further exchange with the KDC. KDCs are
+ *  taken from the [realms] section of krb5.conf (DNS SRV records are not
+ *  consulted) or from the kdc list given to krb5engine_create().
+ *
+ *  Realms' KDCs are looked up by a resolver thread, never by a worker:
+ *  a request for a realm not yet known is parked until the resolver has
+ *  been through it, and known realms are refreshed in the background
+ *  every ENGINE_KDCTTL seconds. A failed refresh keeps the addresses the
+ *  realm had and is retried after ENGINE_KDCRETRY seconds.
+ */
+
+#define ENGINE_KDCS	8	/* KDC addresses used per realm */
+#define ENGINE_TRIES	3	/* passes over those addresses */
+#define ENGINE_REALMS	8	/* realms the engine remembers */
+#define ENGINE_KDCTTL	300	/* seconds before looking them up again */
+#define ENGINE_KDCRETRY	30	/* or after a failed lookup */
+#define ENGINE_UDPMAX	1465	/* larger messages go over TCP */
+#define ENGINE_EVENTS	256
+
+struct kdcs {
+    char realm[256];
+    struct sockaddr_storage addr[ENGINE_KDCS];
+    socklen_t length[ENGINE_KDCS];
+    int count;
+    time_t expires;
+    int looked;			/* looked up at least once */
+};
+
+struct request {
+    const char *user, *password, *server, *keytab;
+    int nofail;
+    krb5_error_code code;
+    long verifying;		/* nanoseconds spent verifying the KDC */
+    int done;
+    pthread_cond_t wait;
+    struct request *next;
+
+    krb5_principal client;
+    krb5_init_creds_context icc;
+    krb5_data out;
+    struct kdcs kdcs;		/* a copy of the realm's KDCs */
+    int kdc, tries, changepw;
+    int fd, tcp, sending;
+    unsigned char *buffer;
+    unsigned long length, have;
+    long deadline;
+    struct request *older, *newer;
+};
+
+struct worker {
+    pthread_mutex_t lock;
+    struct request *first, *last;
+    struct request *parked;	/* waiting for their realm's KDCs */
+    int epoll, event, stop;
+    pthread_t thread;
+    krb5_context context;
+    krb5_get_init_creds_opt *options;
+    krb5_keytab keytab;
+    char *keytab_name;
+    struct request *oldest, *newest;
+    struct krb5engine *engine;
+    unsigned char reply[65536];
+};
+
+struct krb5engine {
+    struct worker *worker;
+    int workers, started;
+    long timeout;
+    struct kdcs kdcs;
+    unsigned long next;
+
+    /* The realms' KDCs, kept up to date by the resolver thread. */
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t resolver;
+    int resolving, stop;
+    krb5_context context;
+    struct kdcs realms[ENGINE_REALMS];
+    time_t used[ENGINE_REALMS];
+};
+
+static void step(struct worker *, struct request *, krb5_data *);
+static void transmit(struct worker *, struct request *);
+static void finish(struct worker *, struct request *, krb5_error_code);
+
+static long now(void) {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return(t.tv_sec * 1000 + t.tv_nsec / 1000000);
+}
+
+/* Add the addresses of a "host[:port]" KDC entry to k. */
+
+static void resolve(struct kdcs *k, const char *entry) {
+    struct addrinfo hints, *ai, *a;
+    char host[256], *port, *s;
+
+    snprintf(host, sizeof(host), "%s", entry);
+
+    s = host;
+    port = NULL;
+
+    if (*s == '[') {
+	s += 1;
+
+	if ((port = strchr(s, ']')) != NULL) {
+	    *port++ = '\0';
+	    port = (*port == ':') ? port + 1 : NULL;
+	}
+    } else if (((port = strchr(s, ':')) != NULL) &&
+	(strchr(port + 1, ':') == NULL)) {
+	*port++ = '\0';
+    } else {
+	port = NULL;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    if (getaddrinfo(s, (port && *port) ? port : "88", &hints, &ai) != 0) {
+	return;
+    }
+
+    for (a = ai; a && (k->count < ENGINE_KDCS); a = a->ai_next) {
+	memcpy(&k->addr[k->count], a->ai_addr, a->ai_addrlen);
+	k->length[k->count++] = a->ai_addrlen;
+    }
+
+    freeaddrinfo(ai);
+}
+
+/* Look a realm's KDCs up in krb5.conf. */
+
+static void lookup(krb5_context context, struct kdcs *k) {
+    const char *names[4];
+    profile_t profile;
+    char **values;
+    int n;
+
+    if (krb5_get_profile(context, &profile) != 0) return;
+
+    names[0] = "realms";
+    names[1] = k->realm;
+    names[2] = "kdc";
+    names[3] = NULL;
+
+    if (profile_get_values(profile, names, &values) == 0) {
+	for (n = 0; values[n] != NULL; n += 1) resolve(k, values[n]);
+
+	profile_free_list(values);
+    }
+
+    profile_release(profile);
+}
+
+/* Wake a worker. Fails only if it cannot be woken. */
+
+static int wake(struct worker *w) {
+    uint64_t one = 1;
+
+    /* EAGAIN: the counter is full, so a wakeup is already pending. */
+
+    if ((write(w->event, &one, sizeof(one)) < 0) && (errno != EAGAIN)) {
+	return(-1);
+    }
+
+    return(0);
+}
+
+/*
+ *  The resolver thread: look up realms the workers have asked for, and
+ *  again those whose addresses have expired, and wake the workers when
+ *  a realm they may be waiting for has been looked up.
+ */
+
+static void *resolver(void *arg) {
+    struct krb5engine *e = (struct krb5engine *)arg;
+    struct timespec until;
+    struct kdcs *k, found;
+    time_t t, next;
+    int n, first;
+
+    pthread_mutex_lock(&e->lock);
+
+    while (e->stop == 0) {
+	t = time(NULL);
+	next = t + ENGINE_KDCTTL;
+
+	for (n = 0; n < ENGINE_REALMS; n += 1) {
+	    k = &e->realms[n];
+
+	    if (k->realm[0] == '\0') continue;
+	    if ((k->looked == 0) || (k->expires <= t)) break;
+	    if (k->expires < next) next = k->expires;
+	}
+
+	if (n == ENGINE_REALMS) {
+	    until.tv_sec = next;
+	    until.tv_nsec = 0;
+
+	    pthread_cond_timedwait(&e->wake, &e->lock, &until);
+	    continue;
+	}
+
+	memset(&found, 0, sizeof(found));
+	memcpy(found.realm, k->realm, sizeof(found.realm));
+
+	first = (k->looked == 0);
+
+	pthread_mutex_unlock(&e->lock);
+
+	lookup(e->context, &found);
+
+	pthread_mutex_lock(&e->lock);
+
+	/* Keep the old addresses if there are no new ones. */
+
+	if (strcmp(k->realm, found.realm) == 0) {
+	    if (found.count > 0) {
+		memcpy(k->addr, found.addr, sizeof(k->addr));
+		memcpy(k->length, found.length, sizeof(k->length));
+		k->count = found.count;
+	    }
+
+	    k->looked = 1;
+	    k->expires = time(NULL) +
+		((found.count > 0) ? ENGINE_KDCTTL : ENGINE_KDCRETRY);
+	}
+
+	if (first) {
+	    for (n = 0; n < e->started; n += 1) wake(&e->worker[n]);
+	}
+    }
+
+    pthread_mutex_unlock(&e->lock);
+
+    return(NULL);
+}
+
+/*
+ *  Copy the KDCs of r's realm into r. Returns 1 if there are some, 0 if
+ *  the realm has yet to be looked up (the resolver is asked to) and -1
+ *  if it has none.
+ */
+
+static int locate(struct worker *w, struct request *r) {
+    struct krb5engine *e = w->engine;
+    struct kdcs *k;
+    int n, m, found;
+
+    if (e->kdcs.count > 0) {
+	memcpy(&r->kdcs, &e->kdcs, sizeof(r->kdcs));
+	return(1);
+    }
+
+    if (r->kdcs.realm[0] == '\0') return(-1);
+
+    pthread_mutex_lock(&e->lock);
+
+    /* Find the realm, or the least recently used one not being looked up. */
+
+    for (n = 0, m = -1; n < ENGINE_REALMS; n += 1) {
+	k = &e->realms[n];
+
+	if (strcmp(k->realm, r->kdcs.realm) == 0) break;
+
+	if (((k->realm[0] == '\0') || k->looked) &&
+	    ((m < 0) || (e->used[n] < e->used[m]))) {
+	    m = n;
+	}
+    }
+
+    if (n == ENGINE_REALMS) {
+	if (m < 0) {
+	    pthread_mutex_unlock(&e->lock);
+	    return(-1);
+	}
+
+	k = &e->realms[n = m];
+
+	memset(k, 0, sizeof(*k));
+	memcpy(k->realm, r->kdcs.realm, sizeof(k->realm));
+
+	pthread_cond_signal(&e->wake);
+    }
+
+    e->used[n] = time(NULL);
+
+    if (k->count > 0) {
+	memcpy(&r->kdcs, k, sizeof(r->kdcs));
+	found = 1;
+    } else {
+	found = (k->looked) ? -1 : 0;
+    }
+
+    pthread_mutex_unlock(&e->lock);
+
+    return(found);
+}
+
+/* Send r's message to its realm's KDCs, or park it until they are known. */
+
+static void route(struct worker *w, struct request *r) {
+    switch (locate(w, r)) {
+    case 1:
+	r->kdc = r->tries = 0;
+	transmit(w, r);
+	break;
+    case 0:
+	r->next = w->parked;
+	w->parked = r;
+	break;
+    default:
+	finish(w, r, KRB5_REALM_CANT_RESOLVE);
+    }
+}
+
+/* Forget about a request's socket. */
+
+static void hangup(struct worker *w, struct request *r) {
+    if (r->fd >= 0) {
+	close(r->fd);
+	r->fd = -1;
+    }
+
+    if (r->older) r->older->newer = r->newer;
+    else if (w->oldest == r) w->oldest = r->newer;
+
+    if (r->newer) r->newer->older = r->older;
+    else if (w->newest == r) w->newest = r->older;
+
+    r->older = r->newer = NULL;
+
+    free(r->buffer);
+    r->buffer = NULL;
+}
+
+/* Free a request's Kerberos state and hand the result to its caller. */
+
+static void finish(struct worker *w, struct request *r,
+    krb5_error_code code)
+{
+    krb5_verify_init_creds_opt verify;
+    struct timespec start, end;
+    krb5_creds creds;
+
+    hangup(w, r);
+
+    if ((code == 0) && (r->changepw == 0) && (r->server != NULL)) {
+
+	/* Check the service ticket with our own key to verify the KDC. */
+
+	memset(&creds, 0, sizeof(creds));
+
+	if ((code = krb5_init_creds_get_creds(w->context, r->icc, &creds)) == 0) {
+	    if ((w->keytab == NULL) || ((r->keytab == NULL) ?
+		(w->keytab_name != NULL) : ((w->keytab_name == NULL) ||
+		strcmp(r->keytab, w->keytab_name)))) {
+		if (w->keytab) krb5_kt_close(w->context, w->keytab);
+
+		free(w->keytab_name);
+		w->keytab_name = (r->keytab) ? strdup(r->keytab) : NULL;
+
+		if (r->keytab) {
+		    code = krb5_kt_resolve(w->context, r->keytab, &w->keytab);
+		} else {
+		    code = krb5_kt_default(w->context, &w->keytab);
+		}
+
+		if (code) w->keytab = NULL;
+	    }
+
+	    if (code == 0) {
+		krb5_verify_init_creds_opt_init(&verify);
+
+		if (r->nofail >= 0) {
+		    krb5_verify_init_creds_opt_set_ap_req_nofail(&verify,
+			r->nofail);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		code = krb5_verify_init_creds(w->context, &creds, creds.server,
+		    w->keytab, NULL, &verify);
+
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		r->verifying += ((end.tv_sec - start.tv_sec) * 1000000000L) +
+		    end.tv_nsec - start.tv_nsec;
+	    }
+
+	    krb5_free_cred_contents(w->context, &creds);
+	}
+    }
+
+    krb5_free_data_contents(w->context, &r->out);
+
+    if (r->icc) krb5_init_creds_free(w->context, r->icc);
+    r->icc = NULL;
+
+    if (r->changepw) {
+
+	/* Expired password: it is correct if kadmin/changepw accepted it. */
+
+	if (code == 0) code = KRB5KDC_ERR_KEY_EXP;
+
+    } else if (code == KRB5KDC_ERR_KEY_EXP) {
+	r->changepw = 1;
+
+	if ((code = krb5_init_creds_init(w->context, r->client, NULL, NULL,
+	    0, w->options, &r->icc)) == 0) {
+	    if (((code = krb5_init_creds_set_password(w->context, r->icc,
+		r->password)) == 0) && ((code = krb5_init_creds_set_service(
+		w->context, r->icc, "kadmin/changepw")) == 0)) {
+		step(w, r, NULL);
+		return;
+	    }
+
+	    krb5_init_creds_free(w->context, r->icc);
+	    r->icc = NULL;
+	}
+    }
+
+    if (r->client) krb5_free_principal(w->context, r->client);
+    r->client = NULL;
+
+    pthread_mutex_lock(&w->lock);
+    r->code = code;
+    r->done = 1;
+    pthread_cond_signal(&r->wait);
+    pthread_mutex_unlock(&w->lock);
+}
+
+/* Feed a reply (or nothing, to begin) to the exchange and send on. */
+
+static void step(struct worker *w, struct request *r, krb5_data *in) {
+    krb5_data empty, out, realm;
+    unsigned int flags = 0;
+    krb5_error_code code;
+
+    hangup(w, r);
+
+    memset(&empty, 0, sizeof(empty));
+    memset(&out, 0, sizeof(out));
+    memset(&realm, 0, sizeof(realm));
+
+    code = krb5_init_creds_step(w->context, r->icc, (in) ? in : &empty,
+	&out, &realm, &flags);
+
+    if ((code == KRB5KRB_ERR_RESPONSE_TOO_BIG) && (r->tcp == 0)) {
+	r->tcp = 1;
+	code = 0;
+
+	if (out.length == 0) {
+	    krb5_free_data_contents(w->context, &realm);
+
+	    r->tries = 0;
+	    transmit(w, r);
+	    return;
+	}
+
+	flags = KRB5_INIT_CREDS_STEP_FLAG_CONTINUE;
+    }
+
+    if (code || !(flags & KRB5_INIT_CREDS_STEP_FLAG_CONTINUE)) {
+	krb5_free_data_contents(w->context, &out);
+	krb5_free_data_contents(w->context, &realm);
+
+	finish(w, r, code);
+	return;
+    }
+
+    krb5_free_data_contents(w->context, &r->out);
+    r->out = out;
+
+    memset(r->kdcs.realm, 0, sizeof(r->kdcs.realm));
+
+    if (realm.length < sizeof(r->kdcs.realm)) {
+	memcpy(r->kdcs.realm, realm.data, realm.length);
+    }
+
+    krb5_free_data_contents(w->context, &realm);
+
+    r->tcp = (r->tcp || (r->out.length > ENGINE_UDPMAX));
+
+    route(w, r);
+}
+
+/* Send the current message to the next KDC to try. */
+
+static void transmit(struct worker *w, struct request *r) {
+    struct epoll_event event;
+    struct sockaddr *addr;
+    unsigned long length;
+    int n;
+
+    hangup(w, r);
+
+    while (r->tries < r->kdcs.count * ENGINE_TRIES) {
+	n = r->kdc++ % r->kdcs.count;
+	r->tries += 1;
+
+	addr = (struct sockaddr *)&r->kdcs.addr[n];
+
+	r->fd = socket(addr->sa_family, ((r->tcp) ? SOCK_STREAM : SOCK_DGRAM)
+	    | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+	if (r->fd < 0) continue;
+
+	if ((connect(r->fd, addr, r->kdcs.length[n]) != 0) &&
+	    (errno != EINPROGRESS)) {
+	    hangup(w, r);
+	    continue;
+	}
+
+	if (r->tcp) {
+
+	    /* Messages over TCP carry a four byte length prefix. */
+
+	    length = r->out.length;
+
+	    if ((r->buffer = malloc(length + 4)) == NULL) {
+		hangup(w, r);
+		break;
+	    }
+
+	    r->buffer[0] = length >> 24;
+	    r->buffer[1] = length >> 16;
+	    r->buffer[2] = length >> 8;
+	    r->buffer[3] = length;
+
+	    memcpy(&r->buffer[4], r->out.data, length);
+
+	    r->length = length + 4;
+	    r->have = 0;
+	    r->sending = 1;
+
+	    event.events = EPOLLOUT;
+	} else {
+	    if (send(r->fd, r->out.data, r->out.length, 0) < 0) {
+		hangup(w, r);
+		continue;
+	    }
+
+	    event.events = EPOLLIN;
+	}
+
+	event.data.ptr = r;
+
+	if (epoll_ctl(w->epoll, EPOLL_CTL_ADD, r->fd, &event) != 0) {
+	    hangup(w, r);
+	    continue;
+	}
+
+	r->deadline = now() + w->engine->timeout;
+
+	r->older = w->newest;
+
+	if (w->newest) w->newest->newer = r;
+	else w->oldest = r;
+
+	w->newest = r;
+
+	return;
+    }
+
+    finish(w, r, KRB5_KDC_UNREACH);
+}
+
+/* A request's socket is ready. */
+
+static void ready(struct worker *w, struct request *r, unsigned int events) {
+    struct epoll_event event;
+    krb5_data in;
+    long n;
+
+    memset(&in, 0, sizeof(in));
+
+    if (r->tcp == 0) {
+	if ((n = recv(r->fd, w->reply, sizeof(w->reply), 0)) <= 0) {
+	    if ((n < 0) && (errno == EAGAIN)) return;
+	    transmit(w, r);
+	    return;
+	}
+
+	in.length = n;
+	in.data = (char *)w->reply;
+
+	step(w, r, &in);
+	return;
+    }
+
+    if ((events & (EPOLLERR | EPOLLHUP)) && !(events & EPOLLIN)) {
+	transmit(w, r);
+	return;
+    }
+
+    if (r->sending) {
+	if ((n = send(r->fd, &r->buffer[r->have], r->length - r->have,
+	    MSG_NOSIGNAL)) < 0) {
+	    if (errno != EAGAIN) transmit(w, r);
+	    return;
+	}
+
+	if ((r->have += n) < r->length) return;
+
+	/* Sent. Now read the length of the reply, then the reply. */
+
+	r->sending = 0;
+	r->length = 4;
+	r->have = 0;
+
+	event.events = EPOLLIN;
+	event.data.ptr = r;
+
+	epoll_ctl(w->epoll, EPOLL_CTL_MOD, r->fd, &event);
+	return;
+    }
+
+    if ((n = recv(r->fd, &r->buffer[r->have], r->length - r->have, 0)) <= 0) {
+	if ((n < 0) && (errno == EAGAIN)) return;
+	transmit(w, r);
+	return;
+    }
+
+    if ((r->have += n) < r->length) return;
+
+    if (r->length == 4) {
+	r->length = ((unsigned long)r->buffer[0] << 24) |
+	    (r->buffer[1] << 16) | (r->buffer[2] << 8) | r->buffer[3];
+
+	if ((r->length == 0) || (r->length > (1 << 20))) {
+	    transmit(w, r);
+	    return;
+	}
+
+	free(r->buffer);
+
+	if ((r->buffer = malloc(r->length)) == NULL) {
+	    transmit(w, r);
+	    return;
+	}
+
+	r->have = 0;
+	return;
+    }
+
+    /* step() frees the buffer, so hand it over first. */
+
+    in.length = r->length;
+    in.data = (char *)r->buffer;
+
+    r->buffer = NULL;
+
+    step(w, r, &in);
+
+    free(in.data);
+}
+
+/* Begin a submitted request. */
+
+static void start(struct worker *w, struct request *r) {
+    krb5_error_code code;
+
+    r->fd = -1;
+
+    if ((code = krb5_parse_name(w->context, r->user, &r->client))) {
+	r->client = NULL;
+	finish(w, r, code);
+	return;
+    }
+
+    if ((code = krb5_init_creds_init(w->context, r->client, NULL, NULL, 0,
+	w->options, &r->icc))) {
+	r->icc = NULL;
+	finish(w, r, code);
+	return;
+    }
+
+    if ((code = krb5_init_creds_set_password(w->context, r->icc,
+	r->password))) {
+	finish(w, r, code);
+	return;
+    }
+
+    if (r->server && (code = krb5_init_creds_set_service(w->context,
+	r->icc, r->server))) {
+	finish(w, r, code);
+	return;
+    }
+
+    step(w, r, NULL);
+}
+
+static void *run(void *arg) {
+    struct epoll_event events[ENGINE_EVENTS];
+    struct worker *w = (struct worker *)arg;
+    struct request *r, *next;
+    uint64_t count;
+    long timeout;
+    int n, ready_count;
+
+    for (;;) {
+	timeout = -1;
+
+	if (w->oldest) {
+	    if ((timeout = w->oldest->deadline - now()) < 0) timeout = 0;
+	}
+
+	ready_count = epoll_wait(w->epoll, events, ENGINE_EVENTS, timeout);
+
+	for (n = 0; n < ready_count; n += 1) {
+	    if (events[n].data.ptr == NULL) {
+		if (read(w->event, &count, sizeof(count)) < 0) continue;
+
+		pthread_mutex_lock(&w->lock);
+
+		if (w->stop) {
+		    pthread_mutex_unlock(&w->lock);
+		    return(NULL);
+		}
+
+		r = w->first;
+		w->first = w->last = NULL;
+		pthread_mutex_unlock(&w->lock);
+
+		for (; r; r = next) {
+		    next = r->next;
+		    start(w, r);
+		}
+
+		/* The resolver may have looked up parked requests' realms. */
+
+		r = w->parked;
+		w->parked = NULL;
+
+		for (; r; r = next) {
+		    next = r->next;
+		    route(w, r);
+		}
+	    } else {
+		ready(w, (struct request *)events[n].data.ptr,
+		    events[n].events);
+	    }
+	}
+
+	/* Resend whatever has waited too long for a reply. */
+
+	while (w->oldest && (w->oldest->deadline <= now())) {
+	    transmit(w, w->oldest);
+	}
+    }
+
+    return(NULL);
+}
+
+/* Stop an engine's threads and free it. */
+
+static void destroy(struct krb5engine *e) {
+    struct worker *w;
+    int n;
+
+    if (e->resolving) {
+	pthread_mutex_lock(&e->lock);
+	e->stop = 1;
+	pthread_cond_signal(&e->wake);
+	pthread_mutex_unlock(&e->lock);
+
+	pthread_join(e->resolver, NULL);
+    }
+
+    for (n = 0; n < e->workers; n += 1) {
+	w = &e->worker[n];
+
+	if (n < e->started) {
+	    pthread_mutex_lock(&w->lock);
+	    w->stop = 1;
+	    pthread_mutex_unlock(&w->lock);
+
+	    if (wake(w) == 0) pthread_join(w->thread, NULL);
+	}
+
+	if (w->event >= 0) close(w->event);
+	if (w->epoll >= 0) close(w->epoll);
+
+	if (w->context) {
+	    if (w->keytab) krb5_kt_close(w->context, w->keytab);
+	    if (w->options) krb5_get_init_creds_opt_free(w->context, w->options);
+
+	    krb5_free_context(w->context);
+	}
+
+	free(w->keytab_name);
+
+	pthread_mutex_destroy(&w->lock);
+    }
+
+    if (e->context) krb5_free_context(e->context);
+
+    pthread_cond_destroy(&e->wake);
+    pthread_mutex_destroy(&e->lock);
+
+    free(e->worker);
+    free(e);
+}
+
+/* Give a worker its Kerberos context, epoll set and wakeup eventfd. */
+
+static int prepare(struct worker *w) {
+    struct epoll_event event;
+
+    if (krb5_init_context(&w->context)) {
+	w->context = NULL;
+	return(-1);
+    }
+
+    if (krb5_get_init_creds_opt_alloc(w->context, &w->options)) {
+	w->options = NULL;
+	return(-1);
+    }
+
+    krb5_get_init_creds_opt_set_tkt_life(w->options, 1 * 60);
+    krb5_get_init_creds_opt_set_renew_life(w->options, 0);
+    krb5_get_init_creds_opt_set_forwardable(w->options, 0);
+    krb5_get_init_creds_opt_set_proxiable(w->options, 0);
+
+    if ((w->epoll = epoll_create1(EPOLL_CLOEXEC)) < 0) return(-1);
+
+    if ((w->event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) return(-1);
+
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+
+    if (epoll_ctl(w->epoll, EPOLL_CTL_ADD, w->event, &event) != 0) {
+	return(-1);
+    }
+
+    return(0);
+}
+
+/*
+ *  Create an engine of threads workers, each of which waits timeout
+ *  milliseconds for a KDC to answer before trying the next one. If kdcs
+ *  is not NULL, it is a comma separated list of "host[:port]" KDCs used
+ *  for every realm instead of those in krb5.conf. Returns NULL on error.
+ */
+
+struct krb5engine *krb5engine_create(int threads, long timeout, char *kdcs) {
+    struct krb5engine *e;
+    struct worker *w;
+    char *s, *t;
+    int n;
+
+    if ((threads <= 0) || (timeout <= 0)) return(NULL);
+
+    if ((e = calloc(1, sizeof(*e))) == NULL) return(NULL);
+
+    if ((e->worker = calloc(threads, sizeof(*w))) == NULL) {
+	free(e);
+	return(NULL);
+    }
+
+    e->workers = threads;
+    e->timeout = timeout;
+
+    pthread_mutex_init(&e->lock, NULL);
+    pthread_cond_init(&e->wake, NULL);
+
+    for (n = 0; n < threads; n += 1) {
+	w = &e->worker[n];
+	w->engine = e;
+	w->epoll = w->event = -1;
+
+	pthread_mutex_init(&w->lock, NULL);
+    }
+
+    if (kdcs) {
+	if ((s = strdup(kdcs)) == NULL) {
+	    destroy(e);
+	    return(NULL);
+	}
+
+	for (t = strtok(s, ", "); t; t = strtok(NULL, ", ")) {
+	    resolve(&e->kdcs, t);
+	}
+
+	free(s);
+
+	if (e->kdcs.count == 0) {
+	    destroy(e);
+	    return(NULL);
+	}
+    }
+
+    for (n = 0; n < threads; n += 1) {
+	w = &e->worker[n];
+
+	if (prepare(w) || (pthread_create(&w->thread, NULL, run, w) != 0)) {
+	    destroy(e);
+	    return(NULL);
+	}
+
+	e->started += 1;
+    }
+
+    if (kdcs == NULL) {
+	if (krb5_init_context(&e->context)) {
+	    e->context = NULL;
+	    destroy(e);
+	    return(NULL);
+	}
+
+	if (pthread_create(&e->resolver, NULL, resolver, e) != 0) {
+	    destroy(e);
+	    return(NULL);
+	}
+
+	e->resolving = 1;
+    }
+
+    return(e);
+}
+
+/*
+ *  Verify user's password, and if server is not NULL, verify the KDC
+ *  with the key for that service principal from keytab (NULL for the
+ *  default keytab). nofail is 1 to fail if the keytab has no key for
+ *  the server, 0 not to, or -1 to leave it to krb5.conf, as with
+ *  krb5_verify_init_creds_opt_set_ap_req_nofail(). Returns the Kerberos
+ *  error code (zero if valid), as krb5_pw_validate() does. If verifying
+ *  is not NULL, the nanoseconds spent verifying the KDC (as opposed to
+ *  getting the credentials) are left there.
+ */
+
+krb5_error_code krb5engine_verify(struct krb5engine *e, const char *user,
+    const char *password, const char *server, const char *keytab,
+    int nofail, long *verifying)
+{
+    struct request r, **p;
+    struct worker *w;
+    int error;
+
+    memset(&r, 0, sizeof(r));
+
+    r.user = user;
+    r.password = password;
+    r.server = server;
+    r.keytab = keytab;
+    r.nofail = nofail;
+
+    pthread_cond_init(&r.wait, NULL);
+
+    w = &e->worker[__sync_fetch_and_add(&e->next, 1) % e->workers];
+
+    pthread_mutex_lock(&w->lock);
+
+    if (w->last) w->last->next = &r;
+    else w->first = &r;
+
+    w->last = &r;
+
+    pthread_mutex_unlock(&w->lock);
+
+    /* If the worker cannot be woken, take the request back if it can. */
+
+    if (wake(w) != 0) {
+	error = errno;
+
+	pthread_mutex_lock(&w->lock);
+
+	for (p = &w->first; *p && (*p != &r); p = &(*p)->next);
+
+	if (*p) {
+	    *p = r.next;
+
+	    if (w->last == &r) {
+		w->last = NULL;
+
+		for (p = &w->first; *p; p = &(*p)->next) w->last = *p;
+	    }
+
+	    r.code = error;
+	    r.done = 1;
+	}
+
+	pthread_mutex_unlock(&w->lock);
+    }
+
+    pthread_mutex_lock(&w->lock);
+
+    while (r.done == 0) pthread_cond_wait(&r.wait, &w->lock);
+
+    pthread_mutex_unlock(&w->lock);
+
+    pthread_cond_destroy(&r.wait);
+
+    if (verifying) *verifying = r.verifying;
+
+    return(r.code);
+}
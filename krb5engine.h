@@ -0,0 +1,13 @@
+/*
+ *  Event-driven Kerberos password verification. A few engine threads
+ *  each own a Kerberos context and an epoll set, and drive many initial
+ *  credential (AS) exchanges at once with krb5_init_creds_step(), doing
+ *  the UDP/TCP I/O to the KDCs themselves. A caller blocks only on its
+ *  own request. Requires <krb5.h>.
+ */
+
+struct krb5engine;
+
+extern struct krb5engine *krb5engine_create(int, long, char *);
+extern krb5_error_code krb5engine_verify(struct krb5engine *, const char *,
+    const char *, const char *, const char *, int, long *);
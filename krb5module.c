@@ -0,0 +1,371 @@
+#include <lber.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <krb5.h>
+
+#include "lutil.h"
+#include "pwcache.h"
+#include "throttle.h"
+#include "krb5engine.h"
+#include "pwstats.h"
+#include "krb5module.h"
+
+/* Errors that mean the KDC could not be asked, not that the password is bad. */
+
+static int unreachable(krb5_error_code code) {
+    return((code == KRB5_KDC_UNREACH) || (code == KRB5_REALM_CANT_RESOLVE) ||
+	(code == ETIMEDOUT) || (code == ECONNREFUSED));
+}
+
+/* Count the time an engine request took, verifying the KDC or not. */
+
+static void timed(int64_t ns, long verifying) {
+    pwstats_add(PWSTATS_INITCREDS, ns - verifying);
+
+    if (verifying) pwstats_add(PWSTATS_VERIFY, verifying);
+}
+
+static int verify(
+    struct krb5_module *m,
+    const struct berval *passwd,
+    const struct berval *cred)
+{
+    unsigned char key[PWCACHE_KEYLEN];
+    int n, result, state = PWCACHE_MISS, flight = PWCACHE_MISS;
+    struct throttle *tracker = m->tracker;
+    struct pwcache *cache = m->cache;
+    krb5_error_code code;
+    uint64_t tag = 0;
+    int64_t start;
+    long verifying;
+    char name[1024];
+
+    /* Make sure there are no NULL characters in credentials. */
+
+    for (n = 0; n < cred->bv_len; n += 1) {
+	if (cred->bv_val[n] == '\0') {
+	    return(LUTIL_PASSWD_ERR);
+	}
+    }
+
+    /* Make sure that the credentials are NULL terminated. */
+
+    if (cred->bv_val[n] != '\0') {
+	return(LUTIL_PASSWD_ERR);
+    }
+
+    /* Make sure there are no NULL characters in password. */
+
+    for (n = 0; n < passwd->bv_len; n += 1) {
+	if (passwd->bv_val[n] == '\0') {
+	    return(LUTIL_PASSWD_ERR);
+	}
+    }
+
+    /* Make sure that the password is NULL terminated. */
+
+    if (passwd->bv_val[n] != '\0') {
+	return(LUTIL_PASSWD_ERR);
+    }
+
+    /*
+     *  See if this principal recently verified with these credentials
+     *  (going without the cache if no key can be had for them).
+     */
+
+    if (cache && pwcache_key(cache, passwd, cred, key)) cache = NULL;
+
+    if (cache) {
+	if ((state = pwcache_lookup(cache, key, &result)) == PWCACHE_HIT) {
+	    return(result);
+	}
+    }
+
+    /*
+     *  Refuse without asking the KDC if this principal keeps failing
+     *  (going without the throttle if no tag can be had for it).
+     */
+
+    if (tracker && ((tag = throttle_key(tracker, passwd)) == 0)) {
+	tracker = NULL;
+    }
+
+    if (tracker) {
+	if (throttle_check(tracker, tag)) {
+	    return(LUTIL_PASSWD_ERR);
+	}
+    }
+
+    /* Share the result of an identical check already in progress. */
+
+    if (cache && (state == PWCACHE_MISS)) {
+	if ((flight = pwcache_join(cache, key, &result)) == PWCACHE_HIT) {
+	    return(result);
+	}
+    }
+
+    if (m->engine) {
+	krb5_service_name(m->service, name, sizeof(name));
+
+	start = pwstats_clock();
+
+	code = krb5engine_verify(m->engine, passwd->bv_val, cred->bv_val,
+	    name, krb5_service_keytab(m->service), m->nofail, &verifying);
+
+	timed(pwstats_clock() - start, verifying);
+    } else {
+	code = m->verify(m->service, passwd->bv_val, cred->bv_val);
+    }
+
+    pwstats_error(code);
+
+    /* Keep serving a stale success while the KDC is unreachable. */
+
+    if ((state == PWCACHE_STALE) && unreachable(code)) {
+	return(result);
+    }
+
+    result = (code) ? LUTIL_PASSWD_ERR : LUTIL_PASSWD_OK;
+
+    if (cache) {
+	pwcache_store(cache, key, result);
+    }
+
+    if (flight == PWCACHE_LEAD) {
+	pwcache_land(cache, key, result);
+    }
+
+    if (tracker && code && !unreachable(code)) {
+	throttle_fail(tracker, tag);
+    }
+
+    return(result);
+}
+
+/* Check cred against the principal passwd, as a module's chk does. */
+
+int krb5_module_check(
+    struct krb5_module *m,
+    const struct berval *passwd,
+    const struct berval *cred)
+{
+    int64_t start;
+    int code;
+
+    start = pwstats_begin(m->stats, &m->slow);
+
+    code = verify(m, passwd, cred);
+
+    pwstats_slow(&m->slow, m->scheme, passwd, pwstats_end(start, code),
+	code);
+
+    return(code);
+}
+
+/*
+ *  Report cache hits and misses, throttled checks, and checks that asked
+ *  the KDC for a flight of identical ones or waited for its answer.
+ */
+
+void krb5_module_stats(struct krb5_module *m, unsigned long *hits,
+    unsigned long *misses, unsigned long *throttled, unsigned long *flights,
+    unsigned long *joined)
+{
+    *hits = *misses = *throttled = *flights = *joined = 0;
+
+    if (m->cache) {
+	pwcache_stats(m->cache, hits, misses);
+	pwcache_flights(m->cache, flights, joined);
+    }
+
+    if (m->tracker) throttle_stats(m->tracker, throttled);
+}
+
+/*
+ *  Take the module arguments and set up what they ask for. Returns 0 or
+ *  -1. The arguments (e.g. "cache-size=10000") are:
+ *
+ *     cache-size=<n>      cache up to n successful checks (default 0)
+ *     cache-ttl=<s>       trust a cached success for s seconds (300)
+ *     cache-stale=<s>     then serve it for up to s more seconds while it
+ *                         is revalidated or the KDC is unreachable (0)
+ *     throttle-size=<n>   track up to n principals (default 0: don't)
+ *     throttle-burst=<n>  refuse a principal after n failures (10)
+ *     throttle-rate=<n>   forgive n failures per minute (6)
+ *     coalesce=<ms>       let identical concurrent checks wait up to ms
+ *                         for the first one's result (default 0: don't)
+ *     service=<name>      service principal used to verify the KDC (ldap)
+ *     host=<name>         host part of that principal (this host)
+ *     keytab=<name>       keytab holding its key (the default keytab)
+ *     realm=<name>        realm of that principal (from the host's realm)
+ *     canonicalize=<y|n>  canonicalize the host name through DNS (yes)
+ *     refresh=<s>         re-resolve the host name every s seconds
+ *                         (3600; 0 resolves it only when loaded)
+ *     engine-threads=<n>  talk to the KDCs from n event-driven threads
+ *                         (default 0: each bind asks the KDC itself)
+ *     engine-timeout=<ms> wait ms for a KDC before trying the next (1000)
+ *     kdc=<host[:port]>   engine KDCs (comma separated) instead of those
+ *                         in krb5.conf
+ *     stats=<name>        keep statistics in shared memory segment name
+ *     slow=<ms>           log checks taking more than ms, with the time
+ *                         spent in each phase (default 0: don't)
+ *     slow-rate=<n>       log at most n slow checks a minute (10)
+ */
+
+int krb5_module_init(struct krb5_module *m, int argc, char *argv[]) {
+    long size = 0, ttl = 300, stale = 0;
+    long tsize = 0, burst = 10, rate = 6;
+    long timeout = 1000, coalesce = 0;
+    char *kdcs = NULL, *name = NULL;
+    int n, threads = 0;
+
+    for (n = 0; n < argc; n += 1) {
+	if (strncasecmp(argv[n], "cache-size=", 11) == 0) {
+	    size = atol(&argv[n][11]);
+	} else if (strncasecmp(argv[n], "cache-ttl=", 10) == 0) {
+	    ttl = atol(&argv[n][10]);
+	} else if (strncasecmp(argv[n], "cache-stale=", 12) == 0) {
+	    stale = atol(&argv[n][12]);
+	} else if (strncasecmp(argv[n], "throttle-size=", 14) == 0) {
+	    tsize = atol(&argv[n][14]);
+	} else if (strncasecmp(argv[n], "throttle-burst=", 15) == 0) {
+	    burst = atol(&argv[n][15]);
+	} else if (strncasecmp(argv[n], "throttle-rate=", 14) == 0) {
+	    rate = atol(&argv[n][14]);
+	} else if (strncasecmp(argv[n], "coalesce=", 9) == 0) {
+	    coalesce = atol(&argv[n][9]);
+	} else if (strncasecmp(argv[n], "engine-threads=", 15) == 0) {
+	    threads = atoi(&argv[n][15]);
+	} else if (strncasecmp(argv[n], "engine-timeout=", 15) == 0) {
+	    timeout = atol(&argv[n][15]);
+	} else if (strncasecmp(argv[n], "kdc=", 4) == 0) {
+	    kdcs = &argv[n][4];
+	} else if (strncasecmp(argv[n], "stats=", 6) == 0) {
+	    name = &argv[n][6];
+	} else if (strncasecmp(argv[n], "slow=", 5) == 0) {
+	    m->slow.threshold = atol(&argv[n][5]);
+	} else if (strncasecmp(argv[n], "slow-rate=", 10) == 0) {
+	    m->slow.rate = atol(&argv[n][10]);
+	} else if (krb5_service_option(m->service, argv[n]) == 0) {
+	    return(-1);
+	}
+    }
+
+    if (krb5_service_init(m->service)) return(-1);
+
+    if (threads > 0) {
+	m->engine = krb5engine_create(threads, timeout, kdcs);
+
+	if (m->engine == NULL) return(-1);
+    }
+
+    if ((size > 0) || (coalesce > 0)) {
+	m->cache = pwcache_create(size, ttl, 0, stale);
+
+	if (m->cache == NULL) return(-1);
+
+	pwcache_coalesce(m->cache, coalesce);
+    }
+
+    if (tsize > 0) {
+	m->tracker = throttle_create(tsize, burst, rate);
+
+	if (m->tracker == NULL) return(-1);
+    }
+
+    if (name) {
+	if ((m->stats = pwstats_create(name, m->scheme)) == NULL) return(-1);
+    }
+
+    return(0);
+}
+
+#if defined(STRESS)
+
+/*
+ *  Burst test for the modules' own: release n identical checks at once
+ *  against a stand-in for the KDC that takes a while to answer, and make
+ *  sure every check succeeds and the KDC was asked exactly once. The
+ *  module needs coalesce= (and no engine-threads=, which would bypass the
+ *  stand-in). Returns 0, or -1 if the test failed.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+
+static pthread_barrier_t ready;
+static unsigned long asked = 0;
+
+static int kdc(struct krb5_service *s, char *principal, char *password) {
+    __sync_fetch_and_add(&asked, 1);
+
+    usleep(100000);
+
+    return(0);
+}
+
+static void *checker(void *arg) {
+    struct berval passwd, cred;
+
+    passwd.bv_val = "user@EXAMPLE.COM";
+    passwd.bv_len = strlen(passwd.bv_val);
+
+    cred.bv_val = "secret";
+    cred.bv_len = strlen(cred.bv_val);
+
+    pthread_barrier_wait(&ready);
+
+    return((void *)(long)(krb5_module_check(arg, &passwd, &cred) !=
+	LUTIL_PASSWD_OK));
+}
+
+int krb5_module_burst(struct krb5_module *m, int n) {
+    unsigned long hits, misses, throttled, flights, joined;
+    pthread_t *thread;
+    long failures = 0;
+    void *result;
+    int k;
+
+    if ((m->cache == NULL) || (m->engine != NULL) || (n <= 0)) {
+	fprintf(stderr, "burst: needs coalesce= and no engine-threads=\n");
+	return(-1);
+    }
+
+    if ((thread = calloc(n, sizeof(*thread))) == NULL) {
+	perror("calloc");
+	return(-1);
+    }
+
+    m->verify = kdc;
+
+    pthread_barrier_init(&ready, NULL, n);
+
+    for (k = 0; k < n; k += 1) {
+	if (pthread_create(&thread[k], NULL, checker, m)) {
+	    perror("pthread_create");
+	    exit(1);
+	}
+    }
+
+    for (k = 0; k < n; k += 1) {
+	pthread_join(thread[k], &result);
+	failures += (long)result;
+    }
+
+    pthread_barrier_destroy(&ready);
+    free(thread);
+
+    krb5_module_stats(m, &hits, &misses, &throttled, &flights, &joined);
+
+    printf("%d identical checks: %ld failures, %lu KDC requests, %lu "
+	"flights, %lu joined\n", n, failures, asked, flights, joined);
+
+    return((failures || (asked != 1)) ? -1 : 0);
+}
+
+#endif
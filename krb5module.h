@@ -0,0 +1,46 @@
+/*
+ *  The check shared by the Kerberos password modules: the sanity checks
+ *  on the principal and the password, and the optional cache, throttle,
+ *  engine, statistics and slow log around the module's own verification,
+ *  with the module arguments for them. A module supplies its service and
+ *  its verification, and includes krb5_pw_validate.c for the service
+ *  functions declared below. Requires <lber.h> for struct berval and
+ *  "pwstats.h".
+ */
+
+struct krb5_service;
+
+struct krb5_module {
+    struct berval *scheme;
+    struct krb5_service *service;
+
+    /* Principal and password against the KDC: 0 or a Kerberos error. */
+
+    int (*verify)(struct krb5_service *, char *, char *);
+
+    int nofail;				/* passed to krb5engine_verify() */
+    struct pwcache *cache;
+    struct throttle *tracker;
+    struct krb5engine *engine;
+    struct pwstats *stats;
+    struct pwslow slow;
+};
+
+#define KRB5_MODULE_DEFAULT(scheme, service, verify, nofail) \
+    { &(scheme), &(service), verify, nofail, NULL, NULL, NULL, NULL, \
+	PWSLOW_DEFAULT }
+
+extern int krb5_service_init(struct krb5_service *);
+extern int krb5_service_option(struct krb5_service *, char *);
+extern void krb5_service_name(struct krb5_service *, char *, long);
+extern char *krb5_service_keytab(struct krb5_service *);
+
+extern int krb5_module_check(struct krb5_module *, const struct berval *,
+    const struct berval *);
+extern int krb5_module_init(struct krb5_module *, int, char *[]);
+extern void krb5_module_stats(struct krb5_module *, unsigned long *,
+    unsigned long *, unsigned long *, unsigned long *, unsigned long *);
+
+#if defined(STRESS)
+extern int krb5_module_burst(struct krb5_module *, int);
+#endif
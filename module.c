@@ -2,6 +2,8 @@
 #include <sys/param.h>
 #include <unistd.h>
 #include <libgen.h>
+#include <pthread.h>
+#include <time.h>
 
 #include <stdio.h>
 #include <dlfcn.h>
@@ -14,6 +16,354 @@ extern struct berval *pw_scheme;
 extern LUTIL_PASSWD_CHK_FUNC *pw_check;
 extern LUTIL_PASSWD_HASH_FUNC *pw_hash;
 
+/*
+ *  Load mode: "module <module> load <corpus> <threads> <count> [<module
+ *  arguments>]" calls the module's check function from threads threads
+ *  at once ("scale" for 1, 2, 4 and so on up to MAXTHREADS in turn) for
+ *  count checks in all, or for count seconds if it ends in "s". Each
+ *  line of the corpus is "<ok|bad> <stored password> <credentials>"
+ *  (the credentials being the rest of the line); blank lines and lines
+ *  starting with '#' are skipped. Each thread goes through the corpus
+ *  from its own starting point. The throughput, the latency percentiles
+ *  and the checks whose result was not the expected one are reported
+ *  for each run, with the module's cache, throttle and flight counts for
+ *  the run (from its <name>_stats() function, if any). The module is
+ *  initialized once, so with "scale" its cache and throttle carry over
+ *  from one run to the next: later runs start warm.
+ */
+
+#define MAXTHREADS	64
+
+/*
+ *  Latency histogram, in nanoseconds, after HdrHistogram: values below
+ *  2 * SUBBUCKETS are counted exactly, larger ones in SUBBUCKETS buckets
+ *  per power of two, so every value is known to within 1 / SUBBUCKETS.
+ */
+
+#define SUBBITS		5
+#define SUBBUCKETS	(1 << SUBBITS)
+#define BUCKETS		((64 - SUBBITS + 1) * SUBBUCKETS)
+
+struct histogram {
+    unsigned long count[BUCKETS];
+    unsigned long total, max;
+    double sum;
+};
+
+static int bucket(unsigned long v) {
+    int e;
+
+    if (v < 2 * SUBBUCKETS) return((int)v);
+
+    e = 63 - __builtin_clzl(v);
+
+    return(((e - SUBBITS) * SUBBUCKETS) + (int)(v >> (e - SUBBITS)));
+}
+
+/* The highest value counted in a bucket. */
+
+static unsigned long highest(int n) {
+    int shift;
+
+    if (n < 2 * SUBBUCKETS) return(n);
+
+    shift = (n / SUBBUCKETS) - 1;
+
+    return((((unsigned long)(n % SUBBUCKETS) + SUBBUCKETS + 1) << shift) - 1);
+}
+
+static void record(struct histogram *h, unsigned long v) {
+    h->count[bucket(v)] += 1;
+    h->total += 1;
+    h->sum += v;
+
+    if (v > h->max) h->max = v;
+}
+
+static double percentile(struct histogram *h, double p) {
+    unsigned long n, seen = 0;
+    int m;
+
+    n = (unsigned long)((p / 100.0) * h->total + 0.5);
+
+    if (n < 1) n = 1;
+
+    for (m = 0; m < BUCKETS; m += 1) {
+	if ((seen += h->count[m]) >= n) {
+	    return((highest(m) < h->max) ? highest(m) : h->max);
+	}
+    }
+
+    return(h->max);
+}
+
+/* The corpus of credentials, and what each thread did with it. */
+
+struct credentials {
+    struct berval passwd, cred;
+    int expect;
+};
+
+static struct credentials *corpus = NULL;
+static long entries = 0;
+
+struct worker {
+    pthread_t thread;
+    long start, checks, wrong;
+    struct histogram latency;
+};
+
+static long remaining = 0;
+static volatile int stop = 0, counted = 0;
+
+static pthread_barrier_t starting;
+
+static long corpusRead(char *file) {
+    char line[4096], *expect, *passwd, *cred, *end;
+    struct credentials *c;
+    long size = 0;
+    FILE *f;
+
+    if ((f = fopen(file, "r")) == NULL) {
+	perror(file);
+	return(-1);
+    }
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+	end = &line[strcspn(line, "\r\n")];
+	*end = '\0';
+
+	if (((expect = strtok(line, " \t")) == NULL) || (*expect == '#')) {
+	    continue;
+	}
+
+	if ((passwd = strtok(NULL, " \t")) == NULL) continue;
+
+	if ((cred = passwd + strlen(passwd)) == end) continue;
+
+	cred += 1 + strspn(cred + 1, " \t");
+
+	if (entries == size) {
+	    size = (size) ? size * 2 : 64;
+
+	    if ((c = realloc(corpus, size * sizeof(*c))) == NULL) {
+		perror("realloc");
+		return(-1);
+	    }
+
+	    corpus = c;
+	}
+
+	c = &corpus[entries++];
+
+	c->expect = (strcasecmp(expect, "ok") == 0) ? LUTIL_PASSWD_OK :
+	    LUTIL_PASSWD_ERR;
+	c->passwd.bv_val = strdup(passwd);
+	c->passwd.bv_len = strlen(passwd);
+	c->cred.bv_val = strdup(cred);
+	c->cred.bv_len = strlen(cred);
+    }
+
+    fclose(f);
+
+    return(entries);
+}
+
+static void *hammer(void *arg) {
+    struct worker *w = (struct worker *)arg;
+    struct timespec start, end;
+    struct credentials *c;
+    long n = w->start;
+    int code;
+
+    pthread_barrier_wait(&starting);
+
+    while (stop == 0) {
+	if (counted && (__sync_fetch_and_sub(&remaining, 1) <= 0)) break;
+
+	c = &corpus[n];
+	n = (n + 1) % entries;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	code = (*pw_check)(pw_scheme, &c->passwd, &c->cred, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	record(&w->latency, ((end.tv_sec - start.tv_sec) * 1000000000UL) +
+	    end.tv_nsec - start.tv_nsec);
+
+	w->checks += 1;
+
+	if (code != c->expect) w->wrong += 1;
+    }
+
+    return(NULL);
+}
+
+/*
+ *  One run with a number of threads. seen holds the module's counts as
+ *  of the end of the last run, so that each run reports its own.
+ */
+
+static void run(int threads, long count, int seconds,
+    void (*stats)(unsigned long *, unsigned long *, unsigned long *,
+	unsigned long *, unsigned long *),
+    unsigned long *seen)
+{
+    unsigned long hits = 0, misses = 0, throttled = 0, flights = 0, joined = 0;
+    struct timespec start, end;
+    struct histogram *total;
+    struct worker *w;
+    double elapsed;
+    long wrong = 0;
+    int m, n;
+
+    if (((w = calloc(threads, sizeof(*w))) == NULL) ||
+	((total = calloc(1, sizeof(*total))) == NULL)) {
+	perror("calloc");
+	exit(1);
+    }
+
+    stop = 0;
+    counted = (seconds == 0);
+    remaining = count;
+
+    pthread_barrier_init(&starting, NULL, threads + 1);
+
+    for (n = 0; n < threads; n += 1) {
+	w[n].start = (entries * n) / threads;
+
+	if (pthread_create(&w[n].thread, NULL, hammer, &w[n])) {
+	    perror("pthread_create");
+	    exit(1);
+	}
+    }
+
+    pthread_barrier_wait(&starting);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (seconds) {
+	sleep(count);
+	stop = 1;
+    }
+
+    for (n = 0; n < threads; n += 1) {
+	pthread_join(w[n].thread, NULL);
+
+	for (m = 0; m < BUCKETS; m += 1) {
+	    total->count[m] += w[n].latency.count[m];
+	}
+
+	total->total += w[n].latency.total;
+	total->sum += w[n].latency.sum;
+
+	if (w[n].latency.max > total->max) total->max = w[n].latency.max;
+
+	wrong += w[n].wrong;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    pthread_barrier_destroy(&starting);
+
+    elapsed = (end.tv_sec - start.tv_sec) +
+	((end.tv_nsec - start.tv_nsec) / 1e9);
+
+    if (stats) (*stats)(&hits, &misses, &throttled, &flights, &joined);
+
+    printf("%4d %10lu %10.1f %9.1f %9.1f %9.1f %9.1f %9.1f %7ld %6.2f%%",
+	threads, total->total, total->total / elapsed,
+	(total->total) ? total->sum / total->total / 1000.0 : 0.0,
+	percentile(total, 50.0) / 1000.0, percentile(total, 99.0) / 1000.0,
+	percentile(total, 99.9) / 1000.0, total->max / 1000.0, wrong,
+	(total->total) ? (100.0 * wrong) / total->total : 0.0);
+
+    if (stats) {
+	printf(" %9lu %9lu %9lu %9lu %9lu", hits - seen[0], misses - seen[1],
+	    throttled - seen[2], flights - seen[3], joined - seen[4]);
+
+	seen[0] = hits;
+	seen[1] = misses;
+	seen[2] = throttled;
+	seen[3] = flights;
+	seen[4] = joined;
+    }
+
+    printf("\n");
+
+    free(total);
+    free(w);
+}
+
+static int load(void *handle, char *module, char *file, char *threads,
+    char *count)
+{
+    void (*stats)(unsigned long *, unsigned long *, unsigned long *,
+	unsigned long *, unsigned long *);
+    unsigned long seen[5] = { 0, 0, 0, 0, 0 };
+    char name[256], *s;
+    long n;
+    int seconds, m;
+
+    if (corpusRead(file) <= 0) {
+	fprintf(stderr, "%s: no credentials\n", file);
+	return(1);
+    }
+
+    n = atol(count);
+    seconds = (count[strlen(count) - 1] == 's');
+
+    if (n <= 0) {
+	fprintf(stderr, "%s: bad count\n", count);
+	return(1);
+    }
+
+    /* Find the module's statistics, e.g. pssblf_stats() in pw-pssblf.so. */
+
+    snprintf(name, sizeof(name), "%s", basename(module));
+
+    if ((s = strchr(name, '.')) != NULL) *s = '\0';
+
+    s = (strncmp(name, "pw-", 3) == 0) ? &name[3] : name;
+
+    memmove(name, s, strlen(s) + 1);
+    strncat(name, "_stats", sizeof(name) - strlen(name) - 1);
+
+    stats = dlsym(handle, name);
+
+    printf("%ld credentials (%s), %s\n", entries, file, (seconds) ?
+	"seconds per run" : "checks per run");
+
+    if (stats && (strcasecmp(threads, "scale") == 0)) {
+	printf("counts are per run; the cache and throttle stay warm "
+	    "across runs\n");
+    }
+
+    printf("%4s %10s %10s %9s %9s %9s %9s %9s %7s %7s", "thr", "checks",
+	"checks/s", "mean us", "p50 us", "p99 us", "p99.9 us", "max us",
+	"wrong", "rate");
+
+    if (stats) {
+	printf(" %9s %9s %9s %9s %9s", "hits", "misses", "throttled",
+	    "flights", "joined");
+    }
+
+    printf("\n");
+
+    if (strcasecmp(threads, "scale") == 0) {
+	for (m = 1; m <= MAXTHREADS; m *= 2) run(m, n, seconds, stats, seen);
+    } else if ((m = atoi(threads)) > 0) {
+	run(m, n, seconds, stats, seen);
+    } else {
+	fprintf(stderr, "%s: bad number of threads\n", threads);
+	return(1);
+    }
+
+    return(0);
+}
+
 int main(int n, char *v[]) {
     int (*init)(int, char **);
     int code;
@@ -24,6 +374,13 @@ int main(int n, char *v[]) {
 
     char *s, path[MAXPATHLEN];
 
+    if (n < 2) {
+	fprintf(stderr, "usage: %s <module> [<passwd> <cred>]\n", v[0]);
+	fprintf(stderr, "       %s <module> load <corpus> <threads|scale> "
+	    "<checks|seconds>s [<module arguments>]\n", v[0]);
+	exit(1);
+    }
+
     if (n >= 2) {
 	if (*v[1] == '/') {
 	    s = v[1];
@@ -50,6 +407,15 @@ int main(int n, char *v[]) {
 	    if ((init = dlsym(handle, "init_module")) == NULL) {
 		fprintf(stderr, "%s while searching for \"%s\" in \"%s\"\n",
 		    dlerror(), "init_module", s);
+	    } else if ((n >= 6) && (strcmp(v[2], "load") == 0)) {
+		if ((*init)(n - 6, &v[6]) != 0) {
+		    fprintf(stderr, "init_module() failed\n");
+		    exit(1);
+		}
+
+		fprintf(stderr, "Scheme:\t%*s\n", pw_scheme->bv_len, pw_scheme->bv_val);
+
+		exit(load(handle, s, v[3], v[4], v[5]));
 	    } else {
 		code = (*init)(0, NULL);
 
@@ -4,11 +4,11 @@
 #include <krb5.h>
 
 #include "lutil.h"
+#include "pwstats.h"
+#include "krb5module.h"
 
 #include "krb5_pw_validate.c"
 
-LDAP_F (char *)ldap_pvt_get_fqdn LDAP_P((char *));
-
 static LUTIL_PASSWD_CHK_FUNC chk_pskrb5;
 
 #define PSKRB5SCHEME	"{X-SAKRB5}"
@@ -18,59 +18,75 @@ static struct berval scheme = {
     PSKRB5SCHEME
 };
 
+/*
+ *  Service, cache, throttle, engine and statistics (see init_module()
+ *  below). A KDC that cannot be verified with the service key fails the
+ *  check, with the engine or without.
+ */
+
+static struct krb5_service service = KRB5_SERVICE_DEFAULT;
+
+static struct krb5_module module =
+    KRB5_MODULE_DEFAULT(scheme, service, krb5_service_validate, 1);
+
 static int chk_pskrb5(
     const struct berval *scheme,
     const struct berval *passwd,
     const struct berval *cred,
     const char **text)
 {
-    char *host;
-    int n;
-
-    krb5_error_code code = 0;
-
-    /* Make sure there are no NULL characters in credentials. */
-
-    for (n = 0; n < cred->bv_len; n += 1) {
-	if (cred->bv_val[n] == '\0') {
-	    return(LUTIL_PASSWD_ERR);
-	}
-    }
+    return(krb5_module_check(&module, passwd, cred));
+}
 
-    /* Make sure that the credentials are NULL terminated. */
+/*
+ *  Report cache hits and misses, throttled checks, and checks that led a
+ *  flight or joined one (see coalesce=).
+ */
 
-    if (cred->bv_val[n] != '\0') {
-	return(LUTIL_PASSWD_ERR);
-    }
+void pskrb5_stats(unsigned long *hits, unsigned long *misses,
+    unsigned long *throttled, unsigned long *flights, unsigned long *joined)
+{
+    krb5_module_stats(&module, hits, misses, throttled, flights, joined);
+}
 
-    /* Make sure there are no NULL characters in password. */
+/*
+ *  Module arguments (e.g. "moduleload pw-pskrb5.so cache-size=10000") are
+ *  those of krb5_module_init().
+ */
 
-    for (n = 0; n < passwd->bv_len; n += 1) {
-	if (passwd->bv_val[n] == '\0') {
-	    return(LUTIL_PASSWD_ERR);
-	}
-    }
+int init_module(int argc, char *argv[]) {
+    if (krb5_module_init(&module, argc, argv)) return(-1);
 
-    /* Make sure that the password is NULL terminated. */
+    return lutil_passwd_add(&scheme, chk_pskrb5, NULL);
+}
 
-    if (passwd->bv_val[n] != '\0') {
-	return(LUTIL_PASSWD_ERR);
+#if defined(STRESS)
+
+/*
+ *  Burst test: "pskrb5_stress <n> coalesce=1000 ..." makes n identical
+ *  checks at once, which must reach the KDC once (see
+ *  krb5_module_burst()). Arguments after n are passed to init_module().
+ *  Build with
+ *
+ *	cc -DSTRESS -o pskrb5_stress pskrb5.c krb5module.c libmodule.c \
+ *	    pwcache.c throttle.c krb5engine.c pwstats.c -llber -lkrb5 \
+ *	    -lcrypto -lpthread -lrt
+ */
+
+#include <stdio.h>
+
+int main(int n, char *v[]) {
+    if ((n < 2) || (atoi(v[1]) <= 0)) {
+	fprintf(stderr, "Usage: %s <checks> [<module arguments>]\n", v[0]);
+	exit(1);
     }
 
-    host = ldap_pvt_get_fqdn( NULL );
-
-    if (host == NULL) {
-        return(LUTIL_PASSWD_ERR);
+    if (init_module(n - 2, &v[2])) {
+	fprintf(stderr, "init_module failed\n");
+	exit(1);
     }
 
-    code = krb5_pw_validate(passwd->bv_val, cred->bv_val, "ldap",
-	host, NULL);
-
-    ber_memfree(host);
-
-    return((code) ? LUTIL_PASSWD_ERR : LUTIL_PASSWD_OK);
+    exit((krb5_module_burst(&module, atoi(v[1]))) ? 1 : 0);
 }
 
-int init_module(int argc, char *argv[]) {
-    return lutil_passwd_add(&scheme, chk_pskrb5, NULL);
-}
+#endif
@@ -1,11 +1,19 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <pwd.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include <lber.h>
 #include <ldap.h>
 
 #include "krb5_pw_validate.c"
+#include "bcrypt.h"
+#include "argon2.h"
 
 static int DEBUG = 0, TEST = 0;
 
@@ -165,30 +173,43 @@ static int findValue(struct berval **v, char *s, int flag) {
 
 #define PSKRB5SCHEME	"{x-sakrb5}"
 #define PSSBLFSCHEME	"{x-sasblf}"
+#define PSARGON2SCHEME	"{x-saargon2}"
 
 static char *table[] = {
     "{kerberos}",
     PSKRB5SCHEME,
-    PSSBLFSCHEME
+    PSSBLFSCHEME,
+    PSARGON2SCHEME
 };
 
+#define SCHEMES	(sizeof(table)/sizeof(*table))
+
 /*
- *  Check a userPassword value entry to see if it should be ignored based on
- *  whether or not it starts with one of the strings in the table above.
+ *  Find which of the strings in the table above a userPassword value
+ *  starts with. Return its index in the table or -1 if none.
  */
 
-static int ignoreValue(struct berval *v) {
+static int valueScheme(struct berval *v) {
     int m, n;
 
-    for (n = 0; n < sizeof(table)/sizeof(*table); n += 1) {
+    for (n = 0; n < SCHEMES; n += 1) {
 	m = strlen(table[n]);
 
 	if ((v->bv_len > m) && (strncasecmp(v->bv_val, table[n], m) == 0)) {
-	    return(1);
+	    return(n);
 	}
     }
 
-    return(0);
+    return(-1);
+}
+
+/*
+ *  Check a userPassword value entry to see if it should be ignored based on
+ *  whether or not it starts with one of the strings in the table above.
+ */
+
+static int ignoreValue(struct berval *v) {
+    return(valueScheme(v) >= 0);
 }
 
 /* Print an array of attribute values. */
@@ -283,17 +304,102 @@ LDAPMod **unset(char *ccid, char *password, struct berval **os,
     return(mods);
 }
 
+/*
+ *  The bcrypt cost of new secondary passwords: the number in COSTFILE
+ *  (see "calibrate" below) if there is a valid one, otherwise COST. The
+ *  file may instead hold "argon2id <KiB> <passes> <lanes>", to make new
+ *  secondary passwords {x-saargon2} values with those parameters.
+ */
+
+#define COST	8
+
+#if ! defined(COSTFILE)
+    #define COSTFILE	"/usr/local/etc/pspasswd.cost"
+#endif
+
+static int newcost = COST;
+static long newmemory = 0, newpasses, newlanes;
+
+static pthread_once_t costread = PTHREAD_ONCE_INIT;
+
+static void readCost(void) {
+    char line[128];
+    long m, t, p;
+    FILE *f;
+    int n;
+
+    if ((f = fopen(COSTFILE, "r")) == NULL) return;
+
+    if (fgets(line, sizeof(line), f) == NULL) {
+	ldapError(0, "Ignoring invalid cost in", COSTFILE "\n");
+    } else if ((sscanf(line, "argon2id %ld %ld %ld", &m, &t, &p) == 3) &&
+	(p >= 1) && (m >= 8 * p) && (t >= 1)) {
+	newmemory = m;
+	newpasses = t;
+	newlanes = p;
+
+	/* Modules with the default limits would refuse these hashes. */
+
+	if ((m > ARGON2_MEMORY) || (t > ARGON2_PASSES) || (p > ARGON2_LANES)) {
+	    ldapError(0, "Argon2id cost above the module defaults in",
+		COSTFILE "\n    raise max-memory, max-passes or max-lanes "
+		"of pw-pssargon2.so to match\n");
+	}
+    } else if ((sscanf(line, "%d", &n) == 1) && (n >= 4) && (n <= 31)) {
+	newcost = n;
+    } else {
+	ldapError(0, "Ignoring invalid cost in", COSTFILE "\n");
+    }
+
+    fclose(f);
+}
+
+static int hashCost(void) {
+    pthread_once(&costread, readCost);
+
+    return(newcost);
+}
+
+/* Hash a new secondary password, returning the scheme used (or NULL). */
+
+static char *newHash(char *password, char *hash, long size) {
+    char salt[BCRYPT_SALTLEN + 1];
+    int cost = hashCost();
+
+    if (newmemory) {
+	if (argon2_hash_r(password, newmemory, newpasses, newlanes, hash,
+	    size) < 0) {
+	    return(NULL);
+	}
+
+	return(PSARGON2SCHEME);
+    }
+
+    if ((bcrypt_gensalt_r(cost, salt, sizeof(salt)) < 0) ||
+	(bcrypt_r(password, salt, hash, size) < 0)) {
+	return(NULL);
+    }
+
+    return(PSSBLFSCHEME);
+}
+
 /* Set the personal secondary password values in LDAP. */
 
 LDAPMod **set(char *ccid, char *password, struct berval **os,
     struct berval **up, int shortbus, void **space)
 {
+    char hash[ARGON2_HASHLEN + 1], *scheme;
     LDAPMod **mods = NULL;
     struct berval *bv;
 
     int m, n;
     char *s;
 
+    if ((scheme = newHash(password, hash, sizeof(hash))) == NULL) {
+	ldapError(0, "Unable to generate secondary password hash", NULL);
+	exit(1);
+    }
+
     m = ldap_count_values_len(up) + 2;
     n = (shortbus) ? 0 : ((os) ? ldap_count_values_len(os) + 1 : 1);
 
@@ -314,7 +420,7 @@ LDAPMod **set(char *ccid, char *password, struct berval **os,
 
     s = &s[256];
 
-    snprintf(s, 256, "%s%s", PSSBLFSCHEME, bcrypt(password, bcrypt_gensalt(8)));
+    snprintf(s, 256, "%s%s", scheme, hash);
     bv[1].bv_len = strlen(s);
     bv[1].bv_val = s;
 
@@ -356,6 +462,93 @@ LDAPMod **set(char *ccid, char *password, struct berval **os,
     return(mods);
 }
 
+/* One change to make, from the command line or a line of a batch. */
+
+struct operation {
+    char *command, *ccid, *oldpw, *newpw;
+    LDAPMod **(*option)();
+    int force;
+    char dn[1024];
+    struct berval **os, **up;
+    LDAPMod **mods;
+    void *space;
+    char *message;
+    int msgid, slot;
+    int sent;				/* the modification was sent */
+    struct operation *next;
+};
+
+/*
+ *  Check an operation's old password against the values found for its
+ *  user and, if the change may go ahead, build the modifications for it.
+ *  Sets op->mods, or op->message to say why not. The values must include
+ *  userPassword (op->up).
+ */
+
+static void prepare(struct operation *op) {
+    char hash[BCRYPT_HASHLEN + 1];
+    int shortbus = 0;
+    int m;
+    char *s;
+
+    if (op->os == NULL) {
+	if (DEBUG)
+	    ldapError(0, "No values found for organizationalstatus", NULL);
+    } else {
+	if (DEBUG) printValues("organizationalStatus", op->os);
+
+	/* Scan the returned values to see if "psp" is set. */
+
+	if (findValue(op->os, "psp", 0) >= 0) {
+	    shortbus = 1;
+	}
+    }
+
+    if (DEBUG) printValues("userPassword", op->up);
+
+    if (op->force == 0) {
+	if (shortbus == 0) {
+	    if (op->option != &set) {
+		op->message = "Secondary password incorrect";
+		return;
+	    }
+
+	    if (krb5_pw_validate(op->ccid, op->oldpw, NULL, NULL, NULL)) {
+		op->message = "Kerberos password incorrect";
+		return;
+	    }
+	} else if ((m = findValue(op->up, PSARGON2SCHEME, 1)) >= 0) {
+	    s = &(op->up[m]->bv_val[strlen(PSARGON2SCHEME)]);
+
+	    if (argon2_check(op->oldpw, s) < 0) {
+		op->message = "Secondary password incorrect";
+		return;
+	    }
+	} else {
+	    if ((m = findValue(op->up, PSSBLFSCHEME, 1)) < 0) {
+		op->message = "Internal error: no secondary password";
+		return;
+	    }
+
+	    s = &(op->up[m]->bv_val[10]);
+
+	    if ((bcrypt_r(op->oldpw, s, hash, sizeof(hash)) < 0) ||
+		strncmp(s, hash, strlen(s))) {
+		op->message = "Secondary password incorrect";
+		return;
+	    }
+	}
+    }
+
+    if (krb5_pw_validate(op->ccid, op->newpw, NULL, NULL, NULL) == 0) {
+	op->message = "Secondary and Kerberos passwords are the same";
+	return;
+    }
+
+    op->mods = (*op->option)(op->ccid, op->newpw, op->os, op->up, shortbus,
+	&op->space);
+}
+
 /* Main program. */
 
 static struct options {
@@ -367,192 +560,1355 @@ static struct options {
     { "set",   &set,   4 },
 };
 
-int main(int n, char *v[]) {
+/* Find the function for a command and how many arguments it takes. */
 
-    /* List of attributes for which to search. */
+static int lookup(struct operation *op, char *command) {
+    int m;
 
-    char *attrs[] = { "organizationalstatus", "userpassword", NULL };
+    op->command = command;
 
-    char *ccid = NULL, *newpw = NULL, *oldpw = NULL;
-    char buffer[1024], dn[1024];
-    char *s;
+    if (strncasecmp("force", command, strlen(command)) == 0) {
+	op->option = &set;
+	op->force = 1;
+	return(4);
+    }
 
-    void *space = NULL;
+    for (m = 0; m < sizeof(options) / sizeof(struct options); m += 1) {
+	if (strncasecmp(command, options[m].command, strlen(command)) == 0) {
+	    op->option = options[m].function;
+	    return(options[m].arguments);
+	}
+    }
 
-    int shortbus = 0;
-    int force = 0;
-    int code = 0;
-    int m;
+    return(-1);
+}
 
-    LDAPMod **(*option)() = NULL;
-    LDAPMod **mods = NULL;
+/*
+ *  Batch mode: read "<option> <ccid> <oldpwd> <newpwd>" lines (fields
+ *  separated by white space; blank lines and lines starting with '#' are
+ *  skipped) and apply them all over one connection. Up to window (at
+ *  most MAXWINDOW) operations are in progress at once: their searches
+ *  and modifications are pipelined on the connection while a pool of
+ *  worker threads checks passwords and generates hashes (prepare()).
+ *  Workers spend much of their time waiting for the KDC, so there is one
+ *  per operation in the window (up to WORKERS), not one per CPU. One
+ *  result line is printed per operation, in the order they complete; if
+ *  the connection is lost, every operation not completed is reported as
+ *  failed.
+ */
 
-    LDAPMessage *result;
-    LDAPMessage *e;
+#define WINDOW	64
+#define MAXWINDOW	4096
+#define WORKERS	256
 
-    struct berval **os, **up;
+static struct operation *queue = NULL, *prepared = NULL;
 
-    /* Allow for debugging and testing. */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER;
 
-    if (s = getenv("DEBUG")) DEBUG = atol(s);
-    if (s = getenv("TEST")) TEST = atol(s);
+static void *worker(void *arg) {
+    struct operation *op;
 
-    /* Check arguments to program. */
+    for (;;) {
+	pthread_mutex_lock(&lock);
 
-    if (n <= 1) {
-	fprintf(stderr, "usage: %s <option> <ccid> <oldpwd> <newpwd>\n", v[0]);
+	while (queue == NULL) pthread_cond_wait(&ready, &lock);
+
+	op = queue;
+	queue = op->next;
+
+	pthread_mutex_unlock(&lock);
+
+	prepare(op);
+
+	pthread_mutex_lock(&lock);
+
+	op->next = prepared;
+	prepared = op;
+
+	pthread_cond_signal(&done);
+	pthread_mutex_unlock(&lock);
+    }
+
+    return(NULL);
+}
+
+/* Parse a batch line into a new operation (NULL if there is none). */
+
+static struct operation *parse(char *line, int number) {
+    struct operation *op;
+    char *field[4], *s;
+    int m, n;
+
+    if ((op = calloc(1, sizeof(*op) + strlen(line) + 1)) == NULL) {
+	ldapError(0, "No space for batch operation", NULL);
 	exit(1);
     }
 
-    if (strncasecmp("force", v[1], strlen(v[1])) == 0) {
-	option = &set;
-	m = 4;
-	force = 1;
-    } else {
-	for (m = 0; m < sizeof(options) / sizeof(struct options); m += 1) {
-	    if (strncasecmp(v[1], options[m].command, strlen(v[1])) == 0) {
-		option = options[m].function;
-		m = options[m].arguments;
-		break;
-	    }
-	}
+    s = strcpy((char *)&op[1], line);
+
+    for (n = 0; n < 4; n += 1) {
+	field[n] = strtok(s, " \t\r\n");
+	s = NULL;
     }
 
-    if (option == NULL) {
-	fprintf(stderr, "%s: no such <option>\n", v[1]);
-	exit(1);
+    if ((field[0] == NULL) || (*field[0] == '#')) {
+	free(op);
+	return(NULL);
     }
 
-    if (n <= m) {
-	fprintf(stderr, "usage: %s <option> <ccid> <oldpwd> <newpwd>\n", v[0]);
-	exit(1);
+    op->ccid = (field[1]) ? field[1] : "-";
+
+    if ((m = lookup(op, field[0])) < 0) {
+	op->message = "no such <option>";
+    } else if (field[m - 1] == NULL) {
+	op->message = "missing arguments";
+    } else {
+	if (m >= 3) op->oldpw = field[2];
+	if (m >= 4) op->newpw = field[3];
+
+	snprintf(op->dn, sizeof(op->dn), "uid=%s,ou=people,dc=ualberta,dc=ca",
+	    op->ccid);
     }
 
-    if (m >= 2) ccid = v[2];
-    if (m >= 3) oldpw = v[3];
-    if (m >= 4) newpw = v[4];
+    op->slot = -1;
 
-    /* Initialize the LDAP connection. */
+    return(op);
+}
 
-    if (ldapInitialize(&ldap, SERVER) == LDAP_SUCCESS) {
+/* Report the outcome of an operation and forget it. */
 
-	/* Set the DN for the user in question. */
+static int failed = 0, changed = 0;
 
-	snprintf(dn, sizeof(dn), "uid=%s,ou=people,dc=ualberta,dc=ca", ccid);
+static void report(struct operation **slot, struct operation *op,
+    int code, char *message)
+{
+    printf("%s %s: %s%s%s\n", op->command, op->ccid,
+	(code) ? ldap_err2string(code) : "", (code) ? " " : "", message);
 
-	/* Search for required attributes associated with desired user. */
+    if ((code == 0) && (op->mods != NULL) && (TEST == 0)) {
+	changed += 1;
+    } else {
+	failed += 1;
+    }
 
-	code = ldap_search_s(ldap, dn, LDAP_SCOPE_BASE, "(objectclass=*)",
-	    attrs, 0, &result);
+    if (op->slot >= 0) slot[op->slot] = NULL;
 
-	if (code != LDAP_SUCCESS) {
-	    ldapError(code, "while performing search for required attributes",
-		NULL);
+    if (op->up) ldap_value_free_len(op->up);
+    if (op->os) ldap_value_free_len(op->os);
+
+    free(op->space);
+    free(op->mods);
+    free(op);
+}
+
+/*
+ *  The connection was lost: report the operations still in progress,
+ *  once the workers are done with any they hold, and those on the lines
+ *  not read yet, as failed.
+ */
+
+static void lost(struct operation **slot, int window, int busy, FILE *input,
+    int number, int code)
+{
+    char buffer[1024], line[1024];
+    struct operation *op;
+    int m;
+
+    pthread_mutex_lock(&lock);
+
+    for (; queue; busy -= 1) queue = queue->next;
+
+    while (busy > 0) {
+	while (prepared == NULL) pthread_cond_wait(&done, &lock);
+
+	for (; prepared; busy -= 1) prepared = prepared->next;
+    }
+
+    pthread_mutex_unlock(&lock);
+
+    for (m = 0; m < window; m += 1) {
+	if (slot[m]) report(slot, slot[m], code, "(connection lost)");
+    }
+
+    while (fgets(line, sizeof(line), input) != NULL) {
+	if ((op = parse(line, number += 1)) == NULL) continue;
+
+	if (op->message) {
+	    snprintf(buffer, sizeof(buffer), "line %d: %s", number,
+		op->message);
+	    report(slot, op, 0, buffer);
 	} else {
+	    report(slot, op, code, "(connection lost)");
+	}
+    }
+}
 
-	    /* Check whether the proper number of results were returned. */
+static int batch(char *file, int window) {
+    char *attrs[] = { "organizationalstatus", "userpassword", NULL };
+    struct operation **slot, *op, *next;
+    int eof = 0, inflight = 0, pending = 0, busy = 0, number = 0;
+    char buffer[1024], line[1024];
+    struct timeval poll;
+    LDAPMessage *result;
+    pthread_t thread;
+    FILE *input;
+    int code, m, n;
+
+    if (strcmp(file, "-") == 0) {
+	input = stdin;
+    } else if ((input = fopen(file, "r")) == NULL) {
+	perror(file);
+	return(1);
+    }
 
-	    if ((m = ldap_count_entries(ldap, result)) != 1) {
-		snprintf(buffer, sizeof(buffer),
-		    "Search returned incorrect number of entries: %d", m);
-		ldapError(0, buffer, NULL);
-	    } else {
+    if (window < 1) window = 1;
+    if (window > MAXWINDOW) window = MAXWINDOW;
 
-		/* Get the first (and only) returned LDAP node entry. */
+    if ((slot = calloc(window, sizeof(*slot))) == NULL) {
+	ldapError(0, "No space for batch operations", NULL);
+	return(1);
+    }
 
-		e = ldap_first_entry(ldap, result);
+    for (n = 0; (n < window) && (n < WORKERS); n += 1) {
+	if (pthread_create(&thread, NULL, worker, NULL) != 0) {
+	    ldapError(0, "Unable to start worker threads", NULL);
+	    return(1);
+	}
 
-		/* Get any values associated with "organizationalStatus". */
+	pthread_detach(thread);
+    }
 
-		os = ldap_get_values_len(ldap, e, "organizationalstatus");
+    if (ldapInitialize(&ldap, SERVER) != LDAP_SUCCESS) return(1);
 
-		if (os == NULL) {
-		    if (DEBUG)
-			ldapError(0,
-			    "No values found for organizationalstatus", NULL);
-		} else {
-		    if (DEBUG) printValues("organizationalStatus", os);
+    while ((eof == 0) || (inflight > 0)) {
 
-		    /* Scan the returned values to see if "psp" is set. */
+	/* Start searches for new operations while the window allows. */
 
-		    if (findValue(os, "psp", 0) >= 0) {
-			shortbus = 1;
-		    }
-		}
+	while ((eof == 0) && (inflight < window)) {
+	    if (fgets(line, sizeof(line), input) == NULL) {
+		eof = 1;
+		break;
+	    }
+
+	    if ((op = parse(line, number += 1)) == NULL) continue;
+
+	    if (op->message) {
+		snprintf(buffer, sizeof(buffer), "line %d: %s", number,
+		    op->message);
+		report(slot, op, 0, buffer);
+		continue;
+	    }
+
+	    code = ldap_search_ext(ldap, op->dn, LDAP_SCOPE_BASE,
+		"(objectclass=*)", attrs, 0, NULL, NULL, NULL, 0, &op->msgid);
+
+	    if (code != LDAP_SUCCESS) {
+		report(slot, op, code,
+		    "while performing search for required attributes");
+		continue;
+	    }
 
-		/* Get any values associated with "userPassword". */
+	    for (m = 0; slot[m]; m += 1);
+
+	    slot[op->slot = m] = op;
+
+	    inflight += 1;
+	    pending += 1;
+	}
+
+	/* Send modifications for operations the workers have prepared. */
+
+	pthread_mutex_lock(&lock);
+	op = prepared;
+	prepared = NULL;
+	pthread_mutex_unlock(&lock);
+
+	for (; op; op = next) {
+	    next = op->next;
+	    busy -= 1;
+
+	    if (op->message) {
+		report(slot, op, 0, op->message);
+		inflight -= 1;
+	    } else if (TEST) {
+		printMods(op->mods);
+		report(slot, op, 0, "Password not changed (TEST)");
+		inflight -= 1;
+	    } else {
+		if (DEBUG) printMods(op->mods);
 
-		up = ldap_get_values_len(ldap, e, "userpassword");
+		code = ldap_modify_ext(ldap, op->dn, op->mods, NULL, NULL,
+		    &op->msgid);
 
-		if (up == NULL) {
-		    ldapError(0, "Internal error: no password values found",
-			NULL);
+		if (code != LDAP_SUCCESS) {
+		    report(slot, op, code, "while changing password");
+		    inflight -= 1;
 		} else {
-		    if (DEBUG) printValues("userPassword", up);
-
-		    if (force == 0) {
-			if (shortbus == 0) {
-			    if (option != &set) {
-				printf("Secondary password incorrect\n");
-				code = -1;
-			    } else {
-				code = krb5_pw_validate(ccid, oldpw, NULL, NULL,
-				    NULL);
-
-				if (code) {
-				    printf("Kerberos password incorrect\n");
-				}
-			    }
-			} else {
-			    code = -1;
-
-			    if ((m = findValue(up, PSSBLFSCHEME, 1)) < 0) {
-				printf("Internal error: no secondary password\n");
-			    } else {
-				s = &(up[m]->bv_val[10]);
-
-				if (strncmp(s, bcrypt(oldpw, s), strlen(s))) {
-				    printf("Secondary password incorrect\n");
-				} else {
-				    code = 0;
-				}
-			    }
-			}
-		    }
-
-		    if (code == 0) {
-			if (krb5_pw_validate(ccid, newpw, NULL, NULL, NULL) == 0) {
-			    printf("Secondary and Kerberos passwords are the same\n");
-			} else {
-			    mods = (*option)(ccid, newpw, os, up, shortbus,
-				&space);
-
-			    if (TEST) {
-				printMods(mods);
-			    } else {
-				if (DEBUG) printMods(mods);
-
-				code = ldap_modify_s(ldap, dn, mods);
-
-				if (code) {
-				    ldapError(code,
-					"while changing password", NULL);
-				} else {
-				    printf("Password changed\n");
-				}
-			    }
-
-			    free(space);
-			    free(mods);
-			}
-		    }
+		    pending += 1;
 		}
-
-		if (up) ldap_value_free_len(up);
-		if (os) ldap_value_free_len(os);
 	    }
+	}
+
+	if (inflight == 0) continue;
+
+	/* Nothing expected from the server: wait for the workers. */
+
+	if (pending == 0) {
+	    pthread_mutex_lock(&lock);
+
+	    while (prepared == NULL) pthread_cond_wait(&done, &lock);
+
+	    pthread_mutex_unlock(&lock);
+	    continue;
+	}
+
+	/* Otherwise wait for the server, checking on busy workers often. */
+
+	poll.tv_sec = 0;
+	poll.tv_usec = 10000;
+
+	n = ldap_result(ldap, LDAP_RES_ANY, LDAP_MSG_ALL, (busy) ? &poll : NULL,
+	    &result);
+
+	if (n == 0) continue;
+
+	if (n < 0) {
+	    ldap_get_option(ldap, LDAP_OPT_RESULT_CODE, &code);
+
+	    lost(slot, window, busy, input, number, code);
+
+	    break;
+	}
+
+	for (m = 0; m < window; m += 1) {
+	    if (slot[m] && (slot[m]->msgid == ldap_msgid(result))) break;
+	}
 
+	if (m == window) {
 	    ldap_msgfree(result);
+	    continue;
+	}
+
+	op = slot[m];
+	op->msgid = 0;
+	pending -= 1;
+
+	ldap_parse_result(ldap, result, &code, NULL, NULL, NULL, NULL, 0);
+
+	if (n == LDAP_RES_MODIFY) {
+	    report(slot, op, code, (code) ? "while changing password" :
+		"Password changed");
+	    inflight -= 1;
+	} else if (code != LDAP_SUCCESS) {
+	    report(slot, op, code,
+		"while performing search for required attributes");
+	    inflight -= 1;
+	} else if ((m = ldap_count_entries(ldap, result)) != 1) {
+	    snprintf(buffer, sizeof(buffer),
+		"Search returned incorrect number of entries: %d", m);
+	    report(slot, op, 0, buffer);
+	    inflight -= 1;
+	} else {
+	    op->os = ldap_get_values_len(ldap, ldap_first_entry(ldap, result),
+		"organizationalstatus");
+	    op->up = ldap_get_values_len(ldap, ldap_first_entry(ldap, result),
+		"userpassword");
+
+	    if (op->up == NULL) {
+		report(slot, op, 0, "Internal error: no password values found");
+		inflight -= 1;
+	    } else {
+
+		/* Hand it to the workers to check and hash. */
+
+		pthread_mutex_lock(&lock);
+		op->next = queue;
+		queue = op;
+		pthread_cond_signal(&ready);
+		pthread_mutex_unlock(&lock);
+
+		busy += 1;
+	    }
+	}
+
+	ldap_msgfree(result);
+    }
+
+    ldap_unbind_ext(ldap, NULL, NULL);
+
+    fprintf(stderr, "%d operations: %d changed, %d not changed\n",
+	changed + failed, changed, failed);
+
+    return((failed || (eof == 0)) ? 1 : 0);
+}
+
+/* Outcomes of change() other than LDAP result codes (or API errors). */
+
+#define BROKEN	(-1001)
+#define REFUSED	(-1002)
+
+/*
+ *  Carry out an operation over a bound connection: look up the user,
+ *  check the old password and make the change (or, if TEST, print it).
+ *  Returns zero if done, an LDAP result code if the directory failed,
+ *  BROKEN if the entry is unusable or REFUSED if the password checks
+ *  failed; op->message (in buffer, if need be) then says why. op->sent
+ *  says whether the modification had been sent, so whether a connection
+ *  lost on the way may have left the change made.
+ */
+
+static int change(LDAP *ld, struct operation *op, char *buffer, long size) {
+
+    /* List of attributes for which to search. */
+
+    char *attrs[] = { "organizationalstatus", "userpassword", NULL };
+
+    LDAPMessage *result;
+    LDAPMessage *e;
+
+    int code = 0;
+    int m;
+
+    op->sent = 0;
+
+    /* Set the DN for the user in question. */
+
+    snprintf(op->dn, sizeof(op->dn), "uid=%s,ou=people,dc=ualberta,dc=ca",
+	op->ccid);
+
+    /* Search for required attributes associated with desired user. */
+
+    code = ldap_search_s(ld, op->dn, LDAP_SCOPE_BASE, "(objectclass=*)",
+	attrs, 0, &result);
+
+    if (code != LDAP_SUCCESS) {
+	op->message = "while performing search for required attributes";
+	return(code);
+    }
+
+    /* Check whether the proper number of results were returned. */
+
+    if ((m = ldap_count_entries(ld, result)) != 1) {
+	snprintf(buffer, size,
+	    "Search returned incorrect number of entries: %d", m);
+	op->message = buffer;
+	ldap_msgfree(result);
+	return(BROKEN);
+    }
+
+    /* Get the first (and only) returned LDAP node entry. */
+
+    e = ldap_first_entry(ld, result);
+
+    /* Get any values associated with "organizationalStatus". */
+
+    op->os = ldap_get_values_len(ld, e, "organizationalstatus");
+
+    /* Get any values associated with "userPassword". */
+
+    op->up = ldap_get_values_len(ld, e, "userpassword");
+
+    if (op->up == NULL) {
+	op->message = "Internal error: no password values found";
+	code = BROKEN;
+    } else {
+	prepare(op);
+
+	if (op->message) {
+	    code = REFUSED;
+	} else {
+	    if (TEST) {
+		printMods(op->mods);
+	    } else {
+		if (DEBUG) printMods(op->mods);
+
+		op->sent = 1;
+
+		code = ldap_modify_s(ld, op->dn, op->mods);
+
+		if (code) op->message = "while changing password";
+	    }
+
+	    free(op->space);
+	    free(op->mods);
+
+	    op->space = NULL;
+	    op->mods = NULL;
+	}
+    }
+
+    if (op->up) ldap_value_free_len(op->up);
+    if (op->os) ldap_value_free_len(op->os);
+
+    op->up = op->os = NULL;
+
+    ldap_msgfree(result);
+
+    return(code);
+}
+
+/*
+ *  Daemon mode: "pspasswd daemon <socket> [<connections>]" serves password
+ *  changes on a Unix domain socket, so a front end need not start a new
+ *  process, TLS session and bind for each one. Each line a client sends
+ *  is a request in the batch format and gets a one line reply: "0" and
+ *  the outcome if the password was changed, "2" and the reason if the
+ *  connection failed after the change was sent (so it may or may not
+ *  have been made), otherwise "1" and the reason. Requests are handled
+ *  concurrently by a few threads per connection in a pool of bound TLS
+ *  connections to the server. A connection idle for more than HEALTH
+ *  seconds is checked (with a "Who am I?" request) before use, and one
+ *  that fails is replaced; a request that finds the server down before
+ *  sending the change is retried once on a new connection. The socket is
+ *  made accessible to its owner and group only.
+ */
+
+#define CONNECTIONS	4
+#define HEALTH		30
+#define IDLE		10
+
+struct connection {
+    LDAP *ldap;
+    time_t used;
+    struct connection *next;
+};
+
+static struct connection *pool = NULL;
+
+static pthread_mutex_t pooled = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t returned = PTHREAD_COND_INITIALIZER;
+
+static int clients[WORKERS], head = 0, tail = 0;
+
+static pthread_mutex_t accepted = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t waiting = PTHREAD_COND_INITIALIZER;
+
+/* (Re)connect a pooled connection. */
+
+static void connect_pool(struct connection *c) {
+    if (c->ldap) ldap_unbind_ext_s(c->ldap, NULL, NULL);
+
+    c->ldap = NULL;
+
+    if (ldapInitialize(&c->ldap, SERVER) != LDAP_SUCCESS) {
+	if (c->ldap) ldap_unbind_ext_s(c->ldap, NULL, NULL);
+	c->ldap = NULL;
+    }
+
+    c->used = time(NULL);
+}
+
+/* Take a connection from the pool, making sure it still works. */
+
+static struct connection *checkout(void) {
+    struct connection *c;
+    struct berval *bv;
+
+    pthread_mutex_lock(&pooled);
+
+    while (pool == NULL) pthread_cond_wait(&returned, &pooled);
+
+    c = pool;
+    pool = c->next;
+
+    pthread_mutex_unlock(&pooled);
+
+    if (c->ldap && (time(NULL) - c->used > HEALTH)) {
+	if (ldap_whoami_s(c->ldap, &bv, NULL, NULL) == LDAP_SUCCESS) {
+	    if (bv) ber_bvfree(bv);
+	} else {
+	    connect_pool(c);
+	}
+    }
+
+    if (c->ldap == NULL) connect_pool(c);
+
+    return(c);
+}
+
+static void checkin(struct connection *c) {
+    c->used = time(NULL);
+
+    pthread_mutex_lock(&pooled);
+
+    c->next = pool;
+    pool = c;
+
+    pthread_cond_signal(&returned);
+    pthread_mutex_unlock(&pooled);
+}
+
+/* Handle one request line, returning the reply for it. */
+
+static void serve(char *line, char *reply, long size) {
+    struct connection *c;
+    struct operation *op;
+    char buffer[1024];
+    int code, tries;
+
+    if ((op = parse(line, 0)) == NULL) {
+	snprintf(reply, size, "1 empty request\n");
+	return;
+    }
+
+    if (op->message) {
+	snprintf(reply, size, "1 %s\n", op->message);
+	free(op);
+	return;
+    }
+
+    for (tries = 0; tries < 2; tries += 1) {
+	c = checkout();
+
+	if (c->ldap == NULL) {
+	    code = LDAP_SERVER_DOWN;
+	    op->message = "(server unavailable, try later)";
+	} else {
+	    op->message = NULL;
+
+	    code = change(c->ldap, op, buffer, sizeof(buffer));
+	}
+
+	if ((code == LDAP_SERVER_DOWN) || (code == LDAP_CONNECT_ERROR)) {
+	    connect_pool(c);
+	    checkin(c);
+
+	    /* Retrying a change that may have been made could undo it. */
+
+	    if (op->sent) break;
+
+	    continue;
+	}
+
+	checkin(c);
+	break;
+    }
+
+    if (code == 0) {
+	snprintf(reply, size, "0 %s\n", (TEST) ?
+	    "Password not changed (TEST)" : "Password changed");
+    } else if (op->sent && (code < 0)) {
+	snprintf(reply, size, "2 %s %s (outcome unknown)\n",
+	    ldap_err2string(code), op->message);
+    } else {
+	snprintf(reply, size, "1 %s%s%s\n", (code > 0) ?
+	    ldap_err2string(code) : "", (code > 0) ? " " : "", op->message);
+    }
+
+    free(op);
+}
+
+/* Write all of a reply. Returns 0, or -1 if the client cannot take it. */
+
+static int answer(int fd, char *reply) {
+    long m, n = strlen(reply);
+
+    while (n > 0) {
+	if ((m = write(fd, reply, n)) < 0) {
+	    if (errno == EINTR) continue;
+	    return(-1);
+	}
+
+	reply += m;
+	n -= m;
+    }
+
+    return(0);
+}
+
+static void *attend(void *arg) {
+    char line[1024], reply[2048];
+    struct timeval t;
+    FILE *in;
+    int fd;
+
+    for (;;) {
+	pthread_mutex_lock(&accepted);
+
+	while (head == tail) pthread_cond_wait(&waiting, &accepted);
+
+	fd = clients[head];
+	head = (head + 1) % WORKERS;
+
+	pthread_mutex_unlock(&accepted);
+
+	/* Don't let an idle client hold on to this thread. */
+
+	t.tv_sec = IDLE;
+	t.tv_usec = 0;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &t, sizeof(t));
+
+	if ((in = fdopen(fd, "r")) == NULL) {
+	    close(fd);
+	    continue;
+	}
+
+	while (fgets(line, sizeof(line), in) != NULL) {
+	    serve(line, reply, sizeof(reply));
+
+	    if (answer(fd, reply) < 0) break;
+	}
+
+	memset(line, 0, sizeof(line));
+
+	fclose(in);
+    }
+
+    return(NULL);
+}
+
+static int daemon_mode(char *path, int connections) {
+    struct sockaddr_un address;
+    struct connection *c;
+    pthread_t thread;
+    int fd, client, n;
+
+    if (connections < 1) connections = 1;
+    if (connections > WORKERS / 4) connections = WORKERS / 4;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Open the pool's connections now, so the first requests find them. */
+
+    for (n = 0; n < connections; n += 1) {
+	if ((c = calloc(1, sizeof(*c))) == NULL) {
+	    ldapError(0, "No space for connection pool", NULL);
+	    return(1);
+	}
+
+	connect_pool(c);
+	checkin(c);
+    }
+
+    for (n = 0; n < connections * 4; n += 1) {
+	if (pthread_create(&thread, NULL, attend, NULL) != 0) {
+	    ldapError(0, "Unable to start worker threads", NULL);
+	    return(1);
+	}
+
+	pthread_detach(thread);
+    }
+
+    memset(&address, 0, sizeof(address));
+
+    address.sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(address.sun_path)) {
+	ldapError(0, "Socket path too long", path);
+	return(1);
+    }
+
+    strcpy(address.sun_path, path);
+
+    unlink(path);
+    umask(007);
+
+    if (((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) ||
+	(bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0) ||
+	(listen(fd, 128) != 0)) {
+	perror(path);
+	return(1);
+    }
+
+    for (;;) {
+	if ((client = accept(fd, NULL, NULL)) < 0) {
+	    if (errno == EINTR) continue;
+	    perror("accept");
+	    return(1);
+	}
+
+	pthread_mutex_lock(&accepted);
+
+	if ((tail + 1) % WORKERS == head) {
+
+	    /* Too many clients waiting already. */
+
+	    pthread_mutex_unlock(&accepted);
+
+	    if (answer(client, "1 busy, try later\n") < 0) perror("write");
+
+	    close(client);
+	    continue;
+	}
+
+	clients[tail] = client;
+	tail = (tail + 1) % WORKERS;
+
+	pthread_cond_signal(&waiting);
+	pthread_mutex_unlock(&accepted);
+    }
+}
+
+/*
+ *  Audit mode: "pspasswd audit [<page size> [<workers>]]" reports which
+ *  password schemes the entries under ou=people use, without changing
+ *  anything. Entries are read a page at a time (with the simple paged
+ *  results control) and handed, through a queue of at most AUDITQUEUE
+ *  entries, to worker threads that classify them, so memory use does not
+ *  grow with the directory. Each entry gets a line on the standard output
+ *
+ *    <dn> <state> <psp> <kerberos> <x-sakrb5> <x-sasblf> <x-saargon2>
+ *    <other> <cost>
+ *
+ *  (tab separated) giving how it stands, whether organizationalStatus has
+ *  "psp", how many userPassword values of each scheme it has and the
+ *  bcrypt cost of its secondary password ("-" if none, "?" if it cannot
+ *  be parsed). The state is one of those in states[] below: the last
+ *  three are entries whose "psp" status and password values disagree.
+ *  A summary goes to the standard error.
+ */
+
+#define AUDITPAGE	500
+#define AUDITQUEUE	1024
+
+#define PEOPLE	"ou=people,dc=ualberta,dc=ca"
+
+/* Where the schemes are in the table above, and the count of the rest. */
+
+#define KERBEROS	0
+#define SAKRB5		1
+#define SASBLF		2
+#define SAARGON2	3
+#define OTHER		SCHEMES
+
+static char *states[] = {
+    "none",			/* no Kerberos values at all */
+    "kerberos",			/* {kerberos} only, no secondary password */
+    "psp",			/* secondary password set */
+    "psp-without-secondary",	/* "psp" but no secondary password value */
+    "secondary-without-psp",	/* {x-sakrb5} or secondary but no "psp" */
+    "mixed"			/* "psp" and {kerberos} or no {x-sakrb5} */
+};
+
+#define STATES	(sizeof(states)/sizeof(*states))
+
+/* What the workers have counted (each its own, added up at the end). */
+
+struct census {
+    unsigned long entries, psp, malformed;
+    unsigned long carry[SCHEMES + 1];
+    unsigned long state[STATES];
+    unsigned long cost[32];
+    pthread_t thread;
+};
+
+static LDAPMessage *entries[AUDITQUEUE];
+static int first = 0, last = 0, scanned = 0;
+
+static pthread_mutex_t audited = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t found = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t room = PTHREAD_COND_INITIALIZER;
+
+/* Cost of a {x-sasblf} value ("$2a$NN$<salt><hash>"), or -1 if malformed. */
+
+static int blfCost(struct berval *v) {
+    long n = strlen(PSSBLFSCHEME);
+    char *s = &v->bv_val[n];
+    int cost;
+
+    n = v->bv_len - n;
+
+    if ((n < 7) || (s[0] != '$') || (s[1] != '2')) return(-1);
+
+    if (s[2] != '$') {
+	s += 1;
+	n -= 1;
+    }
+
+    if ((s[2] != '$') || (s[5] != '$')) return(-1);
+
+    if ((s[3] < '0') || (s[3] > '9') || (s[4] < '0') || (s[4] > '9')) {
+	return(-1);
+    }
+
+    cost = ((s[3] - '0') * 10) + (s[4] - '0');
+
+    return(((cost < 32) && (n == 6 + 53)) ? cost : -1);
+}
+
+/* Classify one entry, print its line and count it. */
+
+static void classify(struct census *c, LDAPMessage *e) {
+    struct berval **os, **up;
+    int carry[SCHEMES + 1];
+    int psp, state, cost = -2;
+    char *dn;
+    int m, n;
+
+    memset(carry, 0, sizeof(carry));
+
+    dn = ldap_get_dn(ldap, e);
+    os = ldap_get_values_len(ldap, e, "organizationalstatus");
+    up = ldap_get_values_len(ldap, e, "userpassword");
+
+    psp = (os) ? (findValue(os, "psp", 0) >= 0) : 0;
+
+    for (n = 0; up && up[n]; n += 1) {
+	if ((m = valueScheme(up[n])) < 0) m = OTHER;
+
+	carry[m] += 1;
+
+	if (m == SASBLF) {
+	    if ((m = blfCost(up[n])) < 0) {
+		c->malformed += 1;
+	    } else {
+		c->cost[m] += 1;
+	    }
+
+	    if (cost == -2) cost = m;
+	}
+    }
+
+    if (psp) {
+	if ((carry[SASBLF] + carry[SAARGON2]) == 0) {
+	    state = 3;
+	} else if (carry[KERBEROS] || (carry[SAKRB5] == 0)) {
+	    state = 5;
+	} else {
+	    state = 2;
+	}
+    } else {
+	if (carry[SAKRB5] || carry[SASBLF] || carry[SAARGON2]) {
+	    state = 4;
+	} else {
+	    state = (carry[KERBEROS]) ? 1 : 0;
+	}
+    }
+
+    /* Keep other workers' lines from landing in the middle of this one. */
+
+    flockfile(stdout);
+
+    printf("%s\t%s\t%d\t%d\t%d\t%d\t%d\t%d\t", (dn) ? dn : "-",
+	states[state], psp, carry[KERBEROS], carry[SAKRB5], carry[SASBLF],
+	carry[SAARGON2], carry[OTHER]);
+
+    if (cost >= 0) {
+	printf("%d\n", cost);
+    } else {
+	printf("%s\n", (cost == -2) ? "-" : "?");
+    }
+
+    funlockfile(stdout);
+
+    c->entries += 1;
+    c->psp += psp;
+    c->state[state] += 1;
+
+    for (m = 0; m <= OTHER; m += 1) {
+	if (carry[m]) c->carry[m] += 1;
+    }
+
+    if (up) ldap_value_free_len(up);
+    if (os) ldap_value_free_len(os);
+    if (dn) ldap_memfree(dn);
+}
+
+/* Take entries off the queue until the scan is over. */
+
+static void *inspect(void *arg) {
+    struct census *c = (struct census *)arg;
+    LDAPMessage *e;
+
+    for (;;) {
+	pthread_mutex_lock(&audited);
+
+	while ((first == last) && (scanned == 0)) {
+	    pthread_cond_wait(&found, &audited);
+	}
+
+	if (first == last) {
+	    pthread_mutex_unlock(&audited);
+	    break;
+	}
+
+	e = entries[first];
+	first = (first + 1) % AUDITQUEUE;
+
+	pthread_cond_signal(&room);
+	pthread_mutex_unlock(&audited);
+
+	classify(c, e);
+
+	ldap_msgfree(e);
+    }
+
+    return(NULL);
+}
+
+static void enqueue(LDAPMessage *e) {
+    pthread_mutex_lock(&audited);
+
+    while ((last + 1) % AUDITQUEUE == first) {
+	pthread_cond_wait(&room, &audited);
+    }
+
+    entries[last] = e;
+    last = (last + 1) % AUDITQUEUE;
+
+    pthread_cond_signal(&found);
+    pthread_mutex_unlock(&audited);
+}
+
+static int audit(int page, int workers) {
+    char *attrs[] = { "organizationalstatus", "userpassword", NULL };
+    LDAPControl *control[2], **returned;
+    struct census *census, total;
+    struct timespec start, end;
+    struct berval cookie;
+    LDAPMessage *result;
+    int code = 0, count, msgid, m, n;
+    double elapsed;
+
+    if (page < 1) page = AUDITPAGE;
+    if (workers < 1) workers = 1;
+    if (workers > WORKERS) workers = WORKERS;
+
+    if ((census = calloc(workers, sizeof(*census))) == NULL) {
+	ldapError(0, "No space for audit workers", NULL);
+	return(1);
+    }
+
+    if (ldapInitialize(&ldap, SERVER) != LDAP_SUCCESS) return(1);
+
+    for (n = 0; n < workers; n += 1) {
+	if (pthread_create(&census[n].thread, NULL, inspect, &census[n])) {
+	    ldapError(0, "Unable to start worker threads", NULL);
+	    return(1);
+	}
+    }
+
+    printf("# dn\tstate\tpsp\tkerberos\tx-sakrb5\tx-sasblf\tx-saargon2\t"
+	"other\tcost\n");
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    cookie.bv_val = NULL;
+    cookie.bv_len = 0;
+
+    do {
+	code = ldap_create_page_control(ldap, page, &cookie, 0, &control[0]);
+
+	if (cookie.bv_val) ber_memfree(cookie.bv_val);
+
+	cookie.bv_val = NULL;
+	cookie.bv_len = 0;
+
+	if (code != LDAP_SUCCESS) {
+	    ldapError(code, "while creating paged results control", NULL);
+	    break;
+	}
+
+	control[1] = NULL;
+
+	code = ldap_search_ext(ldap, PEOPLE, LDAP_SCOPE_ONELEVEL,
+	    "(objectclass=*)", attrs, 0, control, NULL, NULL, 0, &msgid);
+
+	ldap_control_free(control[0]);
+
+	if (code != LDAP_SUCCESS) {
+	    ldapError(code, "while searching " PEOPLE, NULL);
+	    break;
+	}
+
+	/* Pass entries on as they arrive, until the end of the page. */
+
+	while ((n = ldap_result(ldap, msgid, LDAP_MSG_ONE, NULL, &result)) > 0) {
+	    if (n == LDAP_RES_SEARCH_ENTRY) {
+		enqueue(result);
+		continue;
+	    }
+
+	    if (n != LDAP_RES_SEARCH_RESULT) {
+		ldap_msgfree(result);
+		continue;
+	    }
+
+	    returned = NULL;
+
+	    ldap_parse_result(ldap, result, &code, NULL, NULL, NULL,
+		&returned, 1);
+
+	    if ((code == LDAP_SUCCESS) && returned &&
+		(control[0] = ldap_control_find(LDAP_CONTROL_PAGEDRESULTS,
+		returned, NULL))) {
+		ldap_parse_pageresponse_control(ldap, control[0], &count,
+		    &cookie);
+	    }
+
+	    if (returned) ldap_controls_free(returned);
+
+	    if (code != LDAP_SUCCESS) {
+		ldapError(code, "while searching " PEOPLE, NULL);
+	    }
+
+	    break;
+	}
+
+	if (n <= 0) {
+	    ldap_get_option(ldap, LDAP_OPT_RESULT_CODE, &code);
+	    ldapError(code, "while reading search results", NULL);
+	    if (code == LDAP_SUCCESS) code = LDAP_OTHER;
+	}
+    } while ((code == LDAP_SUCCESS) && (cookie.bv_len > 0));
+
+    if (cookie.bv_val) ber_memfree(cookie.bv_val);
+
+    /* Let the workers finish the queue, then add up what they found. */
+
+    pthread_mutex_lock(&audited);
+    scanned = 1;
+    pthread_cond_broadcast(&found);
+    pthread_mutex_unlock(&audited);
+
+    memset(&total, 0, sizeof(total));
+
+    for (n = 0; n < workers; n += 1) {
+	pthread_join(census[n].thread, NULL);
+
+	total.entries += census[n].entries;
+	total.psp += census[n].psp;
+	total.malformed += census[n].malformed;
+
+	for (m = 0; m <= OTHER; m += 1) total.carry[m] += census[n].carry[m];
+	for (m = 0; m < STATES; m += 1) total.state[m] += census[n].state[m];
+	for (m = 0; m < 32; m += 1) total.cost[m] += census[n].cost[m];
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    elapsed = (end.tv_sec - start.tv_sec) +
+	((end.tv_nsec - start.tv_nsec) / 1e9);
+
+    fflush(stdout);
+
+    fprintf(stderr, "%lu entries in %.1f seconds (%.0f per second)%s\n",
+	total.entries, elapsed, (elapsed > 0) ? total.entries / elapsed : 0.0,
+	(code) ? ", incomplete" : "");
+
+    fprintf(stderr, "%8lu with organizationalStatus psp\n", total.psp);
+
+    for (m = 0; m < SCHEMES; m += 1) {
+	fprintf(stderr, "%8lu with %s values\n", total.carry[m], table[m]);
+    }
+
+    fprintf(stderr, "%8lu with other values\n", total.carry[OTHER]);
+
+    for (m = 0; m < 32; m += 1) {
+	if (total.cost[m]) {
+	    fprintf(stderr, "%8lu %s values of cost %d\n", total.cost[m],
+		PSSBLFSCHEME, m);
+	}
+    }
+
+    if (total.malformed) {
+	fprintf(stderr, "%8lu malformed %s values\n", total.malformed,
+	    PSSBLFSCHEME);
+    }
+
+    for (m = 0; m < STATES; m += 1) {
+	fprintf(stderr, "%8lu %s\n", total.state[m], states[m]);
+    }
+
+    ldap_unbind_ext(ldap, NULL, NULL);
+
+    free(census);
+
+    return((code) ? 1 : 0);
+}
+
+/*
+ *  Calibrate mode: "pspasswd calibrate <ms> [<binds per second> [save]]"
+ *  times bcrypt on this host at each cost in turn, from the lowest up to
+ *  the first that takes longer than ms milliseconds. For each it shows
+ *  how long a password check takes (the median of up to CALIBRATIONS
+ *  runs), how many checks one CPU can do per second and how many CPUs
+ *  the given peak bind rate would keep busy. It recommends the highest
+ *  cost within the time that does not need more CPUs than the host has
+ *  and, with "save", writes it to COSTFILE for new hashes (see set()).
+ *  A COSTFILE that makes new hashes argon2id is not replaced: it must be
+ *  removed first, to go back to bcrypt. Existing hashes keep their cost
+ *  until the password is next changed.
+ */
+
+#define CALIBRATIONS	5
+
+static double hashTime(int n) {
+    char salt[BCRYPT_SALTLEN + 1], hash[BCRYPT_HASHLEN + 1];
+    double t[CALIBRATIONS], total = 0.0, x;
+    struct timespec start, end;
+    int k, m;
+
+    if (bcrypt_gensalt_r(n, salt, sizeof(salt)) < 0) return(-1.0);
+
+    for (m = 0; (m < CALIBRATIONS) && (total < 1.0); m += 1) {
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (bcrypt_r("calibration", salt, hash, sizeof(hash)) < 0) {
+	    return(-1.0);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	x = (end.tv_sec - start.tv_sec) + ((end.tv_nsec - start.tv_nsec) / 1e9);
+
+	total += x;
+
+	for (k = m; (k > 0) && (t[k - 1] > x); k -= 1) t[k] = t[k - 1];
+
+	t[k] = x;
+    }
+
+    return(t[m / 2]);
+}
+
+static int calibrate(double target, double rate, int save) {
+    int cpus = sysconf(_SC_NPROCESSORS_ONLN), best = -1, n;
+    char using[128];
+    double t;
+    FILE *f;
+
+    if (cpus < 1) cpus = 1;
+
+    hashTime(4);
+
+    printf("cost  ms/check  checks/s/cpu");
+    if (rate > 0) printf("  cpus at %.0f/s", rate);
+    printf("\n");
+
+    for (n = 4; n <= 31; n += 1) {
+	if ((t = hashTime(n)) < 0) {
+	    ldapError(0, "Unable to time bcrypt", NULL);
+	    return(1);
+	}
+
+	printf("%4d %9.2f %13.1f", n, t * 1000.0, 1.0 / t);
+	if (rate > 0) printf(" %14.2f", rate * t);
+	printf("\n");
+
+	if (t * 1000.0 > target) break;
+
+	if ((rate <= 0) || (rate * t <= cpus)) best = n;
+    }
+
+    if (best < 0) {
+	printf("\nNo cost meets the target on this host (%d CPUs)\n", cpus);
+	return(1);
+    }
+
+    /* Say what new hashes use now, which may not be bcrypt. */
+
+    hashCost();
+
+    if (newmemory) {
+	snprintf(using, sizeof(using), "argon2id %ld KiB, %ld passes, %ld "
+	    "lanes", newmemory, newpasses, newlanes);
+    } else {
+	snprintf(using, sizeof(using), "bcrypt cost %d", newcost);
+    }
+
+    printf("\nRecommended cost: %d (this host has %d CPUs, now using %s)\n",
+	best, cpus, using);
+
+    if (best < COST) {
+	printf("Warning: that is less than the default cost of %d\n", COST);
+    }
+
+    if (save && newmemory) {
+	printf("Not saved: %s selects argon2id; remove it first to go back "
+	    "to bcrypt\n", COSTFILE);
+	return(1);
+    }
+
+    if (save) {
+	if (((f = fopen(COSTFILE, "w")) == NULL) ||
+	    (fprintf(f, "%d\n", best) < 0) || (fclose(f) != 0)) {
+	    perror(COSTFILE);
+	    return(1);
+	}
+
+	printf("Saved in %s\n", COSTFILE);
+    }
+
+    return(0);
+}
+
+int main(int n, char *v[]) {
+    char buffer[1024];
+    char *s;
+
+    struct operation op;
+
+    int code = 0;
+    int m;
+
+    /* Allow for debugging and testing. */
+
+    if (s = getenv("DEBUG")) DEBUG = atol(s);
+    if (s = getenv("TEST")) TEST = atol(s);
+
+    /* Check arguments to program. */
+
+    if (n <= 1) {
+	fprintf(stderr, "usage: %s <option> <ccid> <oldpwd> <newpwd>\n", v[0]);
+	fprintf(stderr, "       %s batch [<file> [<window>]]\n", v[0]);
+	fprintf(stderr, "       %s daemon <socket> [<connections>]\n", v[0]);
+	fprintf(stderr, "       %s audit [<page size> [<workers>]]\n", v[0]);
+	fprintf(stderr, "       %s calibrate <ms> [<binds per second> [save]]\n",
+	    v[0]);
+	exit(1);
+    }
+
+    if (strncasecmp("batch", v[1], strlen(v[1])) == 0) {
+	exit(batch((n > 2) ? v[2] : "-", (n > 3) ? atoi(v[3]) : WINDOW));
+    }
+
+    if ((strncasecmp("daemon", v[1], strlen(v[1])) == 0) && (n > 2)) {
+	exit(daemon_mode(v[2], (n > 3) ? atoi(v[3]) : CONNECTIONS));
+    }
+
+    if (strncasecmp("audit", v[1], strlen(v[1])) == 0) {
+	exit(audit((n > 2) ? atoi(v[2]) : AUDITPAGE,
+	    (n > 3) ? atoi(v[3]) : sysconf(_SC_NPROCESSORS_ONLN)));
+    }
+
+    if ((strncasecmp("calibrate", v[1], strlen(v[1])) == 0) && (n > 2)) {
+	exit(calibrate(atof(v[2]), (n > 3) ? atof(v[3]) : 0.0,
+	    (n > 4) && (strcasecmp(v[4], "save") == 0)));
+    }
+
+    memset(&op, 0, sizeof(op));
+
+    if ((m = lookup(&op, v[1])) < 0) {
+	fprintf(stderr, "%s: no such <option>\n", v[1]);
+	exit(1);
+    }
+
+    if (n <= m) {
+	fprintf(stderr, "usage: %s <option> <ccid> <oldpwd> <newpwd>\n", v[0]);
+	exit(1);
+    }
+
+    if (m >= 2) op.ccid = v[2];
+    if (m >= 3) op.oldpw = v[3];
+    if (m >= 4) op.newpw = v[4];
+
+    /* Initialize the LDAP connection. */
+
+    if (ldapInitialize(&ldap, SERVER) == LDAP_SUCCESS) {
+	code = change(ldap, &op, buffer, sizeof(buffer));
+
+	if (code == REFUSED) {
+	    printf("%s\n", op.message);
+	} else if (code == BROKEN) {
+	    ldapError(0, op.message, NULL);
+	} else if (code) {
+	    ldapError(code, op.message, NULL);
+	} else if (TEST == 0) {
+	    printf("Password changed\n");
 	}
 
 	ldap_unbind_s(ldap);
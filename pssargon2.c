@@ -0,0 +1,144 @@
+#include <ldap.h>
+#include <lber.h>
+
+#include <pwd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "lutil.h"
+#include "argon2.h"
+#include "pwstats.h"
+#include "pwcheck.h"
+
+static LUTIL_PASSWD_CHK_FUNC chk_pssargon2;
+
+#define PSARGON2SCHEME  "{X-SAARGON2}"
+
+static struct berval scheme = {
+    sizeof(PSARGON2SCHEME) - 1,
+    PSARGON2SCHEME
+};
+
+/* The most memory (KiB), passes and lanes a stored hash may ask for. */
+
+static long maxmemory = ARGON2_MEMORY;
+static long maxpasses = ARGON2_PASSES;
+static long maxlanes = ARGON2_LANES;
+
+/*
+ *  Make sure that the supplied password is an Argon2id hash, and refuse
+ *  hashes that would cost more than this server allows. A check takes a
+ *  slot for each of its lanes, as each keeps a CPU busy.
+ */
+
+static long weigh(const struct berval *passwd) {
+    long memory, passes, lanes;
+
+    if ((passwd->bv_len > ARGON2_HASHLEN) ||
+	strncmp(passwd->bv_val, "$argon2id$", 10)) {
+	return(0);
+    }
+
+    if ((argon2_params(passwd->bv_val, &memory, &passes, &lanes) < 0) ||
+	(memory > maxmemory) || (passes > maxpasses) || (lanes > maxlanes)) {
+	return(0);
+    }
+
+    return(lanes);
+}
+
+/*
+ *  Hash the credentials with the memory, passes and lanes of the stored
+ *  hash (its lanes filled in parallel) and compare the tags.
+ */
+
+static int verify(const char *cred, const char *passwd) {
+    return(argon2_check(cred, passwd));
+}
+
+/* Cache, throttle, admission and statistics (see init_module() below). */
+
+static struct pwcheck check = PWCHECK_DEFAULT(scheme, weigh, verify);
+
+static int chk_pssargon2(
+    const struct berval *scheme,
+    const struct berval *passwd,
+    const struct berval *cred,
+    const char **text)
+{
+    return(pwcheck(&check, passwd, cred));
+}
+
+/* Report cache hits and misses and throttled checks. */
+
+void pssargon2_stats(unsigned long *hits, unsigned long *misses,
+    unsigned long *throttled, unsigned long *flights, unsigned long *joined)
+{
+    pwcheck_stats(&check, hits, misses, throttled, flights, joined);
+}
+
+/*
+ *  Module arguments (e.g. "moduleload pw-pssargon2.so cache-size=10000")
+ *  are those of pwcheck_option(), where admit= counts lanes, and:
+ *
+ *    max-memory=<KiB>    refuse hashes using more memory (65536)
+ *    max-passes=<n>      refuse hashes making more passes (3)
+ *    max-lanes=<n>       refuse hashes with more lanes (4); raise these
+ *                        along with the argon2id line of pspasswd's
+ *                        cost file
+ */
+
+int init_module(int argc, char *argv[]) {
+    int n;
+
+    for (n = 0; n < argc; n += 1) {
+	if (pwcheck_option(&check, argv[n])) {
+	    continue;
+	} else if (strncasecmp(argv[n], "max-memory=", 11) == 0) {
+	    maxmemory = atol(&argv[n][11]);
+	} else if (strncasecmp(argv[n], "max-passes=", 11) == 0) {
+	    maxpasses = atol(&argv[n][11]);
+	} else if (strncasecmp(argv[n], "max-lanes=", 10) == 0) {
+	    maxlanes = atol(&argv[n][10]);
+	} else {
+	    return(-1);
+	}
+    }
+
+    if (pwcheck_init(&check)) return(-1);
+
+    return lutil_passwd_add(&scheme, chk_pssargon2, NULL);
+}
+
+#if defined(STRESS)
+
+/*
+ *  Stress test: hammer chk_pssargon2() from many threads at once (see
+ *  pwcheck_stress()). Arguments are passed to init_module(), so the
+ *  cache can be exercised too. Build with
+ *
+ *	cc -DSTRESS -o pssargon2_stress pssargon2.c pwcheck.c libmodule.c \
+ *	    pwcache.c throttle.c pwstats.c admit.c argon2.c base64.c \
+ *	    -llber -lcrypto -lpthread -lrt
+ */
+
+#include <stdio.h>
+
+int main(int n, char *v[]) {
+    char hash[ARGON2_HASHLEN + 1];
+
+    if (init_module(n - 1, &v[1])) {
+	fprintf(stderr, "init_module failed\n");
+	exit(1);
+    }
+
+    if (argon2_hash_r("secret", 1024, 1, 2, hash, sizeof(hash)) < 0) {
+	perror("argon2");
+	exit(1);
+    }
+
+    exit((pwcheck_stress(&check, hash)) ? 1 : 0);
+}
+
+#endif
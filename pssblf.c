@@ -2,8 +2,13 @@
 #include <lber.h>
 
 #include <pwd.h>
+#include <stdlib.h>
+#include <strings.h>
 
 #include "lutil.h"
+#include "bcrypt.h"
+#include "pwstats.h"
+#include "pwcheck.h"
 
 static LUTIL_PASSWD_CHK_FUNC chk_pssblf;
 
@@ -14,57 +19,89 @@ static struct berval scheme = {
     PSSBLFSCHEME
 };
 
+/* Let's just make sure that the supplied password is the correct length. */
+
+static long weigh(const struct berval *passwd) {
+    return((passwd->bv_len == 7 + 22 + 31) ? 1 : 0);
+}
+
+/*
+ *  Compare credentials with BLF-encrypted password. The stored hash is
+ *  decoded (and kept decoded for this thread), and the raw digests
+ *  compared in constant time.
+ */
+
+static int verify(const char *cred, const char *passwd) {
+    return(bcrypt_check(cred, passwd));
+}
+
+/* Cache, throttle, admission and statistics (see init_module() below). */
+
+static struct pwcheck check = PWCHECK_DEFAULT(scheme, weigh, verify);
+
 static int chk_pssblf(
     const struct berval *scheme,
     const struct berval *passwd,
     const struct berval *cred,
     const char **text)
 {
-    int n;
+    return(pwcheck(&check, passwd, cred));
+}
 
-    /* Make sure there are no NULL characters in credentials. */
+/* Report cache hits and misses and throttled checks. */
 
-    for (n = 0; n < cred->bv_len; n += 1) {
-	if (cred->bv_val[n] == '\0') {
-	    return(LUTIL_PASSWD_ERR);
-	}
-    }
+void pssblf_stats(unsigned long *hits, unsigned long *misses,
+    unsigned long *throttled, unsigned long *flights, unsigned long *joined)
+{
+    pwcheck_stats(&check, hits, misses, throttled, flights, joined);
+}
 
-    /* Make sure that the credentials are NULL terminated. */
+/*
+ *  Module arguments (e.g. "moduleload pw-pssblf.so cache-size=10000") are
+ *  those of pwcheck_option(); admit= counts passwords hashed at once.
+ */
 
-    if (cred->bv_val[n] != '\0') {
-	    return(LUTIL_PASSWD_ERR);
+int init_module(int argc, char *argv[]) {
+    int n;
+
+    for (n = 0; n < argc; n += 1) {
+	if (pwcheck_option(&check, argv[n]) == 0) return(-1);
     }
 
-    /* Make sure there are no NULL characters in password. */
+    if (pwcheck_init(&check)) return(-1);
 
-    for (n = 0; n < passwd->bv_len; n += 1) {
-	if (passwd->bv_val[n] == '\0') {
-	    return(LUTIL_PASSWD_ERR);
-	}
-    }
+    return lutil_passwd_add(&scheme, chk_pssblf, NULL);
+}
 
-    /* Make sure that the password is NULL terminated. */
+#if defined(STRESS)
 
-    if (passwd->bv_val[n] != '\0') {
-	return(LUTIL_PASSWD_ERR);
-    }
+/*
+ *  Stress test: hammer chk_pssblf() from many threads at once (see
+ *  pwcheck_stress()). Arguments are passed to init_module(), so the
+ *  cache can be exercised too. Build with
+ *
+ *	cc -DSTRESS -o pssblf_stress pssblf.c pwcheck.c libmodule.c \
+ *	    pwcache.c throttle.c pwstats.c admit.c bcrypt.c blf.c base64.c \
+ *	    -llber -lcrypto -lpthread -lrt
+ */
 
-    /* Let's just make sure that the supplied password is the correct length. */
+#include <stdio.h>
 
-    if (passwd->bv_len != 7 + 22 + 31) {
-	return(LUTIL_PASSWD_ERR);
-    }
+int main(int n, char *v[]) {
+    char salt[BCRYPT_SALTLEN + 1], hash[BCRYPT_HASHLEN + 1];
 
-    /* Now compare credentials with BLF-encrypted password. */
+    if (init_module(n - 1, &v[1])) {
+	fprintf(stderr, "init_module failed\n");
+	exit(1);
+    }
 
-    if (strncmp(passwd->bv_val, bcrypt(cred->bv_val, passwd->bv_val), passwd->bv_len)) {
-	return(LUTIL_PASSWD_ERR);
+    if ((bcrypt_gensalt_r(4, salt, sizeof(salt)) < 0) ||
+	(bcrypt_r("secret", salt, hash, sizeof(hash)) < 0)) {
+	perror("bcrypt");
+	exit(1);
     }
 
-    return(LUTIL_PASSWD_OK);
+    exit((pwcheck_stress(&check, hash)) ? 1 : 0);
 }
 
-int init_module(int argc, char *argv[]) {
-    return lutil_passwd_add(&scheme, chk_pssblf, NULL);
-}
+#endif
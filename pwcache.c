@@ -0,0 +1,516 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <lber.h>
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#include "pwcache.h"
+
+/*
+ *  The cache is split into PWCACHE_SHARDS shards, each with its own lock,
+ *  hash table and LRU list, so concurrent binds rarely contend. Entries
+ *  live in a fixed array per shard; list links are array indices.
+ *
+ *  Each shard also lists the checks in progress for its keys, so that
+ *  identical concurrent checks can wait for the first one's result
+ *  instead of repeating it (see pwcache_join()).
+ */
+
+struct flight {
+    unsigned char key[PWCACHE_KEYLEN];
+    int result, landed, refs;
+    pthread_cond_t done;
+    struct flight *next;
+};
+
+struct entry {
+    unsigned char key[PWCACHE_KEYLEN];
+    time_t expires, refresh;
+    int result;
+    int chain;
+    int older, newer;
+};
+
+struct shard {
+    pthread_mutex_t lock;
+    struct entry *entry;
+    int *bucket;
+    int buckets;
+    int size, used;
+    int newest, oldest;
+    int free;
+    struct flight *flights;
+} __attribute__((aligned(64)));
+
+struct pwcache {
+    struct shard shard[PWCACHE_SHARDS];
+    long ttl, negttl, stale;
+    unsigned long hits, misses;
+    unsigned long flights, joined;
+    long wait;
+    pthread_condattr_t clock;
+    EVP_MD_CTX *inner, *outer;
+};
+
+/* Each thread's context for deriving keys (see pwcache_key()). */
+
+static pthread_key_t context;
+static pthread_once_t contexts = PTHREAD_ONCE_INIT;
+static int keyed = 0;
+
+static void context_free(void *x) {
+    EVP_MD_CTX_free(x);
+}
+
+static void context_init(void) {
+    keyed = (pthread_key_create(&context, context_free) == 0);
+}
+
+static time_t now(void) {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return(t.tv_sec);
+}
+
+/* Free a cache that could not be set up completely. */
+
+static struct pwcache *destroy(struct pwcache *c) {
+    int n;
+
+    for (n = 0; n < PWCACHE_SHARDS; n += 1) {
+	free(c->shard[n].entry);
+	free(c->shard[n].bucket);
+    }
+
+    EVP_MD_CTX_free(c->inner);
+    EVP_MD_CTX_free(c->outer);
+
+    free(c);
+
+    return(NULL);
+}
+
+/*
+ *  Create a cache of at most size entries. Positive results (zero) are
+ *  kept for ttl seconds and negative ones (anything else) for negttl
+ *  seconds; a TTL of zero means such results are not cached at all.
+ *  Positive results may be served for a further stale seconds while
+ *  they are being revalidated (see pwcache_lookup()). A cache of size
+ *  zero keeps nothing but can still coalesce checks. Returns NULL if
+ *  out of memory.
+ */
+
+struct pwcache *pwcache_create(long size, long ttl, long negttl, long stale) {
+    unsigned char key[64], pad[64];
+    struct pwcache *c;
+    struct shard *s;
+    int m, n, ok;
+
+    if ((c = calloc(1, sizeof(*c))) == NULL) return(NULL);
+
+    c->ttl = ttl;
+    c->negttl = negttl;
+    c->stale = stale;
+
+    for (n = 0; n < PWCACHE_SHARDS; n += 1) {
+	s = &c->shard[n];
+
+	s->size = (size + PWCACHE_SHARDS - 1) / PWCACHE_SHARDS;
+
+	for (s->buckets = 1; s->buckets < s->size; s->buckets <<= 1);
+
+	s->entry = calloc(s->size, sizeof(struct entry));
+	s->bucket = malloc(s->buckets * sizeof(int));
+
+	if ((s->size && (s->entry == NULL)) || (s->bucket == NULL)) {
+	    return(destroy(c));
+	}
+
+	for (m = 0; m < s->buckets; m += 1) s->bucket[m] = -1;
+
+	s->newest = s->oldest = s->free = -1;
+    }
+
+    /*
+     *  Precompute the HMAC-SHA256 inner and outer states for a random
+     *  per-process key. Keys derived in one process mean nothing in any
+     *  other.
+     */
+
+    if (RAND_bytes(key, sizeof(key)) <= 0) return(destroy(c));
+
+    c->inner = EVP_MD_CTX_new();
+    c->outer = EVP_MD_CTX_new();
+
+    if ((c->inner == NULL) || (c->outer == NULL)) return(destroy(c));
+
+    for (n = 0; n < sizeof(pad); n += 1) pad[n] = key[n] ^ 0x36;
+
+    ok = EVP_DigestInit_ex(c->inner, EVP_sha256(), NULL) &&
+	EVP_DigestUpdate(c->inner, pad, sizeof(pad));
+
+    for (n = 0; n < sizeof(pad); n += 1) pad[n] = key[n] ^ 0x5c;
+
+    ok = ok && EVP_DigestInit_ex(c->outer, EVP_sha256(), NULL) &&
+	EVP_DigestUpdate(c->outer, pad, sizeof(pad));
+
+    memset(key, 0, sizeof(key));
+    memset(pad, 0, sizeof(pad));
+
+    if (ok == 0) return(destroy(c));
+
+    for (n = 0; n < PWCACHE_SHARDS; n += 1) {
+	pthread_mutex_init(&c->shard[n].lock, NULL);
+    }
+
+    pthread_condattr_init(&c->clock);
+    pthread_condattr_setclock(&c->clock, CLOCK_MONOTONIC);
+
+    return(c);
+}
+
+/*
+ *  Derive the cache key for a stored value and a set of credentials,
+ *  with a context kept by the calling thread. Returns 0, or -1 if the
+ *  key could not be derived; the caller should then do without the
+ *  cache.
+ */
+
+int pwcache_key(struct pwcache *c, const struct berval *passwd,
+    const struct berval *cred, unsigned char *key)
+{
+    unsigned char digest[EVP_MAX_MD_SIZE], length[4];
+    unsigned int n;
+    EVP_MD_CTX *x;
+
+    pthread_once(&contexts, context_init);
+
+    if (keyed == 0) return(-1);
+
+    if ((x = pthread_getspecific(context)) == NULL) {
+	if ((x = EVP_MD_CTX_new()) == NULL) return(-1);
+
+	if (pthread_setspecific(context, x) != 0) {
+	    EVP_MD_CTX_free(x);
+	    return(-1);
+	}
+    }
+
+    length[0] = (passwd->bv_len >> 24) & 0xff;
+    length[1] = (passwd->bv_len >> 16) & 0xff;
+    length[2] = (passwd->bv_len >> 8) & 0xff;
+    length[3] = passwd->bv_len & 0xff;
+
+    if (!EVP_MD_CTX_copy_ex(x, c->inner) ||
+	!EVP_DigestUpdate(x, length, sizeof(length)) ||
+	!EVP_DigestUpdate(x, passwd->bv_val, passwd->bv_len) ||
+	!EVP_DigestUpdate(x, cred->bv_val, cred->bv_len) ||
+	!EVP_DigestFinal_ex(x, digest, &n)) {
+	return(-1);
+    }
+
+    if (!EVP_MD_CTX_copy_ex(x, c->outer) ||
+	!EVP_DigestUpdate(x, digest, n) ||
+	!EVP_DigestFinal_ex(x, digest, &n)) {
+	return(-1);
+    }
+
+    memcpy(key, digest, PWCACHE_KEYLEN);
+
+    return(0);
+}
+
+static struct shard *shard(struct pwcache *c, const unsigned char *key) {
+    return(&c->shard[key[0] % PWCACHE_SHARDS]);
+}
+
+static int *bucket(struct shard *s, const unsigned char *key) {
+    return(&s->bucket[((key[1] << 16) | (key[2] << 8) | key[3]) &
+	(s->buckets - 1)]);
+}
+
+static int find(struct shard *s, const unsigned char *key) {
+    int n;
+
+    for (n = *bucket(s, key); n >= 0; n = s->entry[n].chain) {
+	if (memcmp(s->entry[n].key, key, PWCACHE_KEYLEN) == 0) return(n);
+    }
+
+    return(-1);
+}
+
+/* Take an entry off the LRU list. */
+
+static void unlink_lru(struct shard *s, int n) {
+    struct entry *e = &s->entry[n];
+
+    if (e->older >= 0) s->entry[e->older].newer = e->newer;
+    else s->oldest = e->newer;
+
+    if (e->newer >= 0) s->entry[e->newer].older = e->older;
+    else s->newest = e->older;
+}
+
+/* Put an entry at the newest end of the LRU list. */
+
+static void link_lru(struct shard *s, int n) {
+    struct entry *e = &s->entry[n];
+
+    e->older = s->newest;
+    e->newer = -1;
+
+    if (s->newest >= 0) s->entry[s->newest].newer = n;
+    else s->oldest = n;
+
+    s->newest = n;
+}
+
+/* Remove an entry from the cache and put it on the free list. */
+
+static void discard(struct shard *s, int n) {
+    int *p;
+
+    for (p = bucket(s, s->entry[n].key); *p != n; p = &s->entry[*p].chain);
+
+    *p = s->entry[n].chain;
+
+    unlink_lru(s, n);
+
+    s->entry[n].chain = s->free;
+    s->free = n;
+}
+
+/*
+ *  Look up a key. Returns PWCACHE_HIT and sets *result if a live entry is
+ *  found, otherwise PWCACHE_MISS. A positive entry that has expired but
+ *  is still within its stale window is handed to one caller at a time
+ *  as PWCACHE_STALE: that caller should revalidate it and either store
+ *  the new result or, if the backend could not be reached, use *result
+ *  anyway. Meanwhile, other callers keep getting the stale result as a
+ *  PWCACHE_HIT.
+ */
+
+int pwcache_lookup(struct pwcache *c, const unsigned char *key, int *result) {
+    struct shard *s = shard(c, key);
+    int found = PWCACHE_MISS, n;
+    struct entry *e;
+    time_t t = now();
+
+    pthread_mutex_lock(&s->lock);
+
+    if ((n = find(s, key)) >= 0) {
+	e = &s->entry[n];
+
+	if (e->expires > t) {
+	    found = PWCACHE_HIT;
+	} else if ((e->result == 0) && (e->expires + c->stale > t)) {
+	    if (e->refresh > t) {
+		found = PWCACHE_HIT;
+	    } else {
+		e->refresh = t + PWCACHE_RETRY;
+		found = PWCACHE_STALE;
+	    }
+	}
+
+	if (found == PWCACHE_MISS) {
+	    discard(s, n);
+	} else {
+	    unlink_lru(s, n);
+	    link_lru(s, n);
+
+	    *result = e->result;
+	}
+    }
+
+    pthread_mutex_unlock(&s->lock);
+
+    __sync_fetch_and_add((found == PWCACHE_HIT) ? &c->hits : &c->misses, 1);
+
+    return(found);
+}
+
+/* Remember a result, evicting the least recently used entry if full. */
+
+void pwcache_store(struct pwcache *c, const unsigned char *key, int result) {
+    struct shard *s = shard(c, key);
+    long ttl = (result == 0) ? c->ttl : c->negttl;
+    int *p, n;
+
+    if (s->size == 0) return;
+
+    pthread_mutex_lock(&s->lock);
+
+    /* A result that is not to be cached still replaces an older one. */
+
+    if (ttl <= 0) {
+	if ((n = find(s, key)) >= 0) discard(s, n);
+
+	pthread_mutex_unlock(&s->lock);
+	return;
+    }
+
+    if ((n = find(s, key)) >= 0) {
+	unlink_lru(s, n);
+    } else {
+	if (s->free >= 0) {
+	    n = s->free;
+	    s->free = s->entry[n].chain;
+	} else if (s->used < s->size) {
+	    n = s->used++;
+	} else {
+	    discard(s, n = s->oldest);
+	    s->free = s->entry[n].chain;
+	}
+
+	memcpy(s->entry[n].key, key, PWCACHE_KEYLEN);
+
+	p = bucket(s, key);
+	s->entry[n].chain = *p;
+	*p = n;
+    }
+
+    s->entry[n].result = result;
+    s->entry[n].expires = now() + ttl;
+    s->entry[n].refresh = 0;
+
+    link_lru(s, n);
+
+    pthread_mutex_unlock(&s->lock);
+}
+
+void pwcache_stats(struct pwcache *c, unsigned long *hits,
+    unsigned long *misses)
+{
+    *hits = __sync_fetch_and_add(&c->hits, 0);
+    *misses = __sync_fetch_and_add(&c->misses, 0);
+}
+
+/*
+ *  Make callers of pwcache_join() wait up to wait milliseconds for an
+ *  identical check already in progress. Zero (the default) turns this
+ *  off.
+ */
+
+void pwcache_coalesce(struct pwcache *c, long wait) {
+    c->wait = wait;
+}
+
+static void release(struct flight *f) {
+    if (--f->refs == 0) {
+	pthread_cond_destroy(&f->done);
+	free(f);
+    }
+}
+
+/*
+ *  Before checking credentials that missed the cache: if an identical
+ *  check is in progress, wait for it and return PWCACHE_HIT with its
+ *  *result. Otherwise return PWCACHE_LEAD; the caller must then do the
+ *  check and hand the result to pwcache_land(). PWCACHE_MISS means the
+ *  caller should check on its own without landing: coalescing is off,
+ *  there was no memory, or the wait timed out.
+ */
+
+int pwcache_join(struct pwcache *c, const unsigned char *key, int *result) {
+    struct shard *s = shard(c, key);
+    struct timespec t;
+    struct flight *f;
+    int found;
+
+    if (c->wait <= 0) return(PWCACHE_MISS);
+
+    pthread_mutex_lock(&s->lock);
+
+    for (f = s->flights; f; f = f->next) {
+	if (memcmp(f->key, key, PWCACHE_KEYLEN) == 0) break;
+    }
+
+    if (f == NULL) {
+	if ((f = calloc(1, sizeof(*f))) == NULL) {
+	    pthread_mutex_unlock(&s->lock);
+	    return(PWCACHE_MISS);
+	}
+
+	memcpy(f->key, key, PWCACHE_KEYLEN);
+	pthread_cond_init(&f->done, &c->clock);
+
+	f->refs = 1;
+	f->next = s->flights;
+	s->flights = f;
+
+	pthread_mutex_unlock(&s->lock);
+
+	__sync_fetch_and_add(&c->flights, 1);
+
+	return(PWCACHE_LEAD);
+    }
+
+    f->refs += 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    t.tv_sec += c->wait / 1000;
+    t.tv_nsec += (c->wait % 1000) * 1000000;
+
+    if (t.tv_nsec >= 1000000000) {
+	t.tv_sec += 1;
+	t.tv_nsec -= 1000000000;
+    }
+
+    while (f->landed == 0) {
+	if (pthread_cond_timedwait(&f->done, &s->lock, &t) == ETIMEDOUT) break;
+    }
+
+    if ((found = (f->landed) ? PWCACHE_HIT : PWCACHE_MISS) == PWCACHE_HIT) {
+	*result = f->result;
+    }
+
+    release(f);
+
+    pthread_mutex_unlock(&s->lock);
+
+    if (found == PWCACHE_HIT) __sync_fetch_and_add(&c->joined, 1);
+
+    return(found);
+}
+
+/* Hand the result of a check begun with PWCACHE_LEAD to its waiters. */
+
+void pwcache_land(struct pwcache *c, const unsigned char *key, int result) {
+    struct shard *s = shard(c, key);
+    struct flight **p, *f;
+
+    pthread_mutex_lock(&s->lock);
+
+    for (p = &s->flights; (f = *p) != NULL; p = &f->next) {
+	if (memcmp(f->key, key, PWCACHE_KEYLEN) == 0) {
+	    *p = f->next;
+
+	    f->result = result;
+	    f->landed = 1;
+
+	    pthread_cond_broadcast(&f->done);
+
+	    release(f);
+	    break;
+	}
+    }
+
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* Checks led so far, and checks that waited for one instead. */
+
+void pwcache_flights(struct pwcache *c, unsigned long *flights,
+    unsigned long *joined)
+{
+    *flights = __sync_fetch_and_add(&c->flights, 0);
+    *joined = __sync_fetch_and_add(&c->joined, 0);
+}
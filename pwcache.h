@@ -0,0 +1,36 @@
+/*
+ *  Verification result cache shared by the password modules. Entries are
+ *  keyed by a keyed MAC of the stored value and the credentials, so no
+ *  plaintext is ever kept. Requires <lber.h> for struct berval.
+ */
+
+#define PWCACHE_KEYLEN	32
+#define PWCACHE_SHARDS	16
+
+/* Seconds a caller gets to revalidate a stale entry before another tries. */
+
+#define PWCACHE_RETRY	5
+
+/* Results of pwcache_lookup(). */
+
+#define PWCACHE_MISS	0
+#define PWCACHE_HIT	1
+#define PWCACHE_STALE	2
+
+/* Result of pwcache_join() for the caller that must do the check itself. */
+
+#define PWCACHE_LEAD	3
+
+struct pwcache;
+
+extern struct pwcache *pwcache_create(long, long, long, long);
+extern int pwcache_key(struct pwcache *, const struct berval *,
+    const struct berval *, unsigned char *);
+extern int pwcache_lookup(struct pwcache *, const unsigned char *, int *);
+extern void pwcache_store(struct pwcache *, const unsigned char *, int);
+extern void pwcache_stats(struct pwcache *, unsigned long *, unsigned long *);
+extern void pwcache_coalesce(struct pwcache *, long);
+extern int pwcache_join(struct pwcache *, const unsigned char *, int *);
+extern void pwcache_land(struct pwcache *, const unsigned char *, int);
+extern void pwcache_flights(struct pwcache *, unsigned long *,
+    unsigned long *);
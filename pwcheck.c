@@ -0,0 +1,327 @@
+#include <lber.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "lutil.h"
+#include "pwcache.h"
+#include "throttle.h"
+#include "admit.h"
+#include "pwstats.h"
+#include "pwcheck.h"
+
+static int check(
+    struct pwcheck *c,
+    const struct berval *passwd,
+    const struct berval *cred)
+{
+    unsigned char key[PWCACHE_KEYLEN];
+    struct throttle *tracker = c->tracker;
+    struct pwcache *cache = c->cache;
+    uint64_t tag = 0;
+    int64_t start;
+    long weight;
+    int code, n;
+
+    /* Make sure there are no NULL characters in credentials. */
+
+    for (n = 0; n < cred->bv_len; n += 1) {
+	if (cred->bv_val[n] == '\0') {
+	    return(LUTIL_PASSWD_ERR);
+	}
+    }
+
+    /* Make sure that the credentials are NULL terminated. */
+
+    if (cred->bv_val[n] != '\0') {
+	return(LUTIL_PASSWD_ERR);
+    }
+
+    /* Make sure there are no NULL characters in password. */
+
+    for (n = 0; n < passwd->bv_len; n += 1) {
+	if (passwd->bv_val[n] == '\0') {
+	    return(LUTIL_PASSWD_ERR);
+	}
+    }
+
+    /* Make sure that the password is NULL terminated. */
+
+    if (passwd->bv_val[n] != '\0') {
+	return(LUTIL_PASSWD_ERR);
+    }
+
+    /* Make sure that the scheme will take the stored value. */
+
+    if ((weight = c->weigh(passwd)) <= 0) {
+	return(LUTIL_PASSWD_ERR);
+    }
+
+    /*
+     *  See if this password and these credentials were checked recently
+     *  (going without the cache if no key can be had for them).
+     */
+
+    if (cache && pwcache_key(cache, passwd, cred, key)) cache = NULL;
+
+    if (cache) {
+	if (pwcache_lookup(cache, key, &code) == PWCACHE_HIT) {
+	    return(code);
+	}
+    }
+
+    /*
+     *  Refuse without hashing if this password keeps failing (going
+     *  without the throttle if no tag can be had for it).
+     */
+
+    if (tracker && ((tag = throttle_key(tracker, passwd)) == 0)) {
+	tracker = NULL;
+    }
+
+    if (tracker) {
+	if (throttle_check(tracker, tag)) {
+	    return(LUTIL_PASSWD_ERR);
+	}
+    }
+
+    /*
+     *  Wait for a turn to hash, failing the check rather than waiting too
+     *  long, so that a storm of binds cannot take every CPU.
+     */
+
+    if (c->admission) {
+	start = (c->stats) ? pwstats_clock() : 0;
+
+	pwstats_waiting(1);
+	n = admit_enter(c->admission, weight);
+	pwstats_waiting(-1);
+
+	if (c->stats) pwstats_add(PWSTATS_QUEUE, pwstats_clock() - start);
+
+	if (n < 0) {
+	    pwstats_rejected();
+	    return(LUTIL_PASSWD_ERR);
+	}
+    }
+
+    /* Now compare the credentials with the stored value. */
+
+    code = LUTIL_PASSWD_OK;
+
+    start = (c->stats) ? pwstats_clock() : 0;
+
+    if (c->verify(cred->bv_val, passwd->bv_val) < 0) {
+	code = LUTIL_PASSWD_ERR;
+    }
+
+    if (c->stats) pwstats_add(PWSTATS_HASH, pwstats_clock() - start);
+
+    if (c->admission) admit_leave(c->admission, weight);
+
+    if (cache) {
+	pwcache_store(cache, key, code);
+    }
+
+    if (tracker && (code != LUTIL_PASSWD_OK)) {
+	throttle_fail(tracker, tag);
+    }
+
+    return(code);
+}
+
+/* Check cred against the stored value passwd, as a module's chk does. */
+
+int pwcheck(
+    struct pwcheck *c,
+    const struct berval *passwd,
+    const struct berval *cred)
+{
+    int64_t start;
+    int code;
+
+    start = pwstats_begin(c->stats, &c->slow);
+
+    code = check(c, passwd, cred);
+
+    pwstats_slow(&c->slow, c->scheme, passwd, pwstats_end(start, code),
+	code);
+
+    return(code);
+}
+
+/*
+ *  Report cache hits and misses and throttled checks. Hashing checks are
+ *  not coalesced, so there are never flights led or joined; those counts
+ *  are there to match the Kerberos modules.
+ */
+
+void pwcheck_stats(struct pwcheck *c, unsigned long *hits,
+    unsigned long *misses, unsigned long *throttled, unsigned long *flights,
+    unsigned long *joined)
+{
+    *hits = *misses = *throttled = *flights = *joined = 0;
+
+    if (c->cache) pwcache_stats(c->cache, hits, misses);
+    if (c->tracker) throttle_stats(c->tracker, throttled);
+}
+
+/*
+ *  Take one of these module arguments, returning 1 if it was one:
+ *
+ *    cache-size=<n>      cache up to n results (default 0: no cache)
+ *    cache-ttl=<s>       keep successful checks for s seconds (300)
+ *    cache-negttl=<s>    keep failed checks for s seconds (0: never)
+ *    throttle-size=<n>   track up to n passwords (default 0: no throttle)
+ *    throttle-burst=<n>  refuse a password after n failures (10)
+ *    throttle-rate=<n>   forgive n failures per minute (6)
+ *    admit=<n>           hash with at most n CPUs at once, the others
+ *                        waiting in turn ("cpus", the default, for one
+ *                        per CPU; "off" for no limit)
+ *    admit-wait=<ms>     fail checks that wait longer than ms (1000)
+ *    stats=<name>        keep statistics in shared memory segment name
+ *    slow=<ms>           log checks taking more than ms, with the time
+ *                        spent in each phase (default 0: don't)
+ *    slow-rate=<n>       log at most n slow checks a minute (10)
+ */
+
+int pwcheck_option(struct pwcheck *c, char *arg) {
+    if (strncasecmp(arg, "cache-size=", 11) == 0) {
+	c->size = atol(&arg[11]);
+    } else if (strncasecmp(arg, "cache-ttl=", 10) == 0) {
+	c->ttl = atol(&arg[10]);
+    } else if (strncasecmp(arg, "cache-negttl=", 13) == 0) {
+	c->negttl = atol(&arg[13]);
+    } else if (strncasecmp(arg, "throttle-size=", 14) == 0) {
+	c->tsize = atol(&arg[14]);
+    } else if (strncasecmp(arg, "throttle-burst=", 15) == 0) {
+	c->burst = atol(&arg[15]);
+    } else if (strncasecmp(arg, "throttle-rate=", 14) == 0) {
+	c->rate = atol(&arg[14]);
+    } else if (strncasecmp(arg, "admit=", 6) == 0) {
+	if (strcasecmp(&arg[6], "off") == 0) {
+	    c->slots = -1;
+	} else {
+	    c->slots = (strcasecmp(&arg[6], "cpus") == 0) ? 0 : atol(&arg[6]);
+	}
+    } else if (strncasecmp(arg, "admit-wait=", 11) == 0) {
+	c->wait = atol(&arg[11]);
+    } else if (strncasecmp(arg, "stats=", 6) == 0) {
+	c->name = &arg[6];
+    } else if (strncasecmp(arg, "slow=", 5) == 0) {
+	c->slow.threshold = atol(&arg[5]);
+    } else if (strncasecmp(arg, "slow-rate=", 10) == 0) {
+	c->slow.rate = atol(&arg[10]);
+    } else {
+	return(0);
+    }
+
+    return(1);
+}
+
+/* Set up what the module arguments asked for. Returns 0 or -1. */
+
+int pwcheck_init(struct pwcheck *c) {
+    if (c->size > 0) {
+	c->cache = pwcache_create(c->size, c->ttl, c->negttl, 0);
+
+	if (c->cache == NULL) return(-1);
+    }
+
+    if (c->tsize > 0) {
+	c->tracker = throttle_create(c->tsize, c->burst, c->rate);
+
+	if (c->tracker == NULL) return(-1);
+    }
+
+    if (c->slots >= 0) {
+	if ((c->admission = admit_create(c->slots, c->wait)) == NULL) {
+	    return(-1);
+	}
+    }
+
+    if (c->name) {
+	if ((c->stats = pwstats_create(c->name, c->scheme)) == NULL) {
+	    return(-1);
+	}
+    }
+
+    return(0);
+}
+
+#if defined(STRESS)
+
+/*
+ *  Stress test for the modules' own: hammer pwcheck() from many threads
+ *  at once, mixing correct ("secret") and wrong credentials against hash,
+ *  and check every result. Returns the number of wrong results.
+ */
+
+#include <stdio.h>
+#include <pthread.h>
+
+#define THREADS	64
+#define CHECKS	16
+
+struct hammer {
+    struct pwcheck *c;
+    const char *hash;
+    long n;
+};
+
+static void *hammer(void *arg) {
+    struct hammer *h = arg;
+    struct berval passwd, cred;
+    long failures = 0;
+    int code, n;
+
+    passwd.bv_val = (char *)h->hash;
+    passwd.bv_len = strlen(h->hash);
+
+    for (n = 0; n < CHECKS; n += 1) {
+	cred.bv_val = ((n + h->n) % 2) ? "secret" : "wrong";
+	cred.bv_len = strlen(cred.bv_val);
+
+	code = pwcheck(h->c, &passwd, &cred);
+
+	if (code != ((*cred.bv_val == 's') ? LUTIL_PASSWD_OK :
+	    LUTIL_PASSWD_ERR)) {
+	    failures += 1;
+	}
+    }
+
+    return((void *)failures);
+}
+
+int pwcheck_stress(struct pwcheck *c, const char *hash) {
+    unsigned long hits, misses, throttled, flights, joined;
+    struct hammer h[THREADS];
+    pthread_t thread[THREADS];
+    long failures = 0;
+    void *result;
+    int n;
+
+    for (n = 0; n < THREADS; n += 1) {
+	h[n] = (struct hammer){ c, hash, n };
+
+	if (pthread_create(&thread[n], NULL, hammer, &h[n])) {
+	    perror("pthread_create");
+	    exit(1);
+	}
+    }
+
+    for (n = 0; n < THREADS; n += 1) {
+	pthread_join(thread[n], &result);
+	failures += (long)result;
+    }
+
+    pwcheck_stats(c, &hits, &misses, &throttled, &flights, &joined);
+
+    printf("%d threads x %d checks: %ld failures, %lu hits, %lu misses, "
+	"%lu throttled\n", THREADS, CHECKS, failures, hits, misses, throttled);
+
+    return(failures);
+}
+
+#endif
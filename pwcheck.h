@@ -0,0 +1,48 @@
+/*
+ *  The check shared by the password modules that hash: the sanity checks
+ *  on the stored value and the credentials, and the optional cache,
+ *  throttle, admission control, statistics and slow log around the
+ *  scheme's own verification, with the module arguments for them. A
+ *  module supplies only what is particular to its scheme. Requires
+ *  <lber.h> for struct berval and "pwstats.h".
+ */
+
+struct pwcheck {
+    struct berval *scheme;
+
+    /* Slots a check of this stored value takes (0 to refuse the value). */
+
+    long (*weigh)(const struct berval *);
+
+    /* Credentials against the stored value: 0 if right, -1 if not. */
+
+    int (*verify)(const char *, const char *);
+
+    struct pwcache *cache;
+    struct throttle *tracker;
+    struct admit *admission;
+    struct pwstats *stats;
+    struct pwslow slow;
+
+    /* Module arguments, taken by pwcheck_option() for pwcheck_init(). */
+
+    long size, ttl, negttl;
+    long tsize, burst, rate;
+    long slots, wait;
+    char *name;
+};
+
+#define PWCHECK_DEFAULT(scheme, weigh, verify) \
+    { &(scheme), weigh, verify, NULL, NULL, NULL, NULL, PWSLOW_DEFAULT, \
+	0, 300, 0, 0, 10, 6, 0, 1000, NULL }
+
+extern int pwcheck(struct pwcheck *, const struct berval *,
+    const struct berval *);
+extern int pwcheck_option(struct pwcheck *, char *);
+extern int pwcheck_init(struct pwcheck *);
+extern void pwcheck_stats(struct pwcheck *, unsigned long *, unsigned long *,
+    unsigned long *, unsigned long *, unsigned long *);
+
+#if defined(STRESS)
+extern int pwcheck_stress(struct pwcheck *, const char *);
+#endif
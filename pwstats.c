@@ -0,0 +1,439 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <lber.h>
+
+#include <openssl/evp.h>
+
+#include "pwstats.h"
+
+/*
+ *  The segment is created (or reset) when a module is loaded, and holds
+ *  PWSTATS_SLOTS slots. A thread takes the next free slot the first time
+ *  it checks a password and keeps it; should there be more threads than
+ *  slots, the rest share the last one. Counters are only ever added to
+ *  with relaxed atomic operations, which cost next to nothing when, as
+ *  usual, the slot is not shared, and which let a reader see whole
+ *  values without any locking. Latencies are counted in fixed buckets,
+ *  as Prometheus histograms expect.
+ *
+ *  The time spent in each phase of the check in progress is also kept
+ *  per thread, so that a check slower than the module's threshold can be
+ *  logged with where its time went.
+ */
+
+/*
+ *  Bucket bounds in nanoseconds. Checks pick their bucket from this table,
+ *  never from the copy in the segment, which anyone able to open it could
+ *  have changed.
+ */
+
+static const uint64_t bounds[PWSTATS_BUCKETS - 1] = {
+    100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000, 25000000,
+    50000000, 100000000, 250000000, 500000000, 1000000000, 2500000000,
+    5000000000, 10000000000
+};
+
+static char *phases[PWSTATS_PHASES] = {
+    "check", "hash", "initcreds", "verify", "changepw", "context", "server",
+    "keytab", "queue"
+};
+
+/* The calling thread's slot, and the segment it belongs to. */
+
+static __thread struct pwstats_slot *slot = NULL;
+static __thread struct pwstats *owner = NULL;
+
+/* The check in progress: its slot (if counted) and phases (if timed). */
+
+static __thread struct pwstats_slot *mine = NULL;
+static __thread int timing = 0;
+static __thread int64_t spent[PWSTATS_PHASES];
+static __thread long error = 0;
+
+#define ADD(x, n)	__atomic_fetch_add(&(x), (n), __ATOMIC_RELAXED)
+
+int64_t pwstats_clock(void) {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return(((int64_t)t.tv_sec * 1000000000) + t.tv_nsec);
+}
+
+/*
+ *  Create the shared memory segment called name (shm_open(3); e.g. "/pw-
+ *  pssblf") for a scheme, replacing any that an earlier slapd (or anyone
+ *  else) left under that name. It is readable by the owner's group, so
+ *  pwstats must run as slapd's user or in its group. Returns NULL if it
+ *  cannot be created.
+ */
+
+struct pwstats *pwstats_create(const char *name, const struct berval *scheme) {
+    char path[256];
+    struct pwstats *s;
+    int fd, n;
+
+    snprintf(path, sizeof(path), "%s%s", (*name == '/') ? "" : "/", name);
+
+    shm_unlink(path);
+
+    if ((fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0640)) < 0) {
+	return(NULL);
+    }
+
+    if (ftruncate(fd, sizeof(*s)) != 0) {
+	close(fd);
+	return(NULL);
+    }
+
+    s = mmap(NULL, sizeof(*s), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    close(fd);
+
+    if (s == MAP_FAILED) return(NULL);
+
+    memset(s, 0, sizeof(*s));
+
+    snprintf(s->scheme, sizeof(s->scheme), "%.*s", (int)scheme->bv_len,
+	scheme->bv_val);
+
+    s->started = time(NULL);
+
+    for (n = 0; n < PWSTATS_BUCKETS - 1; n += 1) {
+	s->bound[n] = bounds[n];
+    }
+
+    s->bound[n] = UINT64_MAX;
+
+    __atomic_store_n(&s->magic, PWSTATS_MAGIC, __ATOMIC_RELEASE);
+
+    return(s);
+}
+
+/*
+ *  Start timing a check (s may be NULL if statistics are not kept, slow
+ *  if slow checks are not logged). Returns the time to pass to
+ *  pwstats_end().
+ */
+
+int64_t pwstats_begin(struct pwstats *s, struct pwslow *slow) {
+    uint32_t n;
+
+    mine = NULL;
+
+    if ((timing = (s || (slow && (slow->threshold > 0)))) == 0) return(0);
+
+    memset(spent, 0, sizeof(spent));
+    error = 0;
+
+    if (s) {
+	if (owner != s) {
+	    if ((n = ADD(s->slots, 1)) >= PWSTATS_SLOTS) n = PWSTATS_SLOTS - 1;
+
+	    slot = &s->slot[n];
+	    owner = s;
+	}
+
+	mine = slot;
+    }
+
+    return(pwstats_clock());
+}
+
+/* Count ns nanoseconds spent in a phase of the check being timed. */
+
+void pwstats_add(int phase, int64_t ns) {
+    int n;
+
+    if (timing == 0) return;
+
+    if (ns < 0) ns = 0;
+
+    spent[phase] += ns;
+
+    if (mine == NULL) return;
+
+    for (n = 0; n < PWSTATS_BUCKETS - 1; n += 1) {
+	if ((uint64_t)ns <= bounds[n]) break;
+    }
+
+    ADD(mine->phase[phase].count, 1);
+    ADD(mine->phase[phase].sum, ns);
+    ADD(mine->phase[phase].bucket[n], 1);
+}
+
+/* Note the error (e.g. from Kerberos) behind the check's result. */
+
+void pwstats_error(long code) {
+    error = code;
+}
+
+/*
+ *  Count the check being timed in (1) or out (-1) of those waiting for a
+ *  turn to hash, and note that it gave up waiting.
+ */
+
+void pwstats_waiting(int n) {
+    if (mine) ADD(owner->waiting, n);
+}
+
+void pwstats_rejected(void) {
+    if (mine) ADD(mine->rejected, 1);
+}
+
+/* Finish timing a check, counting its result. Returns how long it took. */
+
+int64_t pwstats_end(int64_t start, int code) {
+    int64_t ns;
+
+    if (timing == 0) return(0);
+
+    pwstats_add(PWSTATS_CHECK, ns = pwstats_clock() - start);
+
+    if (mine == NULL) return(ns);
+
+    if (code == 0) {
+	ADD(mine->ok, 1);
+    } else {
+	ADD(mine->err, 1);
+    }
+
+    return(ns);
+}
+
+/*
+ *  Log a check of the stored value passwd that took ns nanoseconds, if
+ *  that is over the threshold, with the time spent in each phase. The
+ *  stored value (a principal, or a hash) is logged as the start of its
+ *  SHA-256 digest, which can be matched against a known principal but
+ *  does not give it away. Beyond slow->rate messages in a minute, slow
+ *  checks are only counted, and the count logged the next minute.
+ */
+
+void pwstats_slow(struct pwslow *slow, const struct berval *scheme,
+    const struct berval *passwd, int64_t ns, int code)
+{
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    char who[17], text[512];
+    unsigned int length;
+    long dropped = 0;
+    time_t minute;
+    int n, m;
+
+    if ((timing == 0) || (slow->threshold <= 0) ||
+	(ns < slow->threshold * 1000000)) return;
+
+    minute = time(NULL) / 60;
+
+    pthread_mutex_lock(&slow->lock);
+
+    if (minute != slow->minute) {
+	dropped = slow->dropped;
+	slow->minute = minute;
+	slow->logged = slow->dropped = 0;
+    }
+
+    if (slow->logged >= slow->rate) {
+	slow->dropped += 1;
+	pthread_mutex_unlock(&slow->lock);
+	return;
+    }
+
+    slow->logged += 1;
+
+    pthread_mutex_unlock(&slow->lock);
+
+    if (dropped) {
+	syslog(LOG_NOTICE, "%.*s: %ld more slow checks were not logged",
+	    (int)scheme->bv_len, scheme->bv_val, dropped);
+    }
+
+    strcpy(who, "?");
+
+    if (EVP_Digest(passwd->bv_val, passwd->bv_len, digest, &length,
+	EVP_sha256(), NULL)) {
+	for (n = 0; n < 8; n += 1) sprintf(&who[n * 2], "%02x", digest[n]);
+    }
+
+    for (*text = '\0', m = 0, n = PWSTATS_CHECK + 1; n < PWSTATS_PHASES;
+	n += 1) {
+	if (spent[n] && (m < sizeof(text))) {
+	    m += snprintf(&text[m], sizeof(text) - m, " %s=%.1fms", phases[n],
+		spent[n] / 1e6);
+	}
+    }
+
+    syslog(LOG_NOTICE, "%.*s: slow check of %s: %.1fms (%s, error %ld):%s",
+	(int)scheme->bv_len, scheme->bv_val, who, ns / 1e6,
+	(code == 0) ? "ok" : "err", error, (*text) ? text : " no phases");
+}
+
+#if defined(MAIN)
+
+/*
+ *  Print the statistics in the named segments in the Prometheus text
+ *  format, e.g. for node_exporter's textfile collector or behind inetd.
+ *
+ *	pwstats /pw-pssblf /pw-pskrb5 /pw-kerberos
+ */
+
+#define LOAD(x)		__atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+/* Add up the slots of a segment. */
+
+static void total(struct pwstats *s, struct pwstats_slot *t) {
+    uint32_t m, n, slots;
+    int p;
+
+    memset(t, 0, sizeof(*t));
+
+    if ((slots = LOAD(s->slots)) > PWSTATS_SLOTS) slots = PWSTATS_SLOTS;
+
+    for (n = 0; n < slots; n += 1) {
+	t->ok += LOAD(s->slot[n].ok);
+	t->err += LOAD(s->slot[n].err);
+	t->rejected += LOAD(s->slot[n].rejected);
+
+	for (p = 0; p < PWSTATS_PHASES; p += 1) {
+	    t->phase[p].count += LOAD(s->slot[n].phase[p].count);
+	    t->phase[p].sum += LOAD(s->slot[n].phase[p].sum);
+
+	    for (m = 0; m < PWSTATS_BUCKETS; m += 1) {
+		t->phase[p].bucket[m] += LOAD(s->slot[n].phase[p].bucket[m]);
+	    }
+	}
+    }
+}
+
+int main(int n, char *v[]) {
+    struct pwstats_slot *t;
+    struct pwstats **s;
+    char path[256];
+    uint64_t sum;
+    struct stat st;
+    int fd, m, p, b;
+
+    if (n < 2) {
+	fprintf(stderr, "usage: %s <segment> ...\n", v[0]);
+	exit(1);
+    }
+
+    if (((s = calloc(n, sizeof(*s))) == NULL) ||
+	((t = calloc(n, sizeof(*t))) == NULL)) {
+	perror("calloc");
+	exit(1);
+    }
+
+    for (m = 1; m < n; m += 1) {
+	snprintf(path, sizeof(path), "%s%s", (*v[m] == '/') ? "" : "/", v[m]);
+
+	if ((fd = shm_open(path, O_RDONLY, 0)) < 0) {
+	    perror(path);
+	    continue;
+	}
+
+	if ((fstat(fd, &st) == 0) && (st.st_size == sizeof(**s))) {
+	    s[m] = mmap(NULL, sizeof(**s), PROT_READ, MAP_SHARED, fd, 0);
+
+	    if (s[m] == MAP_FAILED) s[m] = NULL;
+	}
+
+	close(fd);
+
+	if ((s[m] == NULL) || (LOAD(s[m]->magic) != PWSTATS_MAGIC)) {
+	    fprintf(stderr, "%s: not a password statistics segment\n", path);
+	    s[m] = NULL;
+	    continue;
+	}
+
+	total(s[m], &t[m]);
+    }
+
+    printf("# HELP pwstats_start_time_seconds When the module was loaded.\n");
+    printf("# TYPE pwstats_start_time_seconds gauge\n");
+
+    for (m = 1; m < n; m += 1) {
+	if (s[m] == NULL) continue;
+
+	printf("pwstats_start_time_seconds{scheme=\"%s\"} %llu\n",
+	    s[m]->scheme, (unsigned long long)s[m]->started);
+    }
+
+    printf("# HELP pwstats_checks_total Password checks, by result.\n");
+    printf("# TYPE pwstats_checks_total counter\n");
+
+    for (m = 1; m < n; m += 1) {
+	if (s[m] == NULL) continue;
+
+	printf("pwstats_checks_total{scheme=\"%s\",result=\"ok\"} %llu\n",
+	    s[m]->scheme, (unsigned long long)t[m].ok);
+	printf("pwstats_checks_total{scheme=\"%s\",result=\"err\"} %llu\n",
+	    s[m]->scheme, (unsigned long long)t[m].err);
+    }
+
+    printf("# HELP pwstats_waiting Checks waiting for a turn to hash.\n");
+    printf("# TYPE pwstats_waiting gauge\n");
+
+    for (m = 1; m < n; m += 1) {
+	if (s[m] == NULL) continue;
+
+	printf("pwstats_waiting{scheme=\"%s\"} %lld\n", s[m]->scheme,
+	    (long long)LOAD(s[m]->waiting));
+    }
+
+    printf("# HELP pwstats_rejected_total Checks that gave up waiting for a "
+	"turn.\n");
+    printf("# TYPE pwstats_rejected_total counter\n");
+
+    for (m = 1; m < n; m += 1) {
+	if (s[m] == NULL) continue;
+
+	printf("pwstats_rejected_total{scheme=\"%s\"} %llu\n", s[m]->scheme,
+	    (unsigned long long)t[m].rejected);
+    }
+
+    printf("# HELP pwstats_phase_seconds Time spent in each phase of "
+	"checks.\n");
+    printf("# TYPE pwstats_phase_seconds histogram\n");
+
+    for (m = 1; m < n; m += 1) {
+	if (s[m] == NULL) continue;
+
+	for (p = 0; p < PWSTATS_PHASES; p += 1) {
+	    if ((p != PWSTATS_CHECK) && (t[m].phase[p].count == 0)) continue;
+
+	    for (sum = 0, b = 0; b < PWSTATS_BUCKETS; b += 1) {
+		sum += t[m].phase[p].bucket[b];
+
+		printf("pwstats_phase_seconds_bucket{scheme=\"%s\",phase=\"%s\","
+		    "le=\"", s[m]->scheme, phases[p]);
+
+		if (b < PWSTATS_BUCKETS - 1) {
+		    printf("%g", s[m]->bound[b] / 1e9);
+		} else {
+		    printf("+Inf");
+		}
+
+		printf("\"} %llu\n", (unsigned long long)sum);
+	    }
+
+	    printf("pwstats_phase_seconds_sum{scheme=\"%s\",phase=\"%s\"} %.6f\n",
+		s[m]->scheme, phases[p], t[m].phase[p].sum / 1e9);
+	    printf("pwstats_phase_seconds_count{scheme=\"%s\",phase=\"%s\"} "
+		"%llu\n", s[m]->scheme, phases[p],
+		(unsigned long long)t[m].phase[p].count);
+	}
+    }
+
+    exit(0);
+}
+
+#endif
@@ -0,0 +1,70 @@
+/*
+ *  Live statistics of the password modules, kept in a shared memory
+ *  segment that the pwstats program reads (in the Prometheus text
+ *  format) while slapd runs. Each thread counts into a slot of its own,
+ *  so nothing is locked while checking passwords. Checks slower than a
+ *  threshold are logged with the time spent in each phase. Requires
+ *  <lber.h> for struct berval.
+ */
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+/* The phases of a check that are timed. */
+
+#define PWSTATS_CHECK		0	/* the whole check */
+#define PWSTATS_HASH		1	/* bcrypt() or Argon2id */
+#define PWSTATS_INITCREDS	2	/* getting initial credentials */
+#define PWSTATS_VERIFY		3	/* krb5_verify_init_creds() */
+#define PWSTATS_CHANGEPW	4	/* retrying expired ones (changepw) */
+#define PWSTATS_CONTEXT		5	/* getting a Kerberos context */
+#define PWSTATS_SERVER		6	/* the service principal (DNS) */
+#define PWSTATS_KEYTAB		7	/* resolving the keytab */
+#define PWSTATS_QUEUE		8	/* waiting for a turn to hash */
+#define PWSTATS_PHASES		9
+
+#define PWSTATS_SLOTS		256
+#define PWSTATS_BUCKETS		17
+#define PWSTATS_MAGIC		0x70777374
+
+struct pwstats_slot {
+    uint64_t ok, err;
+    uint64_t rejected;			/* gave up waiting for a turn */
+    struct {
+	uint64_t count, sum;		/* sum in nanoseconds */
+	uint64_t bucket[PWSTATS_BUCKETS];
+    } phase[PWSTATS_PHASES];
+} __attribute__((aligned(64)));
+
+struct pwstats {
+    uint32_t magic, slots;
+    char scheme[32];
+    uint64_t started;
+    int64_t waiting;			/* checks waiting for a turn now */
+    uint64_t bound[PWSTATS_BUCKETS];	/* nanoseconds, last is infinite */
+    struct pwstats_slot slot[PWSTATS_SLOTS];
+};
+
+/* Logging of slow checks, at most rate messages a minute. */
+
+struct pwslow {
+    long threshold;			/* milliseconds, 0: don't log */
+    long rate;
+    time_t minute;
+    long logged, dropped;
+    pthread_mutex_t lock;
+};
+
+#define PWSLOW_DEFAULT	{ 0, 10, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER }
+
+extern struct pwstats *pwstats_create(const char *, const struct berval *);
+extern int64_t pwstats_clock(void);
+extern int64_t pwstats_begin(struct pwstats *, struct pwslow *);
+extern void pwstats_add(int, int64_t);
+extern void pwstats_error(long);
+extern void pwstats_waiting(int);
+extern void pwstats_rejected(void);
+extern int64_t pwstats_end(int64_t, int);
+extern void pwstats_slow(struct pwslow *, const struct berval *,
+    const struct berval *, int64_t, int);
@@ -0,0 +1,227 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <lber.h>
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#include "throttle.h"
+
+/*
+ *  The tracker is a fixed-size open-addressing table updated with atomic
+ *  compare-and-swap only, so checks never take a lock. Each slot holds a
+ *  64-bit tag identifying the key and a 64-bit state packing the tokens
+ *  left (in thousandths, high half) with the time of the last update (in
+ *  milliseconds, low half, compared modulo 2^32).
+ */
+
+#define PROBES	8
+#define UNIT	1000
+
+struct slot {
+    uint64_t tag;
+    uint64_t state;
+};
+
+struct throttle {
+    struct slot *slot;
+    uint64_t mask;
+    uint64_t burst;
+    uint64_t rate;
+    unsigned char seed[16];
+    unsigned long throttled;
+};
+
+/* Each thread's context for deriving tags (see throttle_key()). */
+
+static pthread_key_t context;
+static pthread_once_t contexts = PTHREAD_ONCE_INIT;
+static int keyed = 0;
+
+static void context_free(void *x) {
+    EVP_MD_CTX_free(x);
+}
+
+static void context_init(void) {
+    keyed = (pthread_key_create(&context, context_free) == 0);
+}
+
+static uint32_t now(void) {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return((uint32_t)((t.tv_sec * 1000) + (t.tv_nsec / 1000000)));
+}
+
+/*
+ *  Create a tracker for up to size keys. Each key may fail burst times
+ *  in a row before it is throttled, and is forgiven rate failures per
+ *  minute. Returns NULL if out of memory.
+ */
+
+struct throttle *throttle_create(long size, long burst, long rate) {
+    struct throttle *t;
+    uint64_t n;
+
+    if ((t = calloc(1, sizeof(*t))) == NULL) return(NULL);
+
+    for (n = 1; n < size; n <<= 1);
+
+    if ((t->slot = calloc(n, sizeof(struct slot))) == NULL) {
+	free(t);
+	return(NULL);
+    }
+
+    t->mask = n - 1;
+    t->burst = burst * UNIT;
+    t->rate = rate;
+
+    if (RAND_bytes(t->seed, sizeof(t->seed)) <= 0) {
+	free(t->slot);
+	free(t);
+	return(NULL);
+    }
+
+    return(t);
+}
+
+/*
+ *  Derive the tag of a stored value or principal, with a context kept by
+ *  the calling thread. Returns 0 if the tag could not be derived; the
+ *  caller should then do without the throttle.
+ */
+
+uint64_t throttle_key(struct throttle *t, const struct berval *v) {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int n;
+    EVP_MD_CTX *x;
+    uint64_t key;
+
+    pthread_once(&contexts, context_init);
+
+    if (keyed == 0) return(0);
+
+    if ((x = pthread_getspecific(context)) == NULL) {
+	if ((x = EVP_MD_CTX_new()) == NULL) return(0);
+
+	if (pthread_setspecific(context, x) != 0) {
+	    EVP_MD_CTX_free(x);
+	    return(0);
+	}
+    }
+
+    if (!EVP_DigestInit_ex(x, EVP_sha256(), NULL) ||
+	!EVP_DigestUpdate(x, t->seed, sizeof(t->seed)) ||
+	!EVP_DigestUpdate(x, v->bv_val, v->bv_len) ||
+	!EVP_DigestFinal_ex(x, digest, &n)) {
+	return(0);
+    }
+
+    memcpy(&key, digest, sizeof(key));
+
+    return((key) ? key : 1);
+}
+
+/* Tokens in a state once refilled up to time m. */
+
+static uint64_t tokens(struct throttle *t, uint64_t state, uint32_t m) {
+    uint64_t n = state >> 32;
+
+    n += ((uint64_t)(uint32_t)(m - (uint32_t)state) * t->rate * UNIT) / 60000;
+
+    return((n > t->burst) ? t->burst : n);
+}
+
+/*
+ *  Find the slot for a key. If claim is set and the key is not present,
+ *  take an empty slot, or else one whose bucket is full again (an idle
+ *  key), and give it a full bucket once its tag is ours; a slot lost to
+ *  another key is left alone. Returns NULL if there is no slot for the
+ *  key.
+ */
+
+static struct slot *lookup(struct throttle *t, uint64_t key, int claim) {
+    uint64_t state, tag;
+    struct slot *s;
+    uint32_t m;
+    int n;
+
+    for (n = 0; n < PROBES; n += 1) {
+	s = &t->slot[(key + n) & t->mask];
+
+	if ((tag = __atomic_load_n(&s->tag, __ATOMIC_ACQUIRE)) == key) {
+	    return(s);
+	}
+
+	if ((tag == 0) && (claim == 0)) return(NULL);
+    }
+
+    if (claim == 0) return(NULL);
+
+    for (n = 0; n < PROBES; n += 1) {
+	s = &t->slot[(key + n) & t->mask];
+
+	tag = __atomic_load_n(&s->tag, __ATOMIC_ACQUIRE);
+	state = __atomic_load_n(&s->state, __ATOMIC_RELAXED);
+
+	m = now();
+
+	if ((tag != 0) && (tokens(t, state, m) < t->burst)) continue;
+
+	if (__atomic_compare_exchange_n(&s->tag, &tag, key, 0,
+	    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+	    __atomic_store_n(&s->state, (t->burst << 32) | m,
+		__ATOMIC_RELEASE);
+	    return(s);
+	}
+
+	if (tag == key) return(s);
+    }
+
+    return(NULL);
+}
+
+/*
+ *  Returns 1 (and counts the attempt) if a key has run out of tokens and
+ *  should be rejected without verifying it, otherwise 0.
+ */
+
+int throttle_check(struct throttle *t, uint64_t key) {
+    struct slot *s;
+
+    if ((s = lookup(t, key, 0)) == NULL) return(0);
+
+    if (tokens(t, __atomic_load_n(&s->state, __ATOMIC_RELAXED), now())
+	>= UNIT) return(0);
+
+    __sync_fetch_and_add(&t->throttled, 1);
+
+    return(1);
+}
+
+/* Record a failed check: take one token from the key's bucket. */
+
+void throttle_fail(struct throttle *t, uint64_t key) {
+    uint64_t state, n;
+    struct slot *s;
+    uint32_t m;
+
+    if ((s = lookup(t, key, 1)) == NULL) return;
+
+    state = __atomic_load_n(&s->state, __ATOMIC_RELAXED);
+
+    do {
+	m = now();
+	n = tokens(t, state, m);
+	n = (n >= UNIT) ? n - UNIT : 0;
+    } while (!__atomic_compare_exchange_n(&s->state, &state, (n << 32) | m,
+	0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void throttle_stats(struct throttle *t, unsigned long *throttled) {
+    *throttled = __sync_fetch_and_add(&t->throttled, 0);
+}
@@ -0,0 +1,15 @@
+/*
+ *  Failure throttling shared by the password modules. Each stored value
+ *  or principal gets a token bucket; failed checks take tokens out and
+ *  time puts them back. Requires <lber.h> for struct berval.
+ */
+
+#include <stdint.h>
+
+struct throttle;
+
+extern struct throttle *throttle_create(long, long, long);
+extern uint64_t throttle_key(struct throttle *, const struct berval *);
+extern int throttle_check(struct throttle *, uint64_t);
+extern void throttle_fail(struct throttle *, uint64_t);
+extern void throttle_stats(struct throttle *, unsigned long *);